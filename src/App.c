@@ -9,7 +9,20 @@
 #include "DB.h"
 #include "mgos.h"
 #include "mgos_hap.h"
+#include "mgos_rpc.h"
 #include "mgos_twinkly.h"
+#include "tw_adk.h"
+#include "tw_client.h"
+#include "common/cs_crc32.h"
+#include "tw_poll.h"
+#include "tw_queue.h"
+#include "tw_sched.h"
+#include "tw_bench.h"
+#include "tw_heap.h"
+#include "tw_kv.h"
+#include "tw_log.h"
+#include "tw_stats.h"
+#include "tw_trace.h"
 #include "HAPAccessoryServer+Internal.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -28,6 +41,13 @@
  */
 #define kAppKeyValueStoreKey_Configuration_State ((HAPPlatformKeyValueStoreDomain) 0x00)
 
+/**
+ * Key used in the key value store to remember if the "All Twinkly" service is advertised, a change needs a new CN.
+ *
+ * Purged: On factory reset.
+ */
+#define kAppKeyValueStoreKey_Configuration_Master ((HAPPlatformKeyValueStoreDomain) 0x01)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 bool requestedServerRestart = false;
@@ -42,10 +62,43 @@ typedef struct {
     int brightness;
 } tw_state_t;
 
+/**
+ * State shadow: what the devices reported, which hub commands are still unconfirmed and how fresh each
+ * characteristic value is. Not persisted.
+ */
+typedef struct {
+    bool on_reported;
+    bool on;
+    bool brightness_reported;
+    int brightness;
+    int64_t on_pending_until; // reports contradicting the hub command before this are stale
+    int64_t brightness_pending_until;
+    bool on_sent; // value of the unconfirmed hub command
+    int brightness_sent;
+    uint32_t on_version; // bumped on every change of the value
+    uint32_t brightness_version;
+    int64_t on_confirmed; // last time the device confirmed the value
+    int64_t brightness_confirmed;
+    bool on_desired; // tw_state value not applied, the device was unreachable; replayed when it is back
+    bool brightness_desired;
+    // Change made elsewhere (Twinkly app, remote) the device reported, not stored and announced yet
+    bool ext_on_pending;
+    bool ext_on;
+    bool ext_brightness_pending;
+    int ext_brightness;
+    uint32_t ext_on_version; // *_version when reported, a hub command since supersedes the change
+    uint32_t ext_brightness_version;
+    int64_t ext_first;             // first report of the pending change
+    int64_t ext_brightness_moved;  // last report of a different brightness
+    int64_t ext_announced;         // last external change announced
+} tw_runtime_t;
+
 typedef struct {
     struct {
-        tw_state_t tw_state[MAX_TWINKLY_DEVICES];
+        tw_state_t* tw_state;
     } state;
+    tw_runtime_t* tw_runtime;
+    size_t numDevices; // entries in the arrays above, follows the device list
     HAPAccessoryServerRef* server;
     HAPPlatformKeyValueStoreRef keyValueStore;
 } AccessoryConfiguration;
@@ -53,6 +106,163 @@ typedef struct {
 static AccessoryConfiguration accessoryConfiguration;
 //----------------------------------------------------------------------------------------------------------------------
 
+/**
+ * Size per-device state to `count` devices. New entries start zeroed.
+ */
+static void ResizeDeviceState(size_t count) {
+    size_t old = accessoryConfiguration.numDevices;
+    if (count > MAX_TWINKLY_DEVICES)
+        count = MAX_TWINKLY_DEVICES;
+    if (count == old)
+        return;
+    tw_heap_mark_t mark;
+    tw_heap_op_begin(&mark, TW_HEAP_OP_RESIZE);
+    if (count == 0) {
+        tw_heap_free(accessoryConfiguration.state.tw_state);
+        tw_heap_free(accessoryConfiguration.tw_runtime);
+        accessoryConfiguration.state.tw_state = NULL;
+        accessoryConfiguration.tw_runtime = NULL;
+        accessoryConfiguration.numDevices = 0;
+        tw_heap_op_end(&mark);
+        return;
+    }
+    tw_state_t* state =
+            tw_heap_realloc(TW_HEAP_STATE, accessoryConfiguration.state.tw_state, count * sizeof(tw_state_t));
+    if (state)
+        accessoryConfiguration.state.tw_state = state;
+    tw_runtime_t* runtime =
+            tw_heap_realloc(TW_HEAP_STATE, accessoryConfiguration.tw_runtime, count * sizeof(tw_runtime_t));
+    if (runtime)
+        accessoryConfiguration.tw_runtime = runtime;
+    HAPAssert(state && runtime);
+    if (count > old) {
+        HAPRawBufferZero(&state[old], (count - old) * sizeof(tw_state_t));
+        HAPRawBufferZero(&runtime[old], (count - old) * sizeof(tw_runtime_t));
+    }
+    accessoryConfiguration.numDevices = count;
+    tw_heap_op_end(&mark);
+    LOG(LL_DEBUG, ("Device state sized for %u devices", (unsigned) count));
+}
+
+/**
+ * Drop the state of a removed device, the ones after it move down by one like in the device list.
+ */
+static void RemoveDeviceState(size_t index) {
+    size_t count = accessoryConfiguration.numDevices;
+    if (index >= count)
+        return;
+    memmove(&accessoryConfiguration.state.tw_state[index],
+            &accessoryConfiguration.state.tw_state[index + 1],
+            (count - index - 1) * sizeof(tw_state_t));
+    memmove(&accessoryConfiguration.tw_runtime[index],
+            &accessoryConfiguration.tw_runtime[index + 1],
+            (count - index - 1) * sizeof(tw_runtime_t));
+    ResizeDeviceState(count - 1);
+}
+
+/**
+ * Persistent state format.
+ *
+ * Header: magic (4), format version (1), record size (1), record count (2), header CRC (2).
+ * Record: flags (1), brightness (1), record CRC (2). All values are little endian. CRCs are the lower half of CRC-32.
+ *
+ * Newer formats may only append fields to a record, so readers decode the prefix they know and skip the rest.
+ * A bad record is reset on its own without discarding its neighbours.
+ */
+#define kAppState_Magic      ((uint32_t) 0x54535754) // "TWST"
+#define kAppState_Version    ((uint8_t) 1)
+#define kAppState_HeaderSize ((size_t) 10)
+#define kAppState_RecordSize ((size_t) 4)
+
+#define kAppState_SaveRetryMs 5000 // after a failed save, the state is kept in RAM until then
+
+#define kAppState_FlagOnline ((uint8_t) 1 << 0)
+#define kAppState_FlagOn     ((uint8_t) 1 << 1)
+
+/**
+ * Unversioned state written by firmware up to 1.0.4: a raw tw_state_t array.
+ */
+typedef struct {
+    bool online;
+    bool on;
+    int brightness;
+} tw_state_v0_t;
+
+static uint16_t StateCRC(const uint8_t* bytes, size_t numBytes) {
+    return (uint16_t) cs_crc32(0, bytes, numBytes);
+}
+
+static size_t EncodeAccessoryState(uint8_t* bytes, size_t maxBytes) {
+    size_t count = accessoryConfiguration.numDevices;
+    HAPAssert(maxBytes >= kAppState_HeaderSize + count * kAppState_RecordSize);
+
+    HAPWriteLittleUInt32(&bytes[0], kAppState_Magic);
+    bytes[4] = kAppState_Version;
+    bytes[5] = kAppState_RecordSize;
+    HAPWriteLittleUInt16(&bytes[6], count);
+    HAPWriteLittleUInt16(&bytes[8], StateCRC(bytes, 8));
+    uint8_t* record = &bytes[kAppState_HeaderSize];
+    for (size_t i = 0; i < count; i++, record += kAppState_RecordSize) {
+        const tw_state_t* st = &accessoryConfiguration.state.tw_state[i];
+        record[0] = (st->online ? kAppState_FlagOnline : 0) | (st->on ? kAppState_FlagOn : 0);
+        record[1] = (uint8_t) st->brightness;
+        HAPWriteLittleUInt16(&record[2], StateCRC(record, 2));
+    }
+    return (size_t)(record - bytes);
+}
+
+static bool DecodeAccessoryState(const uint8_t* bytes, size_t numBytes) {
+    if (numBytes < kAppState_HeaderSize || HAPReadLittleUInt32(&bytes[0]) != kAppState_Magic)
+        return false;
+    if (HAPReadLittleUInt16(&bytes[8]) != StateCRC(bytes, 8)) {
+        HAPLogError(&kHAPLog_Default, "App state header is corrupted.");
+        return false;
+    }
+    uint8_t version = bytes[4];
+    size_t recordSize = bytes[5];
+    size_t count = HAPReadLittleUInt16(&bytes[6]);
+    if (recordSize < 3) {
+        HAPLogError(&kHAPLog_Default, "App state record size %u is invalid.", (unsigned) recordSize);
+        return false;
+    }
+    if (version > kAppState_Version) {
+        HAPLogInfo(&kHAPLog_Default, "App state format %u is newer, reading known fields.", version);
+    }
+    const uint8_t* record = &bytes[kAppState_HeaderSize];
+    for (size_t i = 0; i < count && i < accessoryConfiguration.numDevices; i++, record += recordSize) {
+        if (record + recordSize > bytes + numBytes)
+            break;
+        size_t payloadSize = recordSize - 2;
+        if (HAPReadLittleUInt16(&record[payloadSize]) != StateCRC(record, payloadSize)) {
+            HAPLogError(&kHAPLog_Default, "App state record %u is corrupted, resetting it.", (unsigned) i);
+            continue;
+        }
+        tw_state_t* st = &accessoryConfiguration.state.tw_state[i];
+        st->online = record[0] & kAppState_FlagOnline;
+        st->on = record[0] & kAppState_FlagOn;
+        if (payloadSize >= 2)
+            st->brightness = record[1];
+    }
+    return true;
+}
+
+static bool MigrateAccessoryStateV0(const uint8_t* bytes, size_t numBytes) {
+    if (numBytes == 0 || numBytes % sizeof(tw_state_v0_t) != 0)
+        return false;
+    const tw_state_v0_t* old = (const tw_state_v0_t*) bytes;
+    size_t count = numBytes / sizeof(tw_state_v0_t);
+    for (size_t i = 0; i < count && i < accessoryConfiguration.numDevices; i++) {
+        tw_state_t* st = &accessoryConfiguration.state.tw_state[i];
+        st->online = old[i].online;
+        st->on = old[i].on;
+        st->brightness = old[i].brightness;
+    }
+    HAPLogInfo(&kHAPLog_Default, "Migrated app state of %u devices from unversioned format.", (unsigned) count);
+    return true;
+}
+
+static void SaveAccessoryState(void);
+
 /**
  * Load the accessory state from persistent memory.
  */
@@ -64,48 +274,249 @@ static void LoadAccessoryState(void) {
     // Load persistent state if available
     bool found;
     size_t numBytes;
+    // Large enough for the unversioned format too
+    size_t maxBytes = MAX_TWINKLY_DEVICES * sizeof(tw_state_v0_t) + kAppState_HeaderSize;
+    uint8_t* bytes = tw_heap_calloc(TW_HEAP_SCRATCH, 1, maxBytes);
+    HAPAssert(bytes);
 
-    err = HAPPlatformKeyValueStoreGet(
-            accessoryConfiguration.keyValueStore,
+    HAPRawBufferZero(accessoryConfiguration.state.tw_state, accessoryConfiguration.numDevices * sizeof(tw_state_t));
+    err = tw_kv_get(
             kAppKeyValueStoreDomain_Configuration,
             kAppKeyValueStoreKey_Configuration_State,
-            &accessoryConfiguration.state,
-            sizeof accessoryConfiguration.state,
+            bytes,
+            maxBytes,
             &numBytes,
             &found);
-
     if (err) {
         HAPAssert(err == kHAPError_Unknown);
         HAPFatalError();
     }
-    if (!found || numBytes != sizeof accessoryConfiguration.state) {
-        if (found) {
+    // Firmware before the state store kept it in the HomeKit key-value store
+    bool legacy = false;
+    if (!found) {
+        err = HAPPlatformKeyValueStoreGet(
+                accessoryConfiguration.keyValueStore,
+                kAppKeyValueStoreDomain_Configuration,
+                kAppKeyValueStoreKey_Configuration_State,
+                bytes,
+                maxBytes,
+                &numBytes,
+                &legacy);
+        if (err) {
+            HAPAssert(err == kHAPError_Unknown);
+            HAPFatalError();
+        }
+        found = legacy;
+    }
+    if (found && !DecodeAccessoryState(bytes, numBytes)) {
+        if (MigrateAccessoryStateV0(bytes, numBytes)) {
+            SaveAccessoryState();
+        } else {
             HAPLogError(
                     &kHAPLog_Default,
                     "Unexpected app state found in key-value store. Resetting to "
                     "default.");
+            HAPRawBufferZero(
+                    accessoryConfiguration.state.tw_state, accessoryConfiguration.numDevices * sizeof(tw_state_t));
         }
-        HAPRawBufferZero(&accessoryConfiguration.state, sizeof accessoryConfiguration.state);
     }
+    if (legacy) {
+        SaveAccessoryState(); // no flash write if the migration above saved it already
+        err = HAPPlatformKeyValueStoreRemove(
+                accessoryConfiguration.keyValueStore,
+                kAppKeyValueStoreDomain_Configuration,
+                kAppKeyValueStoreKey_Configuration_State);
+        if (err)
+            HAPLogError(&kHAPLog_Default, "Old app state could not be removed, the state store copy is used.");
+        else
+            HAPLogInfo(&kHAPLog_Default, "App state moved to the state store.");
+    }
+    tw_heap_free(bytes);
+}
+
+#if TW_HEAP_TRACK
+/* Set while Hub.Heap.Test has made up devices in the state, which must never reach flash */
+static bool heapTestRunning;
+#endif
+
+static mgos_timer_id saveRetryTimer = MGOS_INVALID_TIMER_ID;
+
+static void SaveAccessoryState(void);
+
+static void SaveRetryTimerCallback(void* arg HAP_UNUSED) {
+    saveRetryTimer = MGOS_INVALID_TIMER_ID;
+    SaveAccessoryState();
 }
 
 /**
- * Save the accessory state to persistent memory.
+ * Save the accessory state to persistent memory. If the store can't take it, the state in RAM stays in charge and
+ * the save is tried again later, the next change saves it too.
  */
 static void SaveAccessoryState(void) {
     HAPPrecondition(accessoryConfiguration.keyValueStore);
 
+    size_t maxBytes = kAppState_HeaderSize + accessoryConfiguration.numDevices * kAppState_RecordSize;
+    uint8_t* bytes = tw_heap_calloc(TW_HEAP_SCRATCH, 1, maxBytes);
+    HAPAssert(bytes);
+    size_t numBytes = EncodeAccessoryState(bytes, maxBytes);
+#if TW_HEAP_TRACK
+    if (heapTestRunning) {
+        tw_heap_free(bytes);
+        return;
+    }
+#endif
+
     HAPError err;
-    err = HAPPlatformKeyValueStoreSet(
-            accessoryConfiguration.keyValueStore,
+    err = tw_kv_set(
             kAppKeyValueStoreDomain_Configuration,
             kAppKeyValueStoreKey_Configuration_State,
-            &accessoryConfiguration.state,
-            sizeof accessoryConfiguration.state);
+            bytes,
+            numBytes);
+    tw_heap_free(bytes);
     if (err) {
-        HAPAssert(err == kHAPError_Unknown);
-        HAPFatalError();
+        LOG(LL_ERROR, ("Saving accessory state failed: %d, retrying in %d ms", err, kAppState_SaveRetryMs));
+        if (saveRetryTimer == MGOS_INVALID_TIMER_ID)
+            saveRetryTimer = mgos_set_timer(kAppState_SaveRetryMs, 0, SaveRetryTimerCallback, NULL);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int64_t NowMs(void) {
+    return mgos_uptime_micros() / 1000;
+}
+
+/**
+ * A command the device did not take leaves the reported value in charge again.
+ */
+static void ModeCommandCallback(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    if (!ok && index >= 0 && index < (int) accessoryConfiguration.numDevices) {
+        LOG(LL_WARN, ("Twinkly %d mode command %s", index, status ? "failed" : "cancelled"));
+        accessoryConfiguration.tw_runtime[index].on_pending_until = 0;
+        // Most likely the device went away, try again once it is back
+        if (status)
+            accessoryConfiguration.tw_runtime[index].on_desired = true;
+    }
+    (void) arg;
+}
+
+static void BrightnessCommandCallback(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    if (!ok && index >= 0 && index < (int) accessoryConfiguration.numDevices) {
+        LOG(LL_WARN, ("Twinkly %d brightness command %s", index, status ? "failed" : "cancelled"));
+        accessoryConfiguration.tw_runtime[index].brightness_pending_until = 0;
+        if (status)
+            accessoryConfiguration.tw_runtime[index].brightness_desired = true;
+    }
+    (void) arg;
+}
+
+static void ReplayCommandCallback(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    intptr_t what = (intptr_t) arg;
+    if (what & 1)
+        ModeCommandCallback(index, ok, status, NULL);
+    if (what & 2)
+        BrightnessCommandCallback(index, ok, status, NULL);
+}
+
+/**
+ * Apply what HomeKit asked for while the device was unreachable, as one command with the latest values.
+ */
+static void ReplayDesiredState(int index) {
+    tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[index];
+    const tw_state_t* st = &accessoryConfiguration.state.tw_state[index];
+    if (!rt->on_desired && !rt->brightness_desired)
+        return;
+    int64_t until = NowMs() + mgos_sys_config_get_app_confirm_ms();
+    int on = rt->on_desired ? st->on : -1;
+    int brightness = rt->brightness_desired ? st->brightness : -1;
+    intptr_t what = (rt->on_desired ? 1 : 0) | (rt->brightness_desired ? 2 : 0);
+    LOG(LL_INFO, ("Twinkly %d is back, applying mode %d, brightness %d", index, on, brightness));
+    if (rt->on_desired) {
+        rt->on_pending_until = until;
+        rt->on_sent = st->on;
+    }
+    if (rt->brightness_desired) {
+        rt->brightness_pending_until = until;
+        rt->brightness_sent = st->brightness;
+    }
+    rt->on_desired = rt->brightness_desired = false;
+    tw_stats_count(TW_CNT_CMD_REPLAYED);
+    tw_queue_set_state(index, on, brightness, TW_PRIO_RECONCILE, ReplayCommandCallback, (void*) what);
+    tw_poll_touch(index);
+}
+
+/**
+ * True if the device already has the value or is about to get it from an earlier command: sending it changes nothing.
+ */
+static bool ModeIsRedundant(const tw_runtime_t* rt, bool value, int64_t now) {
+    if (now < rt->on_pending_until)
+        return rt->on_sent == value;
+    return rt->on_reported && rt->on == value;
+}
+
+static bool BrightnessIsRedundant(const tw_runtime_t* rt, int value, int64_t now) {
+    if (now < rt->brightness_pending_until)
+        return rt->brightness_sent == value;
+    return rt->brightness_reported && rt->brightness == value;
+}
+
+/**
+ * Send the mode to the device, unless it has already reported that very value.
+ */
+static void SendModeCommand(int index, bool value) {
+    tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[index];
+    int64_t now = NowMs();
+    if (!accessoryConfiguration.state.tw_state[index].online) {
+        rt->on_desired = true;
+        tw_stats_count(TW_CNT_CMD_DEFERRED);
+        return;
+    }
+    if (rt->on_reported && rt->on == value && now >= rt->on_pending_until) {
+        tw_stats_count(TW_CNT_CMD_SUPPRESSED);
+        return;
     }
+    tw_stats_count(TW_CNT_CMD_SENT);
+    if (ModeIsRedundant(rt, value, now))
+        tw_stats_count(TW_CNT_CMD_REDUNDANT);
+    rt->on_pending_until = now + mgos_sys_config_get_app_confirm_ms();
+    rt->on_sent = value;
+    tw_queue_set_mode(index, value, TW_PRIO_INTERACTIVE, ModeCommandCallback, NULL);
+    tw_poll_touch(index);
+}
+
+/**
+ * Send the brightness to the device, unless it has already reported that very value.
+ */
+static void SendBrightnessCommand(int index, int value) {
+    tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[index];
+    int64_t now = NowMs();
+    if (!accessoryConfiguration.state.tw_state[index].online) {
+        rt->brightness_desired = true;
+        tw_stats_count(TW_CNT_CMD_DEFERRED);
+        return;
+    }
+    if (rt->brightness_reported && rt->brightness == value && now >= rt->brightness_pending_until) {
+        tw_stats_count(TW_CNT_CMD_SUPPRESSED);
+        return;
+    }
+    tw_stats_count(TW_CNT_CMD_SENT);
+    if (BrightnessIsRedundant(rt, value, now))
+        tw_stats_count(TW_CNT_CMD_REDUNDANT);
+    rt->brightness_pending_until = now + mgos_sys_config_get_app_confirm_ms();
+    rt->brightness_sent = value;
+    tw_queue_set_brightness(index, value, TW_PRIO_INTERACTIVE, BrightnessCommandCallback, NULL);
+    tw_poll_touch(index);
+}
+
+/**
+ * Schedule a background refresh of the device if the value is older than the freshness budget.
+ */
+static void CheckFreshness(int index, int64_t confirmed) {
+    int64_t seen = tw_poll_last_seen_ms(index);
+    if (seen > confirmed)
+        confirmed = seen;
+    if (NowMs() - confirmed > mgos_sys_config_get_app_fresh_ms())
+        tw_poll_refresh(index);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -134,11 +545,60 @@ static HAPAccessory accessory = { .aid = 1,
 //----------------------------------------------------------------------------------------------------------------------
 
 void AccessoryNotification(const HAPService* service, const HAPCharacteristic* characteristic) {
-    HAPLogInfo(&kHAPLog_Default, "Accessory Notification");
+    int index = (int) (service->iid >> kIID_PoolBitsize);
+    TW_LOG(HAP, LL_INFO, TW_MSG_HAP_NOTIFY, index, (int32_t) (service->iid & (kIID_PoolSize - 1)));
+    TW_TRACE_INSTANT("hap.event", index + 1, 0);
 
     HAPAccessoryServerRaiseEvent(accessoryConfiguration.server, characteristic, service, &accessory);
 }
 
+/* "All Twinkly" values last announced to controllers */
+static struct {
+    bool on;
+    int brightness;
+} masterAnnounced;
+
+static bool MasterOn(void) {
+    for (size_t i = 0; i < accessoryConfiguration.numDevices; i++) {
+        if (accessoryConfiguration.state.tw_state[i].on)
+            return true;
+    }
+    return false;
+}
+
+/* Brightest device that is on, or of all if none is */
+static int MasterBrightness(void) {
+    bool anyOn = MasterOn();
+    int brightness = 0;
+    for (size_t i = 0; i < accessoryConfiguration.numDevices; i++) {
+        const tw_state_t* st = &accessoryConfiguration.state.tw_state[i];
+        if ((st->on || !anyOn) && st->brightness > brightness)
+            brightness = st->brightness;
+    }
+    return brightness;
+}
+
+/**
+ * Announce the "All Twinkly" values if a device change moved them.
+ */
+static void UpdateMaster(void) {
+    if (!mgos_sys_config_get_app_group_master())
+        return;
+    bool running = HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running;
+    bool on = MasterOn();
+    int brightness = MasterBrightness();
+    if (on != masterAnnounced.on) {
+        masterAnnounced.on = on;
+        if (running)
+            AccessoryNotification(&masterLightBulbService, masterLightBulbService.characteristics[1]);
+    }
+    if (brightness != masterAnnounced.brightness) {
+        masterAnnounced.brightness = brightness;
+        if (running)
+            AccessoryNotification(&masterLightBulbService, masterLightBulbService.characteristics[2]);
+    }
+}
+
 static void identify_timer_cb(void* arg) {
     mgos_gpio_blink(mgos_sys_config_get_pins_led(), 0, 0);
     mgos_gpio_write(mgos_sys_config_get_pins_led(), LED_OFF);
@@ -156,16 +616,38 @@ HAPError IdentifyAccessory(
     return kHAPError_None;
 }
 
+/* Restart time measurement: from the restart until the first controller request */
+static int64_t restartStarted = 0;
+static bool restartWarm = false;
+
+static void NoteControllerRequest(void) {
+    if (restartStarted == 0)
+        return;
+    int64_t took = mgos_uptime_micros() - restartStarted;
+    restartStarted = 0;
+    LOG(LL_INFO,
+        ("%s restart: controllers back after %lld ms", restartWarm ? "Warm" : "Cold", (long long) (took / 1000)));
+    tw_stats_record(restartWarm ? TW_STAT_RESTART_WARM : TW_STAT_RESTART_COLD, took, true);
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleLightBulbOnRead(
         HAPAccessoryServerRef* server HAP_UNUSED,
         const HAPBoolCharacteristicReadRequest* request HAP_UNUSED,
         bool* value,
         void* _Nullable context HAP_UNUSED) {
+    int64_t started = mgos_uptime_micros();
     int index = request->characteristic->iid >> kIID_PoolBitsize;
+    if (index >= (int) accessoryConfiguration.numDevices)
+        return kHAPError_InvalidState; // device list changed, the server is restarting
+    NoteControllerRequest();
+    TW_TRACE_BEGIN("hap.read.on", index + 1);
     *value = accessoryConfiguration.state.tw_state[index].on;
-    HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, *value ? "true" : "false");
+    CheckFreshness(index, accessoryConfiguration.tw_runtime[index].on_confirmed);
+    TW_LOG(HAP, LL_INFO, TW_MSG_HAP_ON_READ, index, *value);
 
+    TW_TRACE_END("hap.read.on", index + 1, *value);
+    tw_stats_record(TW_STAT_HAP_READ, mgos_uptime_micros() - started, true);
     return kHAPError_None;
 }
 
@@ -175,18 +657,27 @@ HAPError HandleLightBulbOnWrite(
         const HAPBoolCharacteristicWriteRequest* request,
         bool value,
         void* _Nullable context HAP_UNUSED) {
-    HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, value ? "true" : "false");
+    int64_t started = mgos_uptime_micros();
     int index = request->characteristic->iid >> kIID_PoolBitsize;
+    if (index >= (int) accessoryConfiguration.numDevices)
+        return kHAPError_InvalidState; // device list changed, the server is restarting
+    NoteControllerRequest();
+    TW_LOG(HAP, LL_INFO, TW_MSG_HAP_ON_WRITE, index, value);
+    TW_TRACE_BEGIN("hap.write.on", index + 1);
     if (accessoryConfiguration.state.tw_state[index].on != value) {
         accessoryConfiguration.state.tw_state[index].on = value;
+        accessoryConfiguration.tw_runtime[index].on_version++;
 
-        mgos_twinkly_set_mode(index, value);
+        SendModeCommand(index, value);
 
         SaveAccessoryState();
 
         HAPAccessoryServerRaiseEvent(server, request->characteristic, request->service, request->accessory);
+        UpdateMaster();
     }
 
+    TW_TRACE_END("hap.write.on", index + 1, value);
+    tw_stats_record(TW_STAT_HAP_WRITE, mgos_uptime_micros() - started, true);
     return kHAPError_None;
 }
 
@@ -196,10 +687,18 @@ HAPError HandleLightBulbBrightnessRead(
         const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
         int32_t* value,
         void* _Nullable context HAP_UNUSED) {
+    int64_t started = mgos_uptime_micros();
     int index = request->characteristic->iid >> kIID_PoolBitsize;
+    if (index >= (int) accessoryConfiguration.numDevices)
+        return kHAPError_InvalidState; // device list changed, the server is restarting
+    NoteControllerRequest();
+    TW_TRACE_BEGIN("hap.read.brightness", index + 1);
     *value = accessoryConfiguration.state.tw_state[index].brightness;
-    HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long) *value);
+    CheckFreshness(index, accessoryConfiguration.tw_runtime[index].brightness_confirmed);
+    TW_LOG(HAP, LL_INFO, TW_MSG_HAP_BRIGHTNESS_READ, index, *value);
 
+    TW_TRACE_END("hap.read.brightness", index + 1, *value);
+    tw_stats_record(TW_STAT_HAP_READ, mgos_uptime_micros() - started, true);
     return kHAPError_None;
 }
 
@@ -209,22 +708,291 @@ HAPError HandleLightBulbBrightnessWrite(
         const HAPIntCharacteristicWriteRequest* request,
         int32_t value,
         void* _Nullable context HAP_UNUSED) {
-    HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long) value);
+    int64_t started = mgos_uptime_micros();
     int index = request->characteristic->iid >> kIID_PoolBitsize;
+    if (index >= (int) accessoryConfiguration.numDevices)
+        return kHAPError_InvalidState; // device list changed, the server is restarting
+    NoteControllerRequest();
+    TW_LOG(HAP, LL_INFO, TW_MSG_HAP_BRIGHTNESS_WRITE, index, value);
+    TW_TRACE_BEGIN("hap.write.brightness", index + 1);
 
     if (accessoryConfiguration.state.tw_state[index].brightness != value) {
         accessoryConfiguration.state.tw_state[index].brightness = value;
+        accessoryConfiguration.tw_runtime[index].brightness_version++;
 
-        mgos_twinkly_set_brightness(index, value);
+        SendBrightnessCommand(index, value);
 
         SaveAccessoryState();
 
         HAPAccessoryServerRaiseEvent(server, request->characteristic, request->service, request->accessory);
+        UpdateMaster();
     }
 
+    TW_TRACE_END("hap.write.brightness", index + 1, value);
+    tw_stats_record(TW_STAT_HAP_WRITE, mgos_uptime_micros() - started, true);
     return kHAPError_None;
 }
 
+/**
+ * Group commands: one command fanned out to several devices, app.group.concurrency of them at a time, with the state
+ * saved once and a single report with the outcome and time of every device.
+ */
+typedef enum {
+    kGroupResult_Unchanged, // the device already has the value
+    kGroupResult_Deferred,  // device offline, applied when it is back
+    kGroupResult_Queued,
+    kGroupResult_Running,
+    kGroupResult_Done,
+    kGroupResult_Failed,
+    kGroupResult_Cancelled,
+    kGroupResult_Max,
+} GroupResult;
+
+static const char* const groupResultNames[kGroupResult_Max] = {
+    "unchanged", "deferred", "queued", "running", "done", "failed", "cancelled"
+};
+
+typedef struct GroupJob GroupJob;
+
+typedef void (*GroupCallback)(const GroupJob* job, void* arg);
+
+typedef struct {
+    GroupJob* job;
+    uint8_t index;
+    uint8_t result;
+    int8_t on; // value sent, -1 if not
+    int8_t brightness;
+    int64_t started;
+    uint32_t tookUs;
+} GroupEntry;
+
+struct GroupJob {
+    int count;
+    int next; // entry to start next
+    int inflight;
+    bool submitting;
+    int64_t started;
+    GroupCallback cb;
+    void* arg;
+    GroupJob* nextJob;
+    GroupEntry entries[];
+};
+
+/* Jobs still running, their entries follow the device list */
+static GroupJob* groupJobs;
+
+static void GroupSubmit(GroupJob* job);
+
+/* Fields of the command, as ReplayCommandCallback takes them */
+static void* GroupEntryFields(const GroupEntry* e) {
+    return (void*) (intptr_t)((e->on >= 0 ? 1 : 0) | (e->brightness >= 0 ? 2 : 0));
+}
+
+static void GroupCommandCallback(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    GroupEntry* e = arg;
+    e->tookUs = mgos_uptime_micros() - e->started;
+    e->result = ok ? kGroupResult_Done : status ? kGroupResult_Failed : kGroupResult_Cancelled;
+    ReplayCommandCallback(index, ok, status, GroupEntryFields(e));
+    e->job->inflight--;
+    GroupSubmit(e->job);
+}
+
+static void GroupSubmit(GroupJob* job) {
+    int concurrency = mgos_sys_config_get_app_group_concurrency();
+    if (job->submitting)
+        return; // a command failed right away, the loop below goes on
+    job->submitting = true;
+    while (job->next < job->count && job->inflight < (concurrency > 0 ? concurrency : 1)) {
+        GroupEntry* e = &job->entries[job->next++];
+        if (e->result != kGroupResult_Queued)
+            continue;
+        e->result = kGroupResult_Running;
+        e->started = mgos_uptime_micros();
+        job->inflight++;
+        if (!tw_queue_set_state(e->index, e->on, e->brightness, TW_PRIO_INTERACTIVE, GroupCommandCallback, e)) {
+            job->inflight--;
+            e->result = kGroupResult_Failed;
+            ReplayCommandCallback(e->index, false, &(tw_client_status_t) {}, GroupEntryFields(e));
+        }
+    }
+    job->submitting = false;
+    if (job->inflight > 0 || job->next < job->count)
+        return;
+    LOG(LL_INFO,
+        ("Group command: %d devices in %lld ms",
+         job->count,
+         (long long) ((mgos_uptime_micros() - job->started) / 1000)));
+    if (job->cb)
+        job->cb(job, job->arg);
+    for (GroupJob** p = &groupJobs; *p; p = &(*p)->nextJob) {
+        if (*p == job) {
+            *p = job->nextJob;
+            break;
+        }
+    }
+    tw_heap_free(job);
+}
+
+/**
+ * A removed device moves the devices after it down by one: entries follow them like the queued commands do, and
+ * the removed device's entries that were not sent yet are cancelled.
+ */
+static void GroupRemoveDevice(int removed) {
+    for (GroupJob* job = groupJobs; job; job = job->nextJob) {
+        for (int i = 0; i < job->count; i++) {
+            GroupEntry* e = &job->entries[i];
+            if (e->index > removed)
+                e->index--;
+            else if (e->index == removed && e->result == kGroupResult_Queued)
+                e->result = kGroupResult_Cancelled;
+        }
+    }
+}
+
+/**
+ * Set `on` and/or `brightness` (-1 to leave as it is) on the devices, like a HomeKit write to each of them would.
+ */
+static bool GroupCommand(const int* indexes, int count, int on, int brightness, GroupCallback cb, void* arg) {
+    GroupJob* job = tw_heap_calloc(TW_HEAP_SCRATCH, 1, sizeof(GroupJob) + count * sizeof(GroupEntry));
+    if (job == NULL)
+        return false;
+    job->count = count;
+    job->started = mgos_uptime_micros();
+    job->cb = cb;
+    job->arg = arg;
+    job->nextJob = groupJobs;
+    groupJobs = job;
+    bool running = HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running;
+    bool changed = false;
+    int64_t now = NowMs();
+    int64_t until = now + mgos_sys_config_get_app_confirm_ms();
+    for (int i = 0; i < count; i++) {
+        int index = indexes[i];
+        GroupEntry* e = &job->entries[i];
+        tw_state_t* st = &accessoryConfiguration.state.tw_state[index];
+        tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[index];
+        e->job = job;
+        e->index = index;
+        e->on = e->brightness = -1;
+        if (on >= 0 && st->on != (bool) on) {
+            st->on = on;
+            rt->on_version++;
+            changed = true;
+            if (running)
+                AccessoryNotification(accessory.services[3 + index], accessory.services[3 + index]->characteristics[1]);
+        }
+        if (brightness >= 0 && st->brightness != brightness) {
+            st->brightness = brightness;
+            rt->brightness_version++;
+            changed = true;
+            if (running)
+                AccessoryNotification(accessory.services[3 + index], accessory.services[3 + index]->characteristics[2]);
+        }
+        // Same rules as SendModeCommand / SendBrightnessCommand
+        bool sendOn = on >= 0 && !(rt->on_reported && rt->on == (bool) on && now >= rt->on_pending_until);
+        bool sendBrightness = brightness >= 0 &&
+                              !(rt->brightness_reported && rt->brightness == brightness &&
+                                now >= rt->brightness_pending_until);
+        if (!sendOn && !sendBrightness) {
+            e->result = kGroupResult_Unchanged;
+            tw_stats_count(TW_CNT_CMD_SUPPRESSED);
+        } else if (!st->online) {
+            rt->on_desired |= sendOn;
+            rt->brightness_desired |= sendBrightness;
+            e->result = kGroupResult_Deferred;
+            tw_stats_count(TW_CNT_CMD_DEFERRED);
+        } else {
+            // No effect at all if every value sent is one the device has or is about to get
+            if ((!sendOn || ModeIsRedundant(rt, (bool) on, now)) &&
+                (!sendBrightness || BrightnessIsRedundant(rt, brightness, now)))
+                tw_stats_count(TW_CNT_CMD_REDUNDANT);
+            if (sendOn) {
+                e->on = on;
+                rt->on_pending_until = until;
+                rt->on_sent = on;
+            }
+            if (sendBrightness) {
+                e->brightness = brightness;
+                rt->brightness_pending_until = until;
+                rt->brightness_sent = brightness;
+            }
+            e->result = kGroupResult_Queued;
+            tw_stats_count(TW_CNT_CMD_SENT);
+            tw_poll_touch(index);
+        }
+    }
+    if (changed) {
+        SaveAccessoryState();
+        UpdateMaster();
+    }
+    GroupSubmit(job);
+    return true;
+}
+
+/* Every device, for SetAll and the "All Twinkly" service */
+static bool GroupCommandAll(int on, int brightness, GroupCallback cb, void* arg) {
+    int indexes[MAX_TWINKLY_DEVICES];
+    int count = (int) accessoryConfiguration.numDevices;
+    for (int i = 0; i < count; i++)
+        indexes[i] = i;
+    return GroupCommand(indexes, count, on, brightness, cb, arg);
+}
+
+/* Schedule rule action, devices that are gone since the rule was set are left out */
+static void ScheduleAction(const uint8_t* devices, int on, int brightness, void* arg) {
+    int indexes[MAX_TWINKLY_DEVICES];
+    int count = 0;
+    for (int i = 0; i < (int) accessoryConfiguration.numDevices; i++) {
+        if (devices == NULL || (devices[i / 8] & (1 << (i % 8))))
+            indexes[count++] = i;
+    }
+    if (count > 0 && !GroupCommand(indexes, count, on, brightness, NULL, NULL))
+        LOG(LL_ERROR, ("Schedule: out of memory"));
+    (void) arg;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterOnRead(
+        HAPAccessoryServerRef* server HAP_UNUSED,
+        const HAPBoolCharacteristicReadRequest* request HAP_UNUSED,
+        bool* value,
+        void* _Nullable context HAP_UNUSED) {
+    NoteControllerRequest();
+    *value = MasterOn();
+    return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterOnWrite(
+        HAPAccessoryServerRef* server HAP_UNUSED,
+        const HAPBoolCharacteristicWriteRequest* request HAP_UNUSED,
+        bool value,
+        void* _Nullable context HAP_UNUSED) {
+    NoteControllerRequest();
+    return GroupCommandAll(value, -1, NULL, NULL) ? kHAPError_None : kHAPError_OutOfResources;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterBrightnessRead(
+        HAPAccessoryServerRef* server HAP_UNUSED,
+        const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
+        int32_t* value,
+        void* _Nullable context HAP_UNUSED) {
+    NoteControllerRequest();
+    *value = MasterBrightness();
+    return kHAPError_None;
+}
+
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterBrightnessWrite(
+        HAPAccessoryServerRef* server HAP_UNUSED,
+        const HAPIntCharacteristicWriteRequest* request HAP_UNUSED,
+        int32_t value,
+        void* _Nullable context HAP_UNUSED) {
+    NoteControllerRequest();
+    return GroupCommandAll(-1, value, NULL, NULL) ? kHAPError_None : kHAPError_OutOfResources;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 
 void AppCreate(HAPAccessoryServerRef* server, HAPPlatformKeyValueStoreRef keyValueStore) {
@@ -236,66 +1004,146 @@ void AppCreate(HAPAccessoryServerRef* server, HAPPlatformKeyValueStoreRef keyVal
     HAPRawBufferZero(&accessoryConfiguration, sizeof accessoryConfiguration);
     accessoryConfiguration.server = server;
     accessoryConfiguration.keyValueStore = keyValueStore;
+    ResizeDeviceState(mgos_twinkly_count());
     LoadAccessoryState();
 }
 
 void AppRelease(void) {
+    ResizeDeviceState(0);
 }
 
+/* Service list being filled by HAPServiceCreate_cb */
+static HAPService** newServices = NULL;
+
 bool HAPServiceCreate_cb(int idx, const struct mg_str* ip, const struct mg_str* json) {
     LOG(LL_DEBUG, ("%s %.*s %.*s", __func__, ip->len, ip->p, json->len, json->p));
     if (idx >= MAX_TWINKLY_DEVICES) {
         LOG(LL_ERROR, ("%s max devices reached %d", __func__, MAX_TWINKLY_DEVICES));
         return false;
     }
-    HAPService* service = calloc(1, sizeof(HAPService));
-    HAPService** index = (void*) &accessory.services[idx + 3]; // acc_info + prot_info + pairing
+    HAPService* service = tw_heap_calloc(TW_HEAP_SERVICE, 1, sizeof(HAPService));
+    HAPService** index = &newServices[idx + 3]; // acc_info + prot_info + pairing
     *index++ = service;
     *index = NULL; // NULL terminated always
     memcpy(service, &lightBulbService, sizeof(HAPService));
     service->iid += kIID_PoolSize * idx;
     LOG(LL_DEBUG, ("%s s->iid %lld", __func__, service->iid));
-    HAPCharacteristic** cs = calloc(4 + 1, sizeof(HAPCharacteristic*)); // 4 chars + NULL
-    service->characteristics = (const HAPCharacteristic* const*) cs;
+    // Characteristics are const tables, only the service is per-device RAM
+    service->characteristics = lightBulbCharacteristics[idx];
     // service->properties.primaryService = (idx == 0);
     // Lightbulb name
     char* name = NULL;
     if (json_scanf(json->p, json->len, "{device_name: %Q}", &name) == 1) {
-        service->name = strdup(name);
+        service->name = tw_heap_adopt_str(TW_HEAP_NAME, name);
         LOG(LL_INFO, ("Twinkly %ld: %s", (long) idx, service->name));
     } else
         LOG(LL_INFO, ("Twinkly %ld: no name, using accessory name", (long) idx));
-    // Need this? i don't think so
-    // HAPDataCharacteristic* SignatureCharacteristic = calloc(1, sizeof(HAPDataCharacteristic));
-    // memcpy(SignatureCharacteristic, &lightBulbServiceSignatureCharacteristic, sizeof(HAPDataCharacteristic));
-    // SignatureCharacteristic->iid += kIID_PoolSize * idx;
-    // *cs++ = SignatureCharacteristic;
-    //
-    HAPStringCharacteristic* NameCharacteristic = calloc(1, sizeof(HAPStringCharacteristic));
-    memcpy(NameCharacteristic, &lightBulbNameCharacteristic, sizeof(HAPStringCharacteristic));
-    NameCharacteristic->iid += kIID_PoolSize * idx;
-    *cs++ = NameCharacteristic;
-    //
-    HAPBoolCharacteristic* OnCharacteristic = calloc(1, sizeof(HAPBoolCharacteristic));
-    memcpy(OnCharacteristic, &lightBulbOnCharacteristic, sizeof(HAPBoolCharacteristic));
-    OnCharacteristic->iid += kIID_PoolSize * idx;
-    *cs++ = OnCharacteristic;
-    //
-    HAPIntCharacteristic* BrightnessCharacteristic = calloc(1, sizeof(HAPIntCharacteristic));
-    memcpy(BrightnessCharacteristic, &lightBulbBrightnessCharacteristic, sizeof(HAPIntCharacteristic));
-    BrightnessCharacteristic->iid += kIID_PoolSize * idx;
-    *cs++ = BrightnessCharacteristic;
-    //
-    *cs = NULL;
+    return true;
+}
+
+/**
+ * Build the service list for the current devices.
+ */
+static const HAPService* const* CreateServices(int n) {
+    bool master = mgos_sys_config_get_app_group_master();
+    newServices = tw_heap_calloc(TW_HEAP_SERVICES, 3 + n + master + 1, sizeof(HAPService*)); // NULL terminated
+    HAPAssert(newServices);
+    newServices[0] = (HAPService*) &mgos_hap_accessory_information_service;
+    newServices[1] = (HAPService*) &mgos_hap_protocol_information_service;
+    newServices[2] = (HAPService*) &mgos_hap_pairing_service;
+    mgos_twinkly_iterate(HAPServiceCreate_cb);
+    if (master) {
+        // After the devices, they keep their positions
+        newServices[3 + n] = (HAPService*) &masterLightBulbService;
+        masterAnnounced.on = MasterOn();
+        masterAnnounced.brightness = MasterBrightness();
+    }
+    LOG(LL_INFO, ("Twinkly devices loaded: %ld", (long) n));
+    const HAPService* const* services = (const HAPService* const*) newServices;
+    newServices = NULL;
+    return services;
+}
+
+static void FreeServices(const HAPService* const* services) {
+    if (services == NULL)
+        return;
+    for (int i = 3; services[i]; i++) { // skipping constant services
+        if (services[i] == &masterLightBulbService)
+            continue;
+        tw_heap_free((void*) services[i]->name);
+        tw_heap_free((void*) services[i]);
+    }
+    tw_heap_free((void*) services);
+}
+
+/* True when the "All Twinkly" service is shown differently than at the last start, and remembers the new value */
+static bool MasterChanged(void) {
+    uint8_t master = mgos_sys_config_get_app_group_master(), stored = 0;
+    size_t numBytes = 0;
+    bool found = false;
+    HAPError err = tw_kv_get(
+            kAppKeyValueStoreDomain_Configuration,
+            kAppKeyValueStoreKey_Configuration_Master,
+            &stored,
+            sizeof stored,
+            &numBytes,
+            &found);
+    if (err || (found && numBytes == sizeof stored && stored == master) || (!found && !master))
+        return false;
+    tw_kv_set(kAppKeyValueStoreDomain_Configuration, kAppKeyValueStoreKey_Configuration_Master, &master, sizeof master);
+    return true;
+}
+
+/**
+ * Shift CN so controllers reload the accessory if devices were added/removed.
+ */
+static bool IncrementCNIfChanged(void) {
+    bool master = MasterChanged();
+    if (!mgos_sys_config_get_twinkly_config_changed() && !master)
+        return false;
+    LOG(LL_INFO, ("Twinkly configuration changed, increasing CN"));
+    HAPError err = HAPAccessoryServerIncrementCN(accessoryConfiguration.keyValueStore);
+    if (err) {
+        LOG(LL_ERROR, ("Failed to increase CN"));
+        return false;
+    }
+    mgos_sys_config_set_twinkly_config_changed(false);
+    mgos_sys_config_save(&mgos_sys_config, false, NULL);
     return true;
 }
 
 void RestartHAPServer() {
     if (HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running) {
+        restartStarted = mgos_uptime_micros();
+        restartWarm = false;
         HAPAccessoryServerStop(accessoryConfiguration.server);
     }
 }
 
+bool AppAccessoryServerWarmRestart(void) {
+    int n = mgos_twinkly_count();
+    if (HAPAccessoryServerGetState(accessoryConfiguration.server) != kHAPAccessoryServerState_Running || !n)
+        return false;
+    int64_t started = mgos_uptime_micros();
+    tw_heap_mark_t mark;
+    tw_heap_op_begin(&mark, TW_HEAP_OP_WARM_RESTART);
+    const HAPService* const* services = CreateServices(n);
+    const HAPService* const* old = accessory.services;
+    // Requests are served from this same event loop, so none of them can see a half updated database
+    accessory.services = services;
+    FreeServices(old);
+    tw_heap_op_end(&mark);
+    if (IncrementCNIfChanged())
+        tw_adk_update_discovery(accessoryConfiguration.server);
+    restartStarted = started;
+    restartWarm = true;
+    LOG(LL_INFO,
+        ("Warm restart: %d services swapped in %lld us, sessions kept",
+         n,
+         (long long) (mgos_uptime_micros() - started)));
+    return true;
+}
+
 void AppAccessoryServerStart(void) {
     LOG(LL_DEBUG, (__func__));
     int n = mgos_twinkly_count();
@@ -303,41 +1151,12 @@ void AppAccessoryServerStart(void) {
         LOG(LL_ERROR, ("No devices to expose. Add first"));
         return;
     }
-    // Cleaning up services
-    if (accessory.services) {
-        int i = 3; // skipping constant services
-        while (accessory.services[i]) {
-            int j = 0;
-            while (accessory.services[i]->characteristics[j]) {
-                free((void*) accessory.services[i]->characteristics[j]);
-                j++;
-            };
-            free((void*) accessory.services[i]->name);
-            free((void*) accessory.services[i]);
-            i++;
-        };
-        free((void*) accessory.services);
-    }
-    // Loading services
-    accessory.services = calloc(3 + n + 1, sizeof(HAPService*));
-    memset((void*) accessory.services, 0, (3 + n + 1) * sizeof(HAPService*)); // NULL terminated
-    HAPService** index = (void*) &accessory.services[0];
-    *index++ = (HAPService*) &mgos_hap_accessory_information_service;
-    *index++ = (HAPService*) &mgos_hap_protocol_information_service;
-    *index++ = (HAPService*) &mgos_hap_pairing_service;
-    mgos_twinkly_iterate(HAPServiceCreate_cb);
-    LOG(LL_INFO, ("Twinkly devices loaded: %ld", (long) n));
-    // Shifting CN to reload accessory if devices were added/removed
-    if (mgos_sys_config_get_twinkly_config_changed()) {
-        LOG(LL_INFO, ("Twinkly configuration changed, increasing CN"));
-        HAPError err = HAPAccessoryServerIncrementCN(accessoryConfiguration.keyValueStore);
-        if (err) {
-            LOG(LL_ERROR, ("Failed to increase CN"));
-        } else {
-            mgos_sys_config_set_twinkly_config_changed(false);
-            mgos_sys_config_save(&mgos_sys_config, false, NULL);
-        }
-    }
+    tw_heap_mark_t mark;
+    tw_heap_op_begin(&mark, TW_HEAP_OP_SERVER_START);
+    FreeServices(accessory.services);
+    accessory.services = CreateServices(n);
+    tw_heap_op_end(&mark);
+    IncrementCNIfChanged();
     HAPAccessoryServerStart(accessoryConfiguration.server, &accessory);
 }
 
@@ -368,6 +1187,484 @@ HAPAccessory* AppGetAccessoryInfo() {
     return &accessory;
 }
 
+static int PrintDeviceStates(struct json_out* out, va_list* ap) {
+    int64_t now = NowMs();
+    int len = json_printf(out, "[");
+    for (int i = 0; i < (int) accessoryConfiguration.numDevices; i++) {
+        const tw_state_t* st = &accessoryConfiguration.state.tw_state[i];
+        const tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[i];
+        int64_t seen = tw_poll_last_seen_ms(i);
+        int64_t on_confirmed = rt->on_confirmed > seen ? rt->on_confirmed : seen;
+        int64_t brightness_confirmed = rt->brightness_confirmed > seen ? rt->brightness_confirmed : seen;
+        len += json_printf(
+                out,
+                "%s{index: %d, online: %B, on: {value: %B, version: %u, age_ms: %lld}, "
+                "brightness: {value: %d, version: %u, age_ms: %lld}}",
+                i ? ", " : "",
+                i,
+                st->online,
+                st->on,
+                (unsigned) rt->on_version,
+                (long long) (on_confirmed ? now - on_confirmed : -1),
+                st->brightness,
+                (unsigned) rt->brightness_version,
+                (long long) (brightness_confirmed ? now - brightness_confirmed : -1));
+    }
+    len += json_printf(out, "]");
+    (void) ap;
+    return len;
+}
+
+static void HandleStateRPC(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg HAP_UNUSED,
+        struct mg_rpc_frame_info* fi HAP_UNUSED,
+        struct mg_str args HAP_UNUSED) {
+    mg_rpc_send_responsef(ri, "%M", PrintDeviceStates);
+}
+
+static int PrintGroupJob(struct json_out* out, va_list* ap) {
+    const GroupJob* job = va_arg(*ap, const GroupJob*);
+    int counts[kGroupResult_Max] = { 0 };
+    for (int i = 0; i < job->count; i++)
+        counts[job->entries[i].result]++;
+    int len = json_printf(out, "{");
+    for (int r = 0; r < kGroupResult_Max; r++)
+        len += json_printf(out, "%Q: %d, ", groupResultNames[r], counts[r]);
+    len += json_printf(
+            out, "took_ms: %lld, devices: [", (long long) ((mgos_uptime_micros() - job->started) / 1000));
+    for (int i = 0; i < job->count; i++) {
+        const GroupEntry* e = &job->entries[i];
+        len += json_printf(
+                out,
+                "%s{index: %d, result: %Q, ms: %u}",
+                i ? ", " : "",
+                e->index,
+                groupResultNames[e->result],
+                (unsigned) (e->tookUs / 1000));
+    }
+    len += json_printf(out, "]}");
+    return len;
+}
+
+static void GroupRPCDone(const GroupJob* job, void* arg) {
+    mg_rpc_send_responsef(arg, "%M", PrintGroupJob, job);
+}
+
+/**
+ * Twinkly.SetAll {on, brightness} and Twinkly.SetGroup {devices, on, brightness}: `devices` lists indexes and/or IPs.
+ * The response comes once every device has answered.
+ */
+static void HandleSetGroupRPC(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi HAP_UNUSED,
+        struct mg_str args) {
+    bool all = cb_arg != NULL;
+    bool onValue = false;
+    int on = -1, brightness = -1;
+    if (json_scanf(args.p, args.len, "{on: %B}", &onValue) == 1)
+        on = onValue;
+    json_scanf(args.p, args.len, "{brightness: %d}", &brightness);
+    if (on < 0 && brightness < 0) {
+        mg_rpc_send_errorf(ri, 400, "on or brightness required");
+        return;
+    }
+    if (brightness < -1 || brightness > 100) {
+        mg_rpc_send_errorf(ri, 400, "brightness out of range");
+        return;
+    }
+    bool ok;
+    if (all) {
+        ok = GroupCommandAll(on, brightness, GroupRPCDone, ri);
+    } else {
+        int indexes[MAX_TWINKLY_DEVICES];
+        bool seen[MAX_TWINKLY_DEVICES] = { false };
+        int count = 0;
+        struct json_token t;
+        for (int i = 0; json_scanf_array_elem(args.p, args.len, ".devices", i, &t) > 0; i++) {
+            int index = -1;
+            char buf[20];
+            if (t.type == JSON_TYPE_NUMBER || t.type == JSON_TYPE_STRING) {
+                snprintf(buf, sizeof(buf), "%.*s", t.len, t.ptr);
+                index = t.type == JSON_TYPE_NUMBER ? atoi(buf) : tw_client_find(buf);
+            }
+            if (index < 0 || index >= (int) accessoryConfiguration.numDevices) {
+                mg_rpc_send_errorf(ri, 400, "unknown device %.*s", t.len, t.ptr);
+                return;
+            }
+            if (!seen[index]) {
+                seen[index] = true;
+                indexes[count++] = index;
+            }
+        }
+        if (count == 0) {
+            mg_rpc_send_errorf(ri, 400, "devices required");
+            return;
+        }
+        ok = GroupCommand(indexes, count, on, brightness, GroupRPCDone, ri);
+    }
+    if (!ok)
+        mg_rpc_send_errorf(ri, 500, "out of memory");
+}
+
+#if TW_BENCH || TW_HEAP_TRACK
+
+/**
+ * Service list for `n` made up devices, built by the same code as the real one.
+ * Slots of the constant services stay empty, FreeServices skips them.
+ */
+static const HAPService* const* CreateTestServices(int n) {
+    const struct mg_str ip = mg_mk_str("192.168.1.100");
+    char json[48];
+    newServices = tw_heap_calloc(TW_HEAP_SERVICES, 3 + n + 1, sizeof(HAPService*));
+    if (newServices == NULL)
+        return NULL;
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(json, sizeof(json), "{\"device_name\": \"Twinkly %02d\"}", i);
+        const struct mg_str js = mg_mk_str_n(json, len);
+        HAPServiceCreate_cb(i, &ip, &js);
+    }
+    const HAPService* const* services = (const HAPService* const*) newServices;
+    newServices = NULL;
+    return services;
+}
+
+#endif
+
+#if TW_BENCH
+
+static bool BenchOnRead(void* arg) {
+    if (accessoryConfiguration.numDevices == 0)
+        return false;
+    const HAPBoolCharacteristicReadRequest request = {
+        .characteristic = (const HAPBoolCharacteristic*) lightBulbCharacteristics[0][1],
+    };
+    bool value;
+    HAPError err = HandleLightBulbOnRead(accessoryConfiguration.server, &request, &value, NULL);
+    (void) arg;
+    return err == kHAPError_None;
+}
+
+static bool BenchBrightnessRead(void* arg) {
+    if (accessoryConfiguration.numDevices == 0)
+        return false;
+    const HAPIntCharacteristicReadRequest request = {
+        .characteristic = (const HAPIntCharacteristic*) lightBulbCharacteristics[0][2],
+    };
+    int32_t value;
+    HAPError err = HandleLightBulbBrightnessRead(accessoryConfiguration.server, &request, &value, NULL);
+    (void) arg;
+    return err == kHAPError_None;
+}
+
+/* Writing the current value: a changed one would send a command to the device */
+static bool BenchOnWriteUnchanged(void* arg) {
+    if (accessoryConfiguration.numDevices == 0)
+        return false;
+    const HAPBoolCharacteristicWriteRequest request = {
+        .characteristic = (const HAPBoolCharacteristic*) lightBulbCharacteristics[0][1],
+    };
+    HAPError err = HandleLightBulbOnWrite(
+            accessoryConfiguration.server, &request, accessoryConfiguration.state.tw_state[0].on, NULL);
+    (void) arg;
+    return err == kHAPError_None;
+}
+
+/* Service list construction for `arg` devices, whatever the current device list is */
+static bool BenchCreateServices(void* arg) {
+    const HAPService* const* services = CreateTestServices((int) (intptr_t) arg);
+    if (services == NULL)
+        return false;
+    FreeServices(services);
+    return true;
+}
+
+static bool BenchSaveState(void* arg) {
+    SaveAccessoryState();
+    (void) arg;
+    return true;
+}
+
+static bool BenchLoadState(void* arg) {
+    LoadAccessoryState();
+    (void) arg;
+    return true;
+}
+
+/* Device report confirming the current value, the common case of a poll */
+static bool BenchModeEvent(void* arg) {
+    if (accessoryConfiguration.numDevices == 0)
+        return false;
+    mgos_twinkly_ev_data_t data = { .index = 0, .value = accessoryConfiguration.state.tw_state[0].on };
+    twinkly_cb(MGOS_TWINKLY_EV_MODE, &data, NULL);
+    (void) arg;
+    return true;
+}
+
+static void RegisterBenchmarks(void) {
+    tw_bench_add("hap_read_on", BenchOnRead, NULL);
+    tw_bench_add("hap_read_brightness", BenchBrightnessRead, NULL);
+    tw_bench_add("hap_write_on_unchanged", BenchOnWriteUnchanged, NULL);
+    tw_bench_add("services_1", BenchCreateServices, (void*) 1);
+    tw_bench_add("services_8", BenchCreateServices, (void*) 8);
+    tw_bench_add("services_32", BenchCreateServices, (void*) MAX_TWINKLY_DEVICES);
+    tw_bench_add("state_save", BenchSaveState, NULL);
+    tw_bench_add("state_load", BenchLoadState, NULL);
+    tw_bench_add("event_mode", BenchModeEvent, NULL);
+}
+
+/**
+ * Stress harness hook: a HomeKit write of `on` and/or `brightness` through the characteristic handlers, or with
+ * `report` a device report of them through twinkly_cb, as a late or out of order poll would deliver it.
+ */
+static void HandleInjectRPC(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg HAP_UNUSED,
+        struct mg_rpc_frame_info* fi HAP_UNUSED,
+        struct mg_str args) {
+    int index = -1, on = -1, brightness = -1;
+    bool report = false;
+    json_scanf(args.p, args.len, ri->args_fmt, &index, &on, &brightness, &report);
+    if (index < 0 || index >= (int) accessoryConfiguration.numDevices || (on < 0 && brightness < 0) ||
+        brightness > 100) {
+        mg_rpc_send_errorf(ri, 400, "index and one of on, brightness are required");
+        return;
+    }
+    if (report) {
+        mgos_twinkly_ev_data_t data = { .index = index };
+        if (on >= 0) {
+            data.value = on;
+            twinkly_cb(MGOS_TWINKLY_EV_MODE, &data, NULL);
+        }
+        if (brightness >= 0) {
+            data.value = brightness;
+            twinkly_cb(MGOS_TWINKLY_EV_BRIGHTNESS, &data, NULL);
+        }
+    } else {
+        const HAPService* service = accessory.services[3 + index];
+        HAPError err = kHAPError_None;
+        if (on >= 0) {
+            const HAPBoolCharacteristicWriteRequest request = {
+                .transportType = kHAPTransportType_IP,
+                .characteristic = (const HAPBoolCharacteristic*) lightBulbCharacteristics[index][1],
+                .service = service,
+                .accessory = &accessory,
+            };
+            err = HandleLightBulbOnWrite(accessoryConfiguration.server, &request, on != 0, NULL);
+        }
+        if (!err && brightness >= 0) {
+            const HAPIntCharacteristicWriteRequest request = {
+                .transportType = kHAPTransportType_IP,
+                .characteristic = (const HAPIntCharacteristic*) lightBulbCharacteristics[index][2],
+                .service = service,
+                .accessory = &accessory,
+            };
+            err = HandleLightBulbBrightnessWrite(accessoryConfiguration.server, &request, brightness, NULL);
+        }
+        if (err) {
+            mg_rpc_send_errorf(ri, 503, "write failed: %d", err);
+            return;
+        }
+    }
+    const tw_state_t* st = &accessoryConfiguration.state.tw_state[index];
+    mg_rpc_send_responsef(ri, "{index: %d, on: %B, brightness: %d}", index, st->on, st->brightness);
+}
+
+#endif
+
+#if TW_HEAP_TRACK
+
+#define kHeapTest_CyclesPerTick 8
+#define kHeapTest_MaxCycles     10000
+
+/* Hub.Heap.Test in progress, it runs a few cycles per timer tick */
+static struct {
+    struct mg_rpc_request_info* ri;
+    mgos_timer_id timer;
+    int devices;
+    int cycles;
+    int done;
+    int rebuilds;
+    bool complete;
+    uint32_t budgetBytes;
+    uint32_t budgetAllocs;
+    uint32_t allocs;
+    int net;
+    int netBytes;
+    size_t freeHeap;
+} heapTest;
+
+/* Copy of the live device state, the test runs on the real arrays and puts it back after each tick */
+typedef struct {
+    size_t count;
+    tw_state_t* state;
+    tw_runtime_t* runtime;
+} HeapTestSnapshot;
+
+static bool HeapTestSave(HeapTestSnapshot* snap) {
+    snap->count = accessoryConfiguration.numDevices;
+    snap->state = NULL;
+    snap->runtime = NULL;
+    if (snap->count == 0)
+        return true;
+    snap->state = tw_heap_calloc(TW_HEAP_SCRATCH, snap->count, sizeof(tw_state_t));
+    snap->runtime = tw_heap_calloc(TW_HEAP_SCRATCH, snap->count, sizeof(tw_runtime_t));
+    if (snap->state == NULL || snap->runtime == NULL) {
+        tw_heap_free(snap->state);
+        tw_heap_free(snap->runtime);
+        return false;
+    }
+    HAPRawBufferCopyBytes(snap->state, accessoryConfiguration.state.tw_state, snap->count * sizeof(tw_state_t));
+    HAPRawBufferCopyBytes(snap->runtime, accessoryConfiguration.tw_runtime, snap->count * sizeof(tw_runtime_t));
+    return true;
+}
+
+static void HeapTestRestore(const HeapTestSnapshot* snap) {
+    ResizeDeviceState(snap->count);
+    if (snap->count) {
+        HAPRawBufferCopyBytes(accessoryConfiguration.state.tw_state, snap->state, snap->count * sizeof(tw_state_t));
+        HAPRawBufferCopyBytes(accessoryConfiguration.tw_runtime, snap->runtime, snap->count * sizeof(tw_runtime_t));
+    }
+}
+
+static void HeapTestFree(HeapTestSnapshot* snap) {
+    tw_heap_free(snap->state);
+    tw_heap_free(snap->runtime);
+}
+
+/* Memory held for `devices` devices: their state from empty and a service list */
+static void HeapTestBudget(void) {
+    HeapTestSnapshot snap;
+    tw_heap_counters_t before, after;
+    if (!HeapTestSave(&snap)) {
+        heapTest.complete = false;
+        return;
+    }
+    ResizeDeviceState(0);
+    tw_heap_total(&before);
+    ResizeDeviceState(heapTest.devices);
+    const HAPService* const* services = CreateTestServices(heapTest.devices);
+    tw_heap_total(&after);
+    heapTest.complete = services != NULL;
+    heapTest.budgetBytes = after.live_bytes - before.live_bytes;
+    heapTest.budgetAllocs = after.live - before.live;
+    FreeServices(services);
+    HeapTestRestore(&snap);
+    HeapTestFree(&snap);
+}
+
+static void HeapTestFinish(void) {
+    mgos_clear_timer(heapTest.timer);
+    heapTest.timer = MGOS_INVALID_TIMER_ID;
+    uint32_t budget = mgos_sys_config_get_app_heap_budget();
+    bool budgetOk = heapTest.complete && heapTest.budgetBytes <= budget;
+    bool cyclesOk = heapTest.complete && heapTest.net == 0 && heapTest.netBytes == 0;
+    mg_rpc_send_responsef(
+            heapTest.ri,
+            "{devices: %d, budget: {bytes: %u, allocs: %u, limit: %u, ok: %B}, "
+            "cycles: {count: %d, rebuilds: %d, allocs: %u, net: %d, net_bytes: %d, heap_delta: %d, ok: %B}, "
+            "complete: %B, ok: %B}",
+            heapTest.devices,
+            (unsigned) heapTest.budgetBytes,
+            (unsigned) heapTest.budgetAllocs,
+            (unsigned) budget,
+            budgetOk,
+            heapTest.done,
+            heapTest.rebuilds,
+            (unsigned) heapTest.allocs,
+            heapTest.net,
+            heapTest.netBytes,
+            (int) (heapTest.freeHeap - mgos_get_free_heap_size()),
+            cyclesOk,
+            heapTest.complete,
+            budgetOk && cyclesOk);
+    heapTest.ri = NULL;
+}
+
+/**
+ * A few device list changes through the code that handles them: state resized, a device removed from the middle,
+ * the state encoded for saving and the service list rebuilt as a warm restart does. It all stays in RAM: the save
+ * stops short of the store and the accessory server keeps its service list. The device state is put back before
+ * returning to the event loop, so requests served between ticks see the real one and nothing of the test is left
+ * behind if the hub resets in the middle of it.
+ */
+static void HeapTestTimer(void* arg HAP_UNUSED) {
+    HeapTestSnapshot snap;
+    tw_heap_counters_t before, after;
+    if (!HeapTestSave(&snap)) {
+        heapTest.complete = false;
+        HeapTestFinish();
+        return;
+    }
+    // A log line per service would take most of the time
+    enum cs_log_level level = cs_log_level;
+    cs_log_set_level(LL_WARN);
+    heapTestRunning = true;
+    tw_heap_total(&before);
+    // Devices are added one per cycle up to `devices`, then the list drops back to one
+    for (int i = 0; i < kHeapTest_CyclesPerTick && heapTest.done < heapTest.cycles; i++, heapTest.done++) {
+        size_t n = heapTest.done % heapTest.devices + 1;
+        ResizeDeviceState(n);
+        RemoveDeviceState(heapTest.done % n);
+        SaveAccessoryState();
+        const HAPService* const* services = CreateTestServices((int) accessoryConfiguration.numDevices);
+        if (services != NULL)
+            heapTest.rebuilds++;
+        FreeServices(services);
+    }
+    HeapTestRestore(&snap);
+    tw_heap_total(&after);
+    heapTestRunning = false;
+    cs_log_set_level(level);
+    HeapTestFree(&snap);
+    heapTest.allocs += after.allocs - before.allocs;
+    heapTest.net += (int) (after.live - before.live);
+    heapTest.netBytes += (int) (after.live_bytes - before.live_bytes);
+    if (heapTest.done == heapTest.cycles)
+        HeapTestFinish();
+}
+
+/**
+ * Heap self-test: the memory held for `devices` devices against app.heap.budget, and `cycles` device list changes
+ * that must not leave any allocation behind. Nothing is written to flash and the server is not touched.
+ */
+static void HandleHeapTestRPC(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg HAP_UNUSED,
+        struct mg_rpc_frame_info* fi HAP_UNUSED,
+        struct mg_str args) {
+    int devices = MAX_TWINKLY_DEVICES, cycles = 1000;
+    if (heapTest.ri != NULL) {
+        mg_rpc_send_errorf(ri, 409, "test running");
+        return;
+    }
+    json_scanf(args.p, args.len, ri->args_fmt, &devices, &cycles);
+    if (devices < 1 || devices > MAX_TWINKLY_DEVICES)
+        devices = MAX_TWINKLY_DEVICES;
+    if (cycles < 1)
+        cycles = 1;
+    if (cycles > kHeapTest_MaxCycles)
+        cycles = kHeapTest_MaxCycles;
+    HAPRawBufferZero(&heapTest, sizeof heapTest);
+    heapTest.devices = devices;
+    heapTest.cycles = cycles;
+    enum cs_log_level level = cs_log_level;
+    cs_log_set_level(LL_WARN);
+    HeapTestBudget();
+    cs_log_set_level(level);
+    heapTest.ri = ri;
+    heapTest.freeHeap = mgos_get_free_heap_size();
+    heapTest.timer = heapTest.complete ? mgos_set_timer(10, MGOS_TIMER_REPEAT, HeapTestTimer, NULL)
+                                       : MGOS_INVALID_TIMER_ID;
+    if (heapTest.timer == MGOS_INVALID_TIMER_ID) {
+        heapTest.complete = false;
+        HeapTestFinish();
+    }
+}
+
+#endif
+
 void AppInitialize(
         HAPAccessoryServerOptions* hapAccessoryServerOptions HAP_UNUSED,
         HAPPlatform* hapPlatform HAP_UNUSED,
@@ -377,6 +1674,18 @@ void AppInitialize(
     static char hostname[13] = "TWH-????";
     mgos_expand_mac_address_placeholders(hostname);
     accessory.name = hostname;
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.State", "", HandleStateRPC, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Twinkly.SetAll", "", HandleSetGroupRPC, (void*) 1);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Twinkly.SetGroup", "", HandleSetGroupRPC, NULL);
+    tw_sched_set_action(ScheduleAction, NULL);
+#if TW_BENCH
+    RegisterBenchmarks();
+    mg_rpc_add_handler(
+            mgos_rpc_get_global(), "Hub.Inject", "{index: %d, on: %d, brightness: %d, report: %B}", HandleInjectRPC, NULL);
+#endif
+#if TW_HEAP_TRACK
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Heap.Test", "{devices: %d, cycles: %d}", HandleHeapTestRPC, NULL);
+#endif
 }
 
 void AppDeinitialize() {
@@ -392,19 +1701,98 @@ static void led_on(int msec) {
     mgos_set_timer(msec, 0, led_off_timer_cb, NULL);
 }
 
+/**
+ * External changes: reports of a value set elsewhere are held per device and announced together, at most one
+ * announcement per app.coalesce.min_interval_ms, and a brightness only once it stayed put for app.coalesce.settle_ms,
+ * so dragging a slider in the Twinkly app ends up as one HAP event with the final value.
+ */
+static mgos_timer_id coalesceTimer = MGOS_INVALID_TIMER_ID;
+
+static int64_t ExternalChangeDue(const tw_runtime_t* rt) {
+    int64_t due = rt->ext_announced + mgos_sys_config_get_app_coalesce_min_interval_ms();
+    int64_t settled = rt->ext_brightness_moved + mgos_sys_config_get_app_coalesce_settle_ms();
+    if (rt->ext_brightness_pending && settled > due)
+        due = settled;
+    int64_t latest = rt->ext_first + mgos_sys_config_get_app_coalesce_max_delay_ms();
+    return due < latest ? due : latest;
+}
+
+static void ApplyExternalChange(int index) {
+    tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[index];
+    tw_state_t* st = &accessoryConfiguration.state.tw_state[index];
+    bool running = HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running;
+    bool changed = false;
+    if (rt->ext_on_pending && rt->ext_on_version == rt->on_version && st->on != rt->ext_on) {
+        rt->on_version++;
+        st->on = rt->ext_on;
+        changed = true;
+        if (running)
+            AccessoryNotification(accessory.services[3 + index], accessory.services[3 + index]->characteristics[1]);
+    }
+    if (rt->ext_brightness_pending && rt->ext_brightness_version == rt->brightness_version &&
+        st->brightness != rt->ext_brightness) {
+        rt->brightness_version++;
+        st->brightness = rt->ext_brightness;
+        changed = true;
+        if (running)
+            AccessoryNotification(accessory.services[3 + index], accessory.services[3 + index]->characteristics[2]);
+    }
+    rt->ext_on_pending = rt->ext_brightness_pending = false;
+    rt->ext_first = 0;
+    if (!changed)
+        return;
+    rt->ext_announced = NowMs();
+    tw_stats_count(TW_CNT_EXT_ANNOUNCED);
+    SaveAccessoryState();
+    UpdateMaster();
+    led_on(150);
+}
+
+static void CoalesceTimerCallback(void* arg);
+
+/* Apply the changes that are due, and wake up for the next one */
+static void ApplyDueExternalChanges(void) {
+    int64_t now = NowMs(), next = 0;
+    for (int i = 0; i < (int) accessoryConfiguration.numDevices; i++) {
+        tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[i];
+        if (!rt->ext_on_pending && !rt->ext_brightness_pending)
+            continue;
+        int64_t due = ExternalChangeDue(rt);
+        if (due <= now)
+            ApplyExternalChange(i);
+        else if (next == 0 || due < next)
+            next = due;
+    }
+    if (coalesceTimer != MGOS_INVALID_TIMER_ID)
+        mgos_clear_timer(coalesceTimer);
+    coalesceTimer = MGOS_INVALID_TIMER_ID;
+    if (next)
+        coalesceTimer = mgos_set_timer((int) (next - now), 0, CoalesceTimerCallback, NULL);
+}
+
+static void CoalesceTimerCallback(void* arg) {
+    coalesceTimer = MGOS_INVALID_TIMER_ID;
+    ApplyDueExternalChanges();
+    (void) arg;
+}
+
 void twinkly_cb(int ev, void* ev_data, void* userdata) {
     mgos_twinkly_ev_data_t* data = ev_data;
     switch (ev) {
         case MGOS_TWINKLY_EV_INITIALIZED: {
             LOG(LL_DEBUG, ("Twinkly init done"));
+            ResizeDeviceState(mgos_twinkly_count());
             led_on(250);
         } break;
         case MGOS_TWINKLY_EV_STATUS: {
             int status = data->value;
-            LOG(LL_INFO, ("Twinkly %ld status: %s", (long) data->index, status ? "online" : "offline"));
-            if (data->index >= MAX_TWINKLY_DEVICES)
+            TW_LOG(DEV, LL_INFO, TW_MSG_DEV_STATUS, data->index, status);
+            TW_TRACE_INSTANT("ev.status", data->index + 1, status);
+            if (data->index >= (int) accessoryConfiguration.numDevices)
                 break;
             accessoryConfiguration.state.tw_state[data->index].online = (bool) status;
+            if (status)
+                ReplayDesiredState(data->index);
             // #todo Raise StstusActive event
             // if (HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running)
             // AccessoryNotification(accessory.services[3+data->index],accessory.services[3+data->index]->characteristics[3]);
@@ -412,30 +1800,96 @@ void twinkly_cb(int ev, void* ev_data, void* userdata) {
         } break;
         case MGOS_TWINKLY_EV_MODE: {
             int mode = data->value;
-            LOG(LL_INFO, ("Twinkly %ld mode: %s", (long) data->index, mode ? "on" : "off"));
-            if (data->index >= MAX_TWINKLY_DEVICES)
+            TW_LOG(DEV, LL_INFO, TW_MSG_DEV_MODE, data->index, mode);
+            TW_TRACE_INSTANT("ev.mode", data->index + 1, mode);
+            if (data->index >= (int) accessoryConfiguration.numDevices)
                 break;
-            accessoryConfiguration.state.tw_state[data->index].on = (bool) mode;
-            if (HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running)
-                AccessoryNotification(
-                        accessory.services[3 + data->index], accessory.services[3 + data->index]->characteristics[1]);
-            led_on(150);
+            tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[data->index];
+            rt->on_reported = true;
+            rt->on = (bool) mode;
+            if (NowMs() < rt->on_pending_until &&
+                (bool) mode != accessoryConfiguration.state.tw_state[data->index].on) {
+                // Report predates our command, the device will catch up
+                tw_stats_count(TW_CNT_STALE_REPORT);
+                break;
+            }
+            bool echo = rt->on_pending_until != 0;
+            rt->on_pending_until = 0;
+            rt->on_confirmed = NowMs();
+            if (accessoryConfiguration.state.tw_state[data->index].on == (bool) mode) {
+                // Confirmation only, nothing to announce; a held external change was undone
+                if (echo)
+                    tw_stats_count(TW_CNT_ECHO);
+                rt->ext_on_pending = false;
+                rt->ext_first = rt->ext_brightness_pending ? rt->ext_first : 0;
+                break;
+            }
+            if (rt->ext_on_pending && rt->ext_on == (bool) mode)
+                break; // same as the held change
+            tw_stats_count(TW_CNT_EXT_REPORT);
+            if (rt->ext_on_pending)
+                tw_stats_count(TW_CNT_EXT_COALESCED);
+            rt->ext_on_pending = true;
+            rt->ext_on = mode;
+            rt->ext_on_version = rt->on_version;
+            rt->ext_first = rt->ext_first ? rt->ext_first : NowMs();
+            tw_poll_touch(data->index);
+            ApplyDueExternalChanges();
         } break;
         case MGOS_TWINKLY_EV_BRIGHTNESS: {
             int brightness = data->value;
-            LOG(LL_INFO, ("Twinkly %ld brightness: %ld", (long) data->index, (long) brightness));
-            if (data->index >= MAX_TWINKLY_DEVICES)
+            TW_LOG(DEV, LL_INFO, TW_MSG_DEV_BRIGHTNESS, data->index, brightness);
+            TW_TRACE_INSTANT("ev.brightness", data->index + 1, brightness);
+            if (data->index >= (int) accessoryConfiguration.numDevices)
                 break;
-            accessoryConfiguration.state.tw_state[data->index].brightness = brightness;
-            if (HAPAccessoryServerGetState(accessoryConfiguration.server) == kHAPAccessoryServerState_Running)
-                AccessoryNotification(
-                        accessory.services[3 + data->index], accessory.services[3 + data->index]->characteristics[2]);
-            led_on(150);
+            tw_runtime_t* rt = &accessoryConfiguration.tw_runtime[data->index];
+            rt->brightness_reported = true;
+            rt->brightness = brightness;
+            if (NowMs() < rt->brightness_pending_until &&
+                brightness != accessoryConfiguration.state.tw_state[data->index].brightness) {
+                // Report predates our command, the device will catch up
+                tw_stats_count(TW_CNT_STALE_REPORT);
+                break;
+            }
+            bool echo = rt->brightness_pending_until != 0;
+            rt->brightness_pending_until = 0;
+            rt->brightness_confirmed = NowMs();
+            if (accessoryConfiguration.state.tw_state[data->index].brightness == brightness) {
+                // Confirmation only, nothing to announce; a held external change was undone
+                if (echo)
+                    tw_stats_count(TW_CNT_ECHO);
+                rt->ext_brightness_pending = false;
+                rt->ext_first = rt->ext_on_pending ? rt->ext_first : 0;
+                break;
+            }
+            if (rt->ext_brightness_pending && rt->ext_brightness == brightness)
+                break; // same as the held change, still settling
+            tw_stats_count(TW_CNT_EXT_REPORT);
+            if (rt->ext_brightness_pending)
+                tw_stats_count(TW_CNT_EXT_COALESCED);
+            rt->ext_brightness_pending = true;
+            rt->ext_brightness = brightness;
+            rt->ext_brightness_version = rt->brightness_version;
+            rt->ext_brightness_moved = NowMs();
+            rt->ext_first = rt->ext_first ? rt->ext_first : NowMs();
+            tw_poll_touch(data->index);
+            ApplyDueExternalChanges();
         } break;
         case MGOS_TWINKLY_EV_ADDED:
         case MGOS_TWINKLY_EV_REMOVED: {
-            LOG(LL_INFO, ("Twinkly device list changed, restarting HAP server"));
+            if (ev == MGOS_TWINKLY_EV_REMOVED && data != NULL) {
+                RemoveDeviceState(data->index);
+                GroupRemoveDevice(data->index);
+            }
+            ResizeDeviceState(mgos_twinkly_count());
+            SaveAccessoryState();
             led_on(400);
+            // Instance ids follow the device index, so removing any but the last device would move the
+            // subscriptions of the devices after it onto their neighbours; a cold restart drops them instead
+            bool shifted = ev == MGOS_TWINKLY_EV_REMOVED && data != NULL && data->index < mgos_twinkly_count();
+            if (!shifted && mgos_sys_config_get_app_warm_restart() && AppAccessoryServerWarmRestart())
+                break;
+            LOG(LL_INFO, ("Twinkly device list changed, restarting HAP server"));
             RestartHAPServer();
             requestedServerRestart = true;
         } break;
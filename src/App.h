@@ -66,6 +66,46 @@ HAPError HandleLightBulbBrightnessWrite(
         int32_t value,
         void* _Nullable context HAP_UNUSED);
 
+/**
+ * Handle read request to the 'On' characteristic of the "All Twinkly" service: on if any device is.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterOnRead(
+        HAPAccessoryServerRef* server,
+        const HAPBoolCharacteristicReadRequest* request,
+        bool* value,
+        void* _Nullable context);
+
+/**
+ * Handle write request to the 'On' characteristic of the "All Twinkly" service, switches every device.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterOnWrite(
+        HAPAccessoryServerRef* server,
+        const HAPBoolCharacteristicWriteRequest* request,
+        bool value,
+        void* _Nullable context);
+
+/**
+ * Handle read request to the 'Brightness' characteristic of the "All Twinkly" service: the brightest device.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterBrightnessRead(
+        HAPAccessoryServerRef* server,
+        const HAPIntCharacteristicReadRequest* request,
+        int32_t* value,
+        void* _Nullable context);
+
+/**
+ * Handle write request to the 'Brightness' characteristic of the "All Twinkly" service.
+ */
+HAP_RESULT_USE_CHECK
+HAPError HandleMasterBrightnessWrite(
+        HAPAccessoryServerRef* server,
+        const HAPIntCharacteristicWriteRequest* request,
+        int32_t value,
+        void* _Nullable context);
+
 /**
  * Initialize the application.
  */
@@ -81,6 +121,12 @@ void AppRelease(void);
  */
 void AppAccessoryServerStart(void);
 
+/**
+ * Swap the attribute database of the running server for the current device list, keeping controller sessions.
+ * Returns false if the server is not running, a regular restart is needed then.
+ */
+bool AppAccessoryServerWarmRestart(void);
+
 /**
  * Handle the updated state of the Accessory Server.
  */
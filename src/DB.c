@@ -46,79 +46,238 @@
 //     .callbacks = { .handleRead = HAPHandleServiceSignatureRead, .handleWrite = NULL }
 // };
 
-HAPStringCharacteristic lightBulbNameCharacteristic = {
-    .format = kHAPCharacteristicFormat_String,
-    .iid = kIID_LightBulbName,
-    .characteristicType = &kHAPCharacteristicType_Name,
-    .debugDescription = kHAPCharacteristicDebugDescription_Name,
-    .manufacturerDescription = NULL,
-    .properties = { .readable = true,
-                    .writable = false,
-                    .supportsEventNotification = false,
-                    .hidden = false,
-                    .requiresTimedWrite = false,
-                    .supportsAuthorizationData = false,
-                    .ip = { .controlPoint = false, .supportsWriteResponse = false },
-                    .ble = { .supportsBroadcastNotification = false,
-                             .supportsDisconnectedNotification = false,
-                             .readableWithoutSecurity = false,
-                             .writableWithoutSecurity = false } },
-    .constraints = { .maxLength = 64 },
-    .callbacks = { .handleRead = HAPHandleNameRead, .handleWrite = NULL }
-};
 /**
- * The 'On' characteristic of the Light Bulb service.
+ * REPEAT(n, M) expands to M(0) M(1) ... M(n - 1), n up to the HAP limit of 96 devices.
+ */
+#define REPEAT_0(M)
+#define REPEAT_1(M) REPEAT_0(M) M(0)
+#define REPEAT_2(M) REPEAT_1(M) M(1)
+#define REPEAT_3(M) REPEAT_2(M) M(2)
+#define REPEAT_4(M) REPEAT_3(M) M(3)
+#define REPEAT_5(M) REPEAT_4(M) M(4)
+#define REPEAT_6(M) REPEAT_5(M) M(5)
+#define REPEAT_7(M) REPEAT_6(M) M(6)
+#define REPEAT_8(M) REPEAT_7(M) M(7)
+#define REPEAT_9(M) REPEAT_8(M) M(8)
+#define REPEAT_10(M) REPEAT_9(M) M(9)
+#define REPEAT_11(M) REPEAT_10(M) M(10)
+#define REPEAT_12(M) REPEAT_11(M) M(11)
+#define REPEAT_13(M) REPEAT_12(M) M(12)
+#define REPEAT_14(M) REPEAT_13(M) M(13)
+#define REPEAT_15(M) REPEAT_14(M) M(14)
+#define REPEAT_16(M) REPEAT_15(M) M(15)
+#define REPEAT_17(M) REPEAT_16(M) M(16)
+#define REPEAT_18(M) REPEAT_17(M) M(17)
+#define REPEAT_19(M) REPEAT_18(M) M(18)
+#define REPEAT_20(M) REPEAT_19(M) M(19)
+#define REPEAT_21(M) REPEAT_20(M) M(20)
+#define REPEAT_22(M) REPEAT_21(M) M(21)
+#define REPEAT_23(M) REPEAT_22(M) M(22)
+#define REPEAT_24(M) REPEAT_23(M) M(23)
+#define REPEAT_25(M) REPEAT_24(M) M(24)
+#define REPEAT_26(M) REPEAT_25(M) M(25)
+#define REPEAT_27(M) REPEAT_26(M) M(26)
+#define REPEAT_28(M) REPEAT_27(M) M(27)
+#define REPEAT_29(M) REPEAT_28(M) M(28)
+#define REPEAT_30(M) REPEAT_29(M) M(29)
+#define REPEAT_31(M) REPEAT_30(M) M(30)
+#define REPEAT_32(M) REPEAT_31(M) M(31)
+#define REPEAT_33(M) REPEAT_32(M) M(32)
+#define REPEAT_34(M) REPEAT_33(M) M(33)
+#define REPEAT_35(M) REPEAT_34(M) M(34)
+#define REPEAT_36(M) REPEAT_35(M) M(35)
+#define REPEAT_37(M) REPEAT_36(M) M(36)
+#define REPEAT_38(M) REPEAT_37(M) M(37)
+#define REPEAT_39(M) REPEAT_38(M) M(38)
+#define REPEAT_40(M) REPEAT_39(M) M(39)
+#define REPEAT_41(M) REPEAT_40(M) M(40)
+#define REPEAT_42(M) REPEAT_41(M) M(41)
+#define REPEAT_43(M) REPEAT_42(M) M(42)
+#define REPEAT_44(M) REPEAT_43(M) M(43)
+#define REPEAT_45(M) REPEAT_44(M) M(44)
+#define REPEAT_46(M) REPEAT_45(M) M(45)
+#define REPEAT_47(M) REPEAT_46(M) M(46)
+#define REPEAT_48(M) REPEAT_47(M) M(47)
+#define REPEAT_49(M) REPEAT_48(M) M(48)
+#define REPEAT_50(M) REPEAT_49(M) M(49)
+#define REPEAT_51(M) REPEAT_50(M) M(50)
+#define REPEAT_52(M) REPEAT_51(M) M(51)
+#define REPEAT_53(M) REPEAT_52(M) M(52)
+#define REPEAT_54(M) REPEAT_53(M) M(53)
+#define REPEAT_55(M) REPEAT_54(M) M(54)
+#define REPEAT_56(M) REPEAT_55(M) M(55)
+#define REPEAT_57(M) REPEAT_56(M) M(56)
+#define REPEAT_58(M) REPEAT_57(M) M(57)
+#define REPEAT_59(M) REPEAT_58(M) M(58)
+#define REPEAT_60(M) REPEAT_59(M) M(59)
+#define REPEAT_61(M) REPEAT_60(M) M(60)
+#define REPEAT_62(M) REPEAT_61(M) M(61)
+#define REPEAT_63(M) REPEAT_62(M) M(62)
+#define REPEAT_64(M) REPEAT_63(M) M(63)
+#define REPEAT_65(M) REPEAT_64(M) M(64)
+#define REPEAT_66(M) REPEAT_65(M) M(65)
+#define REPEAT_67(M) REPEAT_66(M) M(66)
+#define REPEAT_68(M) REPEAT_67(M) M(67)
+#define REPEAT_69(M) REPEAT_68(M) M(68)
+#define REPEAT_70(M) REPEAT_69(M) M(69)
+#define REPEAT_71(M) REPEAT_70(M) M(70)
+#define REPEAT_72(M) REPEAT_71(M) M(71)
+#define REPEAT_73(M) REPEAT_72(M) M(72)
+#define REPEAT_74(M) REPEAT_73(M) M(73)
+#define REPEAT_75(M) REPEAT_74(M) M(74)
+#define REPEAT_76(M) REPEAT_75(M) M(75)
+#define REPEAT_77(M) REPEAT_76(M) M(76)
+#define REPEAT_78(M) REPEAT_77(M) M(77)
+#define REPEAT_79(M) REPEAT_78(M) M(78)
+#define REPEAT_80(M) REPEAT_79(M) M(79)
+#define REPEAT_81(M) REPEAT_80(M) M(80)
+#define REPEAT_82(M) REPEAT_81(M) M(81)
+#define REPEAT_83(M) REPEAT_82(M) M(82)
+#define REPEAT_84(M) REPEAT_83(M) M(83)
+#define REPEAT_85(M) REPEAT_84(M) M(84)
+#define REPEAT_86(M) REPEAT_85(M) M(85)
+#define REPEAT_87(M) REPEAT_86(M) M(86)
+#define REPEAT_88(M) REPEAT_87(M) M(87)
+#define REPEAT_89(M) REPEAT_88(M) M(88)
+#define REPEAT_90(M) REPEAT_89(M) M(89)
+#define REPEAT_91(M) REPEAT_90(M) M(90)
+#define REPEAT_92(M) REPEAT_91(M) M(91)
+#define REPEAT_93(M) REPEAT_92(M) M(92)
+#define REPEAT_94(M) REPEAT_93(M) M(93)
+#define REPEAT_95(M) REPEAT_94(M) M(94)
+#define REPEAT_96(M) REPEAT_95(M) M(95)
+#define REPEAT_(n, M) REPEAT_##n(M)
+#define REPEAT(n, M)  REPEAT_(n, M)
+
+/**
+ * The 'Name' characteristic of the Light Bulb service of device `idx`.
+ */
+#define LIGHTBULB_NAME_CHARACTERISTIC(idx) {                                         \
+    .format = kHAPCharacteristicFormat_String,                                       \
+    .iid = kIID_LightBulbName + kIID_PoolSize * (idx),                               \
+    .characteristicType = &kHAPCharacteristicType_Name,                              \
+    .debugDescription = kHAPCharacteristicDebugDescription_Name,                     \
+    .manufacturerDescription = NULL,                                                 \
+    .properties = { .readable = true,                                                \
+                    .writable = false,                                               \
+                    .supportsEventNotification = false,                              \
+                    .hidden = false,                                                 \
+                    .requiresTimedWrite = false,                                     \
+                    .supportsAuthorizationData = false,                              \
+                    .ip = { .controlPoint = false, .supportsWriteResponse = false }, \
+                    .ble = { .supportsBroadcastNotification = false,                 \
+                             .supportsDisconnectedNotification = false,              \
+                             .readableWithoutSecurity = false,                       \
+                             .writableWithoutSecurity = false } },                   \
+    .constraints = { .maxLength = 64 },                                              \
+    .callbacks = { .handleRead = HAPHandleNameRead, .handleWrite = NULL }            \
+}
+
+/**
+ * The 'On' characteristic of the Light Bulb service of device `idx`, handled by `onRead` and `onWrite`.
+ */
+#define LIGHTBULB_ON_CHARACTERISTIC(idx, onRead, onWrite) {                          \
+    .format = kHAPCharacteristicFormat_Bool,                                         \
+    .iid = kIID_LightBulbOn + kIID_PoolSize * (idx),                                 \
+    .characteristicType = &kHAPCharacteristicType_On,                                \
+    .debugDescription = kHAPCharacteristicDebugDescription_On,                       \
+    .manufacturerDescription = NULL,                                                 \
+    .properties = { .readable = true,                                                \
+                    .writable = true,                                                \
+                    .supportsEventNotification = true,                               \
+                    .hidden = false,                                                 \
+                    .requiresTimedWrite = false,                                     \
+                    .supportsAuthorizationData = false,                              \
+                    .ip = { .controlPoint = false, .supportsWriteResponse = false }, \
+                    .ble = { .supportsBroadcastNotification = true,                  \
+                             .supportsDisconnectedNotification = true,               \
+                             .readableWithoutSecurity = false,                       \
+                             .writableWithoutSecurity = false } },                   \
+    .callbacks = { .handleRead = onRead, .handleWrite = onWrite }                    \
+}
+
+/**
+ * The 'Brightness' characteristic of the Light Bulb service of device `idx`, handled by `onRead` and `onWrite`.
+ */
+#define LIGHTBULB_BRIGHTNESS_CHARACTERISTIC(idx, onRead, onWrite) {                  \
+    .format = kHAPCharacteristicFormat_Int,                                          \
+    .iid = kIID_LightBulbBrightness + kIID_PoolSize * (idx),                         \
+    .characteristicType = &kHAPCharacteristicType_Brightness,                        \
+    .debugDescription = kHAPCharacteristicDebugDescription_Brightness,               \
+    .manufacturerDescription = NULL,                                                 \
+    .properties = { .readable = true,                                                \
+                    .writable = true,                                                \
+                    .supportsEventNotification = true,                               \
+                    .hidden = false,                                                 \
+                    .requiresTimedWrite = false,                                     \
+                    .supportsAuthorizationData = false,                              \
+                    .ip = { .controlPoint = false, .supportsWriteResponse = false }, \
+                    .ble = { .supportsBroadcastNotification = true,                  \
+                             .supportsDisconnectedNotification = true,               \
+                             .readableWithoutSecurity = false,                       \
+                             .writableWithoutSecurity = false } },                   \
+    .constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = 1 },       \
+    .callbacks = { .handleRead = onRead, .handleWrite = onWrite }                    \
+}
+
+/**
+ * Light Bulb characteristics of every device. They only differ in the iid pool, so they are built at compile time
+ * as const tables that stay in flash, instead of heap copies of a template.
  */
-HAPBoolCharacteristic lightBulbOnCharacteristic = {
-    .format = kHAPCharacteristicFormat_Bool,
-    .iid = kIID_LightBulbOn,
-    .characteristicType = &kHAPCharacteristicType_On,
-    .debugDescription = kHAPCharacteristicDebugDescription_On,
-    .manufacturerDescription = NULL,
-    .properties = { .readable = true,
-                    .writable = true,
-                    .supportsEventNotification = true,
-                    .hidden = false,
-                    .requiresTimedWrite = false,
-                    .supportsAuthorizationData = false,
-                    .ip = { .controlPoint = false, .supportsWriteResponse = false },
-                    .ble = { .supportsBroadcastNotification = true,
-                             .supportsDisconnectedNotification = true,
-                             .readableWithoutSecurity = false,
-                             .writableWithoutSecurity = false } },
-    .callbacks = { .handleRead = HandleLightBulbOnRead, .handleWrite = HandleLightBulbOnWrite }
+#define LIGHTBULB_CHARACTERISTICS(idx)                                                                              \
+    static const HAPStringCharacteristic lightBulbNameCharacteristic##idx = LIGHTBULB_NAME_CHARACTERISTIC(idx);     \
+    static const HAPBoolCharacteristic lightBulbOnCharacteristic##idx =                                             \
+            LIGHTBULB_ON_CHARACTERISTIC(idx, HandleLightBulbOnRead, HandleLightBulbOnWrite);                        \
+    static const HAPIntCharacteristic lightBulbBrightnessCharacteristic##idx = LIGHTBULB_BRIGHTNESS_CHARACTERISTIC( \
+            idx, HandleLightBulbBrightnessRead, HandleLightBulbBrightnessWrite);                                    \
+    static const HAPCharacteristic* const lightBulbCharacteristics##idx[] = {                                       \
+        &lightBulbNameCharacteristic##idx,                                                                          \
+        &lightBulbOnCharacteristic##idx,                                                                            \
+        &lightBulbBrightnessCharacteristic##idx,                                                                    \
+        NULL,                                                                                                       \
+    };
+#define LIGHTBULB_CHARACTERISTICS_REF(idx) lightBulbCharacteristics##idx,
+
+REPEAT(MAX_TWINKLY_DEVICES, LIGHTBULB_CHARACTERISTICS)
+
+const HAPCharacteristic* const* const lightBulbCharacteristics[MAX_TWINKLY_DEVICES] = {
+    REPEAT(MAX_TWINKLY_DEVICES, LIGHTBULB_CHARACTERISTICS_REF)
 };
 
-HAPIntCharacteristic lightBulbBrightnessCharacteristic = {
-    .format = kHAPCharacteristicFormat_Int,
-    .iid = kIID_LightBulbBrightness,
-    .characteristicType = &kHAPCharacteristicType_Brightness,
-    .debugDescription = kHAPCharacteristicDebugDescription_Brightness,
-    .manufacturerDescription = NULL,
-    .properties = { .readable = true,
-                    .writable = true,
-                    .supportsEventNotification = true,
-                    .hidden = false,
-                    .requiresTimedWrite = false,
-                    .supportsAuthorizationData = false,
-                    .ip = { .controlPoint = false, .supportsWriteResponse = false },
-                    .ble = { .supportsBroadcastNotification = true,
-                             .supportsDisconnectedNotification = true,
-                             .readableWithoutSecurity = false,
-                             .writableWithoutSecurity = false } },
-    .constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = 1 },
-    .callbacks = { .handleRead = HandleLightBulbBrightnessRead, .handleWrite = HandleLightBulbBrightnessWrite }
+/**
+ * Characteristics of the "All Twinkly" service, in the iid pool after the last device so they never move.
+ */
+static const HAPStringCharacteristic masterNameCharacteristic = LIGHTBULB_NAME_CHARACTERISTIC(MAX_TWINKLY_DEVICES);
+static const HAPBoolCharacteristic masterOnCharacteristic =
+        LIGHTBULB_ON_CHARACTERISTIC(MAX_TWINKLY_DEVICES, HandleMasterOnRead, HandleMasterOnWrite);
+static const HAPIntCharacteristic masterBrightnessCharacteristic = LIGHTBULB_BRIGHTNESS_CHARACTERISTIC(
+        MAX_TWINKLY_DEVICES, HandleMasterBrightnessRead, HandleMasterBrightnessWrite);
+
+/**
+ * Light Bulb service switching all devices at once.
+ */
+const HAPService masterLightBulbService = {
+    .iid = kIID_LightBulb + kIID_PoolSize * MAX_TWINKLY_DEVICES,
+    .serviceType = &kHAPServiceType_LightBulb,
+    .debugDescription = kHAPServiceDebugDescription_LightBulb,
+    .name = "All Twinkly",
+    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
+    .linkedServices = NULL,
+    .characteristics = (const HAPCharacteristic* const[]) { &masterNameCharacteristic,
+                                                            &masterOnCharacteristic,
+                                                            &masterBrightnessCharacteristic,
+                                                            NULL }
 };
 
 /**
  * The Light Bulb service that contains the 'On' characteristic.
  */
-HAPService lightBulbService = {
+const HAPService lightBulbService = {
     .iid = kIID_LightBulb,
     .serviceType = &kHAPServiceType_LightBulb,
     .debugDescription = kHAPServiceDebugDescription_LightBulb,
     .name = NULL, // Set on init
     .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
     .linkedServices = NULL,
-    .characteristics = NULL
+    .characteristics = NULL // Set on init
 };
@@ -20,11 +20,14 @@ extern "C" {
 /**
  * Services
  */
-extern HAPService lightBulbService;
-// extern HAPDataCharacteristic lightBulbServiceSignatureCharacteristic;
-extern HAPStringCharacteristic lightBulbNameCharacteristic;
-extern HAPBoolCharacteristic lightBulbOnCharacteristic;
-extern HAPIntCharacteristic lightBulbBrightnessCharacteristic;
+extern const HAPService lightBulbService;
+
+extern const HAPService masterLightBulbService;
+
+/**
+ * NULL terminated Light Bulb characteristics of each device, const.
+ */
+extern const HAPCharacteristic* const* const lightBulbCharacteristics[MAX_TWINKLY_DEVICES];
 
 #define kIID_PoolBitsize 16
 #define kIID_PoolSize ((uint64_t) 1 << kIID_PoolBitsize)
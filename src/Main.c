@@ -27,6 +27,21 @@
 #endif
 #include "mgos_twinkly.h"
 #include "reset_btn.h"
+#include "tw_bench.h"
+#include "tw_client.h"
+#include "tw_hapdiag.h"
+#include "tw_heap.h"
+#include "tw_kv.h"
+#include "tw_log.h"
+#include "tw_mdns.h"
+#include "tw_poll.h"
+#include "tw_queue.h"
+#include "tw_sched.h"
+#include "tw_stats.h"
+#include "tw_trace.h"
+#include "tw_udplog.h"
+#include "tw_web.h"
+#include "tw_wifi.h"
 
 static bool requestedFactoryReset = false;
 static bool clearPairings = false;
@@ -73,6 +88,31 @@ extern void AppInitialize(
 extern void AppDeinitialize();
 extern void AppAccessoryServerStart(void);
 extern void AccessoryServerHandleUpdatedState(HAPAccessoryServerRef* server, void* _Nullable context);
+/* Accessory server start is deferred until device state is resynchronized */
+static bool serverStartPending = false;
+
+static void resync_done_cb(int64_t took_ms, void* arg) {
+    LOG(LL_INFO, ("=== Devices resynchronized in %lld ms, starting accessory server", (long long) took_ms));
+    AppAccessoryServerStart();
+    (void) arg;
+}
+
+static void server_start_resync(void) {
+    if (!serverStartPending)
+        return;
+    serverStartPending = false;
+    tw_poll_resync(resync_done_cb, NULL);
+}
+
+static void net_wait_timer_cb(void* arg) {
+    if (serverStartPending) {
+        LOG(LL_WARN, ("=== No IP address in %d ms, starting accessory server", mgos_sys_config_get_app_resync_net_wait_ms()));
+        serverStartPending = false;
+        AppAccessoryServerStart();
+    }
+    (void) arg;
+}
+
 /* WiFi last event*/
 static int wifi_state = MGOS_WIFI_EV_STA_DISCONNECTED;
 
@@ -121,6 +161,7 @@ static void net_cb(int ev, void *evd, void *arg) {
       break;
     case MGOS_NET_EV_IP_ACQUIRED:
       LOG(LL_INFO, ("%s", "Net got IP address"));
+      server_start_resync();
       break;
   }
 
@@ -190,10 +231,11 @@ static void timer_cb(void* arg) {
  * Initialize global platform objects.
  */
 static void InitializePlatform() {
-    // Key-value store.
+    // Key-value store. Its calls end up in the state store once kv.json is moved over, see tw_kv.c
     HAPPlatformKeyValueStoreCreate(
             &platform.keyValueStore, &(const HAPPlatformKeyValueStoreOptions) { .fileName = "kv.json" });
     platform.hapPlatform.keyValueStore = &platform.keyValueStore;
+    tw_kv_migrate(&platform.keyValueStore, "kv.json");
 
     // Accessory setup manager. Depends on key-value store.
     static HAPPlatformAccessorySetup accessorySetup;
@@ -231,6 +273,8 @@ static void InitializePlatform() {
     platform.hapAccessoryServerOptions.maxPairings = kHAPPairingStorage_MinElements;
 
     platform.hapAccessoryServerCallbacks.handleUpdatedState = HandleUpdatedState;
+    platform.hapAccessoryServerCallbacks.handleSessionAccept = tw_hapdiag_session_accept;
+    platform.hapAccessoryServerCallbacks.handleSessionInvalidate = tw_hapdiag_session_invalidate;
 
     mgos_set_timer(1000, MGOS_TIMER_REPEAT, timer_cb, NULL);
 }
@@ -274,6 +318,12 @@ void HandleUpdatedState(HAPAccessoryServerRef* _Nonnull server, void* _Nullable
             HAPAssert(err == kHAPError_Unknown);
             HAPFatalError();
         }
+        err = tw_kv_purge_domain((HAPPlatformKeyValueStoreDomain) 0x00);
+        if (err) {
+            HAPAssert(err == kHAPError_Unknown);
+            HAPFatalError();
+        }
+        tw_sched_reset();
 
         // Reset HomeKit state.
         err = HAPRestoreFactorySettings(&platform.keyValueStore);
@@ -324,6 +374,8 @@ static void InitializeIP() {
     platform.hapAccessoryServerOptions.ip.accessoryServerStorage = &ipAccessoryServerStorage;
 
     platform.hapPlatform.ip.tcpStreamManager = &platform.tcpStreamManager;
+
+    tw_hapdiag_init(ipScratchBuffer, sizeof ipScratchBuffer, HAPArrayCount(ipSessions));
 }
 #endif
 
@@ -360,6 +412,8 @@ enum mgos_app_init_result mgos_app_init(void) {
     mgos_gpio_set_mode(mgos_sys_config_get_pins_led(), MGOS_GPIO_MODE_OUTPUT);
     mgos_gpio_write(mgos_sys_config_get_pins_led(), LED_OFF);
     mgos_set_timer(1000, MGOS_TIMER_REPEAT, wifi_timer_cb, NULL);
+    /* Web UI, the captive portal needs it too */
+    tw_web_init();
     /* Captive */
     if (mgos_sys_config_get_wifi_ap_enable()) {
         LOG(LL_WARN, ("Runing captive portal to setup WiFi"));
@@ -368,6 +422,21 @@ enum mgos_app_init_result mgos_app_init(void) {
     LOG(LL_INFO, ("Starting services..."));
     /* Twinkly events */
     mgos_event_add_group_handler(MGOS_EVENT_GRP_TWINKLY, twinkly_cb, NULL);
+    /* Diagnostics and state store */
+    tw_udplog_init();
+    tw_log_init();
+    tw_stats_init();
+    tw_trace_init();
+    tw_kv_init();
+    tw_bench_init();
+    tw_heap_init();
+    /* Device requests and status polling */
+    tw_client_init();
+    tw_queue_init();
+    tw_poll_init();
+    tw_mdns_init();
+    tw_sched_init();
+    tw_wifi_init();
     /* HAP */
     HAPAssert(HAPGetCompatibilityVersion() == HAP_COMPATIBILITY_VERSION);
     // Initialize global platform objects.
@@ -398,7 +467,10 @@ enum mgos_app_init_result mgos_app_init(void) {
 
     // Start accessory server for App.
     if (mgos_hap_config_valid()) {
-        AppAccessoryServerStart();
+        if (mgos_sys_config_get_app_resync_enable())
+            serverStartPending = true;
+        else
+            AppAccessoryServerStart();
     } else {
         LOG(LL_INFO, ("=== Accessory is not provisioned"));
     }
@@ -411,5 +483,18 @@ enum mgos_app_init_result mgos_app_init(void) {
     mgos_event_add_group_handler(MGOS_EVENT_GRP_WIFI, wifi_cb, NULL);
 #endif
 
+    if (serverStartPending) {
+#ifdef MGOS_HAVE_WIFI
+        // The station may have its address already, the event is not raised again then
+        struct mgos_net_ip_info ip_info;
+        if (mgos_net_get_ip_info(MGOS_NET_IF_TYPE_WIFI, MGOS_NET_IF_WIFI_STA, &ip_info) &&
+            ip_info.ip.sin_addr.s_addr != 0)
+            server_start_resync();
+#endif
+        // Do not wait for the network forever, HomeKit is still reachable over the AP or a later address
+        if (serverStartPending)
+            mgos_set_timer(mgos_sys_config_get_app_resync_net_wait_ms(), 0, net_wait_timer_cb, NULL);
+    }
+
     return MGOS_APP_INIT_SUCCESS;
 }
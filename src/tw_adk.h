@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "HAP.h"
+
+/**
+ * ADK internals the app depends on.
+ *
+ * None of these are public HAP API, they are written against the ADK bundled with the homekit-adk library and are
+ * kept here so that an ADK update has one place to check. Callers must have a fallback that only uses public calls.
+ */
+
+/**
+ * Publishes the _hap Bonjour record again, e.g. after the configuration number was increased, without stopping the
+ * accessory server. Needs a running IP accessory server.
+ */
+void tw_adk_update_discovery(HAPAccessoryServerRef* server);
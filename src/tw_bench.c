@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_bench.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#if TW_BENCH
+
+#define TW_BENCH_MAX_CASES      16
+#define TW_BENCH_WARMUP         3
+#define TW_BENCH_MIN_ITERATIONS 10
+#define TW_BENCH_MAX_ITERATIONS 2000 // a run blocks the loop, this keeps it within the WDT and the heap
+
+typedef struct {
+    const char* name;
+    tw_bench_fn_t fn;
+    void* arg;
+} tw_bench_case_t;
+
+static tw_bench_case_t s_cases[TW_BENCH_MAX_CASES];
+static int s_num_cases;
+
+void tw_bench_add(const char* name, tw_bench_fn_t fn, void* arg) {
+    if (s_num_cases == TW_BENCH_MAX_CASES) {
+        LOG(LL_ERROR, ("Too many benchmarks, %s dropped", name));
+        return;
+    }
+    s_cases[s_num_cases++] = (tw_bench_case_t) { name, fn, arg };
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    int iterations;
+    const char* only;
+    uint32_t* samples;
+} tw_bench_run_t;
+
+static int run_case(struct json_out* out, const tw_bench_run_t* run, const tw_bench_case_t* c) {
+    for (int i = 0; i < TW_BENCH_WARMUP; i++) {
+        if (!c->fn(c->arg))
+            return json_printf(out, "%Q: {skipped: true}", c->name);
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < run->iterations; i++) {
+        int64_t started = mgos_uptime_micros();
+        c->fn(c->arg);
+        run->samples[i] = mgos_uptime_micros() - started;
+        total += run->samples[i];
+        if (i % 100 == 99)
+            mgos_wdt_feed();
+    }
+    mgos_wdt_feed();
+    qsort(run->samples, run->iterations, sizeof(uint32_t), cmp_u32);
+    return json_printf(
+            out,
+            "%Q: {mean_us: %.1f, p50_us: %u, p90_us: %u, max_us: %u}",
+            c->name,
+            (double) total / run->iterations,
+            (unsigned) run->samples[run->iterations / 2],
+            (unsigned) run->samples[run->iterations * 9 / 10],
+            (unsigned) run->samples[run->iterations - 1]);
+}
+
+static int print_results(struct json_out* out, va_list* ap) {
+    const tw_bench_run_t* run = va_arg(*ap, const tw_bench_run_t*);
+    int len = 0;
+    bool first = true;
+    for (int i = 0; i < s_num_cases; i++) {
+        if (run->only && strcmp(run->only, s_cases[i].name) != 0)
+            continue;
+        len += json_printf(out, first ? "" : ", ");
+        len += run_case(out, run, &s_cases[i]);
+        first = false;
+    }
+    return len;
+}
+
+static void bench_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    tw_bench_run_t run = { .iterations = 200 };
+    char* only = NULL;
+    json_scanf(args.p, args.len, ri->args_fmt, &run.iterations, &only);
+    if (run.iterations < TW_BENCH_MIN_ITERATIONS)
+        run.iterations = TW_BENCH_MIN_ITERATIONS;
+    if (run.iterations > TW_BENCH_MAX_ITERATIONS)
+        run.iterations = TW_BENCH_MAX_ITERATIONS;
+    run.only = only;
+    run.samples = malloc(run.iterations * sizeof(uint32_t));
+    if (run.samples == NULL) {
+        mg_rpc_send_errorf(ri, 500, "out of memory");
+        free(only);
+        return;
+    }
+    size_t heap = mgos_get_free_heap_size();
+    // Log lines of the code under test, one per service when building the list, would be timed too
+    enum cs_log_level level = cs_log_level;
+    cs_log_set_level(LL_WARN);
+    mg_rpc_send_responsef(
+            ri,
+            "{iterations: %d, free_heap: %u, min_free_heap: %u, results: {%M}}",
+            run.iterations,
+            (unsigned) heap,
+            (unsigned) mgos_get_min_free_heap_size(),
+            print_results,
+            &run);
+    cs_log_set_level(level);
+    free(run.samples);
+    free(only);
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_bench_init(void) {
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Bench", "{iterations: %d, only: %Q}", bench_handler, NULL);
+    return true;
+}
+
+#else
+
+void tw_bench_add(const char* name, tw_bench_fn_t fn, void* arg) {
+    (void) name;
+    (void) fn;
+    (void) arg;
+}
+
+bool tw_bench_init(void) {
+    return true;
+}
+
+#endif
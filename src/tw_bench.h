@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * On-device micro benchmarks of the hub hot paths.
+ *
+ * Modules register cases with tw_bench_add(), Hub.Bench runs each of them `iterations` times and reports mean,
+ * p50, p90 and max in microseconds. tools/bench.py compares the result against a stored baseline. Only built
+ * with `mos build ... --build-var BENCH=1`, otherwise the calls are no-ops.
+ */
+
+#ifndef TW_BENCH
+#define TW_BENCH 0
+#endif
+
+/**
+ * One run of the measured operation. Returns false if it can't run now, e.g. there are no devices.
+ */
+typedef bool (*tw_bench_fn_t)(void* arg);
+
+bool tw_bench_init(void);
+
+void tw_bench_add(const char* name, tw_bench_fn_t fn, void* arg);
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_client.h"
+
+#include "mgos.h"
+#include "mgos_event.h"
+#include "mgos_mongoose.h"
+#include "mgos_twinkly.h"
+#include "tw_heap.h"
+#include "tw_stats.h"
+#include "tw_trace.h"
+
+#define TW_API_PREFIX   "/xled/v1/"
+#define TW_CODE_OK      1000
+#define TW_IP_LEN       16
+#define TW_TOKEN_LEN    48
+#define TW_MAC_LEN      18
+#define TW_MAX_STEPS    6
+
+enum tw_step {
+    TW_STEP_LOGIN,
+    TW_STEP_VERIFY,
+    TW_STEP_MODE,
+    TW_STEP_BRIGHTNESS,
+    TW_STEP_SET_MODE,
+    TW_STEP_SET_BRIGHTNESS,
+};
+
+typedef struct {
+    char lib_ip[TW_IP_LEN]; // address known to the twinkly library
+    char ip[TW_IP_LEN];     // current address, may be updated by discovery
+    char mac[TW_MAC_LEN];
+    char token[TW_TOKEN_LEN];
+    double token_expires;
+} tw_device_t;
+
+struct tw_call {
+    int index;
+    enum tw_step steps[TW_MAX_STEPS];
+    int num_steps;
+    int pos;
+    bool replied;
+    bool relogin;
+    char* challenge_response;
+    tw_client_status_t status;
+    tw_client_status_t set; // values to write
+    tw_client_cb_t cb;
+    void* arg;
+    int64_t started;
+    uint32_t trace_id;
+};
+
+static uint32_t s_call_seq = 0;
+static tw_device_t* s_devices = NULL; // sized to the device list
+static int s_count = 0;
+static int s_capacity = 0;
+
+static bool tw_call_start_step(struct tw_call* call);
+
+static bool reload_cb(int idx, const struct mg_str* ip, const struct mg_str* json) {
+    if (idx >= s_capacity)
+        return false;
+    tw_device_t* dev = &s_devices[idx];
+    if (mg_vcmp(ip, dev->lib_ip) != 0) {
+        // New device at this index, drop the token
+        char* mac = NULL;
+        memset(dev, 0, sizeof(*dev));
+        snprintf(dev->lib_ip, sizeof(dev->lib_ip), "%.*s", (int) ip->len, ip->p);
+        strcpy(dev->ip, dev->lib_ip);
+        if (json_scanf(json->p, json->len, "{mac: %Q}", &mac) == 1 && strlen(mac) < sizeof(dev->mac))
+            strcpy(dev->mac, mac);
+        free(mac);
+    }
+    s_count = idx + 1;
+    return true;
+}
+
+static void resize(int capacity) {
+    if (capacity == s_capacity)
+        return;
+    if (capacity == 0) {
+        tw_heap_free(s_devices);
+        s_devices = NULL;
+        s_capacity = 0;
+        return;
+    }
+    tw_device_t* devices = tw_heap_realloc(TW_HEAP_STATE, s_devices, capacity * sizeof(*devices));
+    if (devices == NULL) {
+        LOG(LL_ERROR, ("No memory for %d devices", capacity));
+        return; // keep serving the ones that fit
+    }
+    if (capacity > s_capacity)
+        memset(&devices[s_capacity], 0, (capacity - s_capacity) * sizeof(*devices));
+    s_devices = devices;
+    s_capacity = capacity;
+}
+
+void tw_client_reload(void) {
+    int n = mgos_twinkly_count();
+    resize(n < MAX_TWINKLY_DEVICES ? n : MAX_TWINKLY_DEVICES);
+    s_count = 0;
+    mgos_twinkly_iterate(reload_cb);
+    for (int i = s_count; i < s_capacity; i++)
+        memset(&s_devices[i], 0, sizeof(s_devices[i]));
+    LOG(LL_DEBUG, ("%s: %d devices", __func__, s_count));
+}
+
+int tw_client_count(void) {
+    return s_count;
+}
+
+const char* tw_client_get_ip(int index) {
+    return (index >= 0 && index < s_count) ? s_devices[index].ip : NULL;
+}
+
+const char* tw_client_get_mac(int index) {
+    return (index >= 0 && index < s_count) ? s_devices[index].mac : NULL;
+}
+
+int tw_client_find(const char* ip) {
+    for (int i = 0; i < s_count; i++) {
+        if (strcmp(s_devices[i].lib_ip, ip) == 0 || strcmp(s_devices[i].ip, ip) == 0)
+            return i;
+    }
+    return -1;
+}
+
+bool tw_client_set_ip(int index, const char* ip) {
+    if (index < 0 || index >= s_count || strlen(ip) >= TW_IP_LEN)
+        return false;
+    tw_device_t* dev = &s_devices[index];
+    if (strcmp(dev->ip, ip) == 0)
+        return false;
+    LOG(LL_INFO, ("Twinkly %d address changed: %s -> %s", index, dev->ip, ip));
+    strcpy(dev->ip, ip);
+    dev->token[0] = '\0';
+    return true;
+}
+
+static bool token_valid(const tw_device_t* dev) {
+    return dev->token[0] && mgos_uptime() < dev->token_expires;
+}
+
+static void tw_call_finish(struct tw_call* call, bool ok) {
+    tw_stats_record(TW_STAT_DEVICE_REQ, mgos_uptime_micros() - call->started, ok);
+    TW_TRACE_ASYNC_END("device.call", call->index + 1, call->trace_id, ok);
+    if (call->cb)
+        call->cb(call->index, ok, &call->status, call->arg);
+    free(call->challenge_response);
+    free(call);
+}
+
+/* Returns false on a protocol level failure of the step */
+static bool tw_call_handle_reply(struct tw_call* call, struct http_message* hm) {
+    tw_device_t* dev = &s_devices[call->index];
+    int code = 0;
+    if (hm->resp_code == 401 && call->steps[call->pos] != TW_STEP_LOGIN && !call->relogin) {
+        // Token expired on the device side, login once more and repeat the step
+        dev->token[0] = '\0';
+        call->relogin = true;
+        memmove(&call->steps[call->pos + 2],
+                &call->steps[call->pos],
+                (call->num_steps - call->pos) * sizeof(call->steps[0]));
+        call->steps[call->pos] = TW_STEP_LOGIN;
+        call->steps[call->pos + 1] = TW_STEP_VERIFY;
+        call->num_steps += 2;
+        call->pos--; // tw_call_start_step advances
+        return true;
+    }
+    if (hm->resp_code != 200)
+        return false;
+    switch (call->steps[call->pos]) {
+        case TW_STEP_LOGIN: {
+            char* token = NULL;
+            int expires = 0;
+            free(call->challenge_response);
+            call->challenge_response = NULL;
+            json_scanf(
+                    hm->body.p,
+                    hm->body.len,
+                    "{authentication_token: %Q, authentication_token_expires_in: %d, challenge-response: %Q, code: %d}",
+                    &token,
+                    &expires,
+                    &call->challenge_response,
+                    &code);
+            bool ok = (code == TW_CODE_OK && token != NULL && strlen(token) < sizeof(dev->token));
+            if (ok) {
+                strcpy(dev->token, token);
+                // Renew a minute before the device forgets us
+                dev->token_expires = mgos_uptime() + (expires > 60 ? expires - 60 : expires);
+            }
+            free(token);
+            return ok;
+        }
+        case TW_STEP_VERIFY: {
+            json_scanf(hm->body.p, hm->body.len, "{code: %d}", &code);
+            if (code != TW_CODE_OK)
+                dev->token[0] = '\0';
+            return code == TW_CODE_OK;
+        }
+        case TW_STEP_MODE: {
+            char* mode = NULL;
+            json_scanf(hm->body.p, hm->body.len, "{mode: %Q, code: %d}", &mode, &code);
+            if (mode != NULL)
+                call->status.on = (strcmp(mode, "off") != 0);
+            free(mode);
+            return code == TW_CODE_OK && mode != NULL;
+        }
+        case TW_STEP_BRIGHTNESS: {
+            char* mode = NULL;
+            int value = 100;
+            json_scanf(hm->body.p, hm->body.len, "{value: %d, mode: %Q, code: %d}", &value, &mode, &code);
+            // Dimming disabled means full brightness
+            call->status.brightness = (mode != NULL && strcmp(mode, "disabled") == 0) ? 100 : value;
+            free(mode);
+            return code == TW_CODE_OK;
+        }
+        case TW_STEP_SET_MODE:
+        case TW_STEP_SET_BRIGHTNESS: {
+            json_scanf(hm->body.p, hm->body.len, "{code: %d}", &code);
+            return code == TW_CODE_OK;
+        }
+    }
+    return false;
+}
+
+static void tw_call_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    struct tw_call* call = user_data;
+    switch (ev) {
+        case MG_EV_HTTP_REPLY: {
+            struct http_message* hm = ev_data;
+            TW_TRACE_INSTANT("http.reply", call->index + 1, hm->resp_code);
+            // The device may have been removed while the request was running
+            call->replied = call->index < s_count && tw_call_handle_reply(call, hm);
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        } break;
+        case MG_EV_TIMER: {
+            LOG(LL_DEBUG, ("Twinkly %d request timeout", call->index));
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        } break;
+        case MG_EV_CLOSE: {
+            if (call->replied) {
+                call->replied = false;
+                call->pos++;
+                if (call->pos >= call->num_steps)
+                    tw_call_finish(call, true);
+                else if (!tw_call_start_step(call))
+                    tw_call_finish(call, false);
+            } else {
+                tw_call_finish(call, false);
+            }
+        } break;
+    }
+}
+
+static bool tw_call_start_step(struct tw_call* call) {
+    if (call->index >= s_count)
+        return false;
+    tw_device_t* dev = &s_devices[call->index];
+    const char* path = NULL;
+    char* post = NULL;
+    char headers[96];
+    switch (call->steps[call->pos]) {
+        case TW_STEP_LOGIN: {
+            unsigned char challenge[32];
+            char b64[48];
+            for (size_t i = 0; i < sizeof(challenge); i++)
+                challenge[i] = (unsigned char) rand();
+            cs_base64_encode(challenge, sizeof(challenge), b64);
+            path = "login";
+            mg_asprintf(&post, 0, "{\"challenge\": \"%s\"}", b64);
+        } break;
+        case TW_STEP_VERIFY: {
+            path = "verify";
+            mg_asprintf(
+                    &post,
+                    0,
+                    "{\"challenge-response\": \"%s\"}",
+                    call->challenge_response ? call->challenge_response : "");
+        } break;
+        case TW_STEP_MODE:
+            path = "led/mode";
+            break;
+        case TW_STEP_BRIGHTNESS:
+            path = "led/out/brightness";
+            break;
+        case TW_STEP_SET_MODE:
+            path = "led/mode";
+            mg_asprintf(&post, 0, "{\"mode\": \"%s\"}", call->set.on ? "movie" : "off");
+            break;
+        case TW_STEP_SET_BRIGHTNESS:
+            path = "led/out/brightness";
+            mg_asprintf(&post, 0, "{\"mode\": \"enabled\", \"type\": \"A\", \"value\": %d}", call->set.brightness);
+            break;
+    }
+    char* url = NULL;
+    mg_asprintf(&url, 0, "http://%s" TW_API_PREFIX "%s", dev->ip, path);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nX-Auth-Token: %s\r\n", dev->token);
+    TW_TRACE_INSTANT("http.send", call->index + 1, call->steps[call->pos]);
+    struct mg_connection* nc = mg_connect_http(mgos_get_mgr(), tw_call_ev_handler, call, url, headers, post);
+    free(url);
+    free(post);
+    if (nc == NULL)
+        return false;
+    mg_set_timer(nc, mg_time() + mgos_sys_config_get_app_timeout_ms() / 1000.0);
+    return true;
+}
+
+static struct tw_call* tw_call_new(int index, tw_client_cb_t cb, void* arg) {
+    if (index < 0 || index >= s_count)
+        return NULL;
+    struct tw_call* call = calloc(1, sizeof(*call));
+    if (call == NULL)
+        return NULL;
+    call->index = index;
+    call->cb = cb;
+    call->arg = arg;
+    call->started = mgos_uptime_micros();
+    call->trace_id = ++s_call_seq;
+    TW_TRACE_ASYNC_BEGIN("device.call", index + 1, call->trace_id);
+    if (!token_valid(&s_devices[index])) {
+        call->steps[call->num_steps++] = TW_STEP_LOGIN;
+        call->steps[call->num_steps++] = TW_STEP_VERIFY;
+    }
+    return call;
+}
+
+static bool tw_call_start(struct tw_call* call) {
+    if (!tw_call_start_step(call)) {
+        free(call);
+        return false;
+    }
+    return true;
+}
+
+bool tw_client_get_status(int index, tw_client_cb_t cb, void* arg) {
+    struct tw_call* call = tw_call_new(index, cb, arg);
+    if (call == NULL)
+        return false;
+    call->steps[call->num_steps++] = TW_STEP_MODE;
+    call->steps[call->num_steps++] = TW_STEP_BRIGHTNESS;
+    return tw_call_start(call);
+}
+
+bool tw_client_set_state(int index, int on, int brightness, tw_client_cb_t cb, void* arg) {
+    struct tw_call* call = tw_call_new(index, cb, arg);
+    if (call == NULL)
+        return false;
+    // Brightness first, so the device does not light up at the old level
+    if (brightness >= 0) {
+        call->set.brightness = call->status.brightness = brightness;
+        call->steps[call->num_steps++] = TW_STEP_SET_BRIGHTNESS;
+    }
+    if (on >= 0) {
+        call->set.on = call->status.on = on;
+        call->steps[call->num_steps++] = TW_STEP_SET_MODE;
+    }
+    return tw_call_start(call);
+}
+
+bool tw_client_set_mode(int index, bool on, tw_client_cb_t cb, void* arg) {
+    return tw_client_set_state(index, on, -1, cb, arg);
+}
+
+bool tw_client_set_brightness(int index, int brightness, tw_client_cb_t cb, void* arg) {
+    return tw_client_set_state(index, -1, brightness, cb, arg);
+}
+
+static void twinkly_list_cb(int ev, void* ev_data, void* userdata) {
+    tw_client_reload();
+    (void) ev;
+    (void) ev_data;
+    (void) userdata;
+}
+
+bool tw_client_init(void) {
+    mgos_event_add_handler(MGOS_TWINKLY_EV_INITIALIZED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_ADDED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_REMOVED, twinkly_list_cb, NULL);
+    tw_client_reload();
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Minimal asynchronous Twinkly HTTP client used by the hub for status queries and commands.
+ * Devices are addressed by the same index the twinkly library uses.
+ */
+
+typedef struct {
+    bool on;
+    int brightness;
+} tw_client_status_t;
+
+/**
+ * Completion callback. `ok` is false when the device did not answer in time.
+ * For commands `status` holds the written value.
+ */
+typedef void (*tw_client_cb_t)(int index, bool ok, const tw_client_status_t* status, void* arg);
+
+bool tw_client_init(void);
+
+/**
+ * Re-read device addresses from the twinkly library.
+ */
+void tw_client_reload(void);
+
+int tw_client_count(void);
+
+const char* tw_client_get_ip(int index);
+
+const char* tw_client_get_mac(int index);
+
+/**
+ * Index of the device by its configured or current address, -1 if unknown.
+ */
+int tw_client_find(const char* ip);
+
+/**
+ * Point the device at a new address, e.g. after a DHCP lease change. Returns true if the address changed.
+ */
+bool tw_client_set_ip(int index, const char* ip);
+
+/**
+ * Fetch current mode and brightness of the device, logging in when needed.
+ */
+bool tw_client_get_status(int index, tw_client_cb_t cb, void* arg);
+
+/**
+ * Switch the device to movie mode or off.
+ */
+bool tw_client_set_mode(int index, bool on, tw_client_cb_t cb, void* arg);
+
+bool tw_client_set_brightness(int index, int brightness, tw_client_cb_t cb, void* arg);
+
+/**
+ * Apply mode and brightness in one call, a negative value leaves that one as it is.
+ */
+bool tw_client_set_state(int index, int on, int brightness, tw_client_cb_t cb, void* arg);
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_hapdiag.h"
+
+#include "HAP+Internal.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#define TW_HAPDIAG_PAINT 0xA5
+
+typedef struct {
+    HAPPlatformTCPStreamRef stream; // 0 if the slot is free
+    int64_t opened_ms;
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t requests;
+    uint32_t events;
+    uint32_t crypto_us;
+} tw_hapdiag_session_t;
+
+static struct {
+    tw_hapdiag_session_t* sessions;
+    size_t max_sessions;
+    HAPPlatformTCPStreamRef current; // stream last read, decryption belongs to it
+    // Encryption done before the next write, the write tells which session it was for
+    struct {
+        uint32_t us;
+        uint32_t responses;
+        uint32_t events;
+    } pending;
+    uint8_t* scratch;
+    size_t scratch_size;
+    // totals since boot
+    uint32_t accepted;
+    uint32_t closed;
+    uint32_t rejected; // no free slot here, the ADK limit is the same
+    uint32_t active_max;
+    uint32_t hap_sessions;
+    uint32_t hap_sessions_max;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t requests; // responses sent, the ADK answers every request
+    uint32_t events;
+    uint64_t crypto_us;
+} s_diag;
+
+HAPError __real_HAPPlatformTCPStreamManagerAcceptTCPStream(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef* tcpStream);
+HAPError __real_HAPPlatformTCPStreamRead(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef tcpStream,
+        void* bytes,
+        size_t maxBytes,
+        size_t* numBytes);
+HAPError __real_HAPPlatformTCPStreamWrite(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef tcpStream,
+        const void* bytes,
+        size_t maxBytes,
+        size_t* numBytes);
+void __real_HAPPlatformTCPStreamClose(HAPPlatformTCPStreamManagerRef manager, HAPPlatformTCPStreamRef tcpStream);
+void __real_HAP_chacha20_poly1305_encrypt_aad(
+        uint8_t tag[16],
+        uint8_t* c,
+        const uint8_t* m,
+        size_t m_len,
+        const uint8_t* a,
+        size_t a_len,
+        const uint8_t* n,
+        size_t n_len,
+        const uint8_t k[32]);
+int __real_HAP_chacha20_poly1305_decrypt_aad(
+        const uint8_t tag[16],
+        uint8_t* m,
+        const uint8_t* c,
+        size_t c_len,
+        const uint8_t* a,
+        size_t a_len,
+        const uint8_t* n,
+        size_t n_len,
+        const uint8_t k[32]);
+
+static tw_hapdiag_session_t* find(HAPPlatformTCPStreamRef stream) {
+    for (size_t i = 0; stream && i < s_diag.max_sessions; i++) {
+        if (s_diag.sessions[i].stream == stream)
+            return &s_diag.sessions[i];
+    }
+    return NULL;
+}
+
+static uint32_t active(void) {
+    uint32_t n = 0;
+    for (size_t i = 0; i < s_diag.max_sessions; i++)
+        n += s_diag.sessions[i].stream != 0;
+    return n;
+}
+
+static bool starts_with(const uint8_t* p, size_t len, const char* prefix) {
+    size_t n = strlen(prefix);
+    return len >= n && memcmp(p, prefix, n) == 0;
+}
+
+HAPError __wrap_HAPPlatformTCPStreamManagerAcceptTCPStream(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef* tcpStream) {
+    HAPError err = __real_HAPPlatformTCPStreamManagerAcceptTCPStream(manager, tcpStream);
+    if (err || s_diag.sessions == NULL)
+        return err;
+    s_diag.accepted++;
+    tw_hapdiag_session_t* s = find(*tcpStream);
+    for (size_t i = 0; s == NULL && i < s_diag.max_sessions; i++) {
+        if (s_diag.sessions[i].stream == 0)
+            s = &s_diag.sessions[i];
+    }
+    if (s == NULL) {
+        s_diag.rejected++;
+        return err;
+    }
+    memset(s, 0, sizeof(*s));
+    s->stream = *tcpStream;
+    s->opened_ms = mgos_uptime_micros() / 1000;
+    uint32_t n = active();
+    if (n > s_diag.active_max)
+        s_diag.active_max = n;
+    return err;
+}
+
+HAPError __wrap_HAPPlatformTCPStreamRead(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef tcpStream,
+        void* bytes,
+        size_t maxBytes,
+        size_t* numBytes) {
+    HAPError err = __real_HAPPlatformTCPStreamRead(manager, tcpStream, bytes, maxBytes, numBytes);
+    s_diag.current = tcpStream;
+    if (err)
+        return err;
+    s_diag.bytes_in += *numBytes;
+    tw_hapdiag_session_t* s = find(tcpStream);
+    if (s)
+        s->bytes_in += *numBytes;
+    return err;
+}
+
+HAPError __wrap_HAPPlatformTCPStreamWrite(
+        HAPPlatformTCPStreamManagerRef manager,
+        HAPPlatformTCPStreamRef tcpStream,
+        const void* bytes,
+        size_t maxBytes,
+        size_t* numBytes) {
+    HAPError err = __real_HAPPlatformTCPStreamWrite(manager, tcpStream, bytes, maxBytes, numBytes);
+    tw_hapdiag_session_t* s = find(tcpStream);
+    if (s) {
+        s->crypto_us += s_diag.pending.us;
+        s->requests += s_diag.pending.responses;
+        s->events += s_diag.pending.events;
+    } else {
+        s_diag.requests += s_diag.pending.responses;
+        s_diag.events += s_diag.pending.events;
+    }
+    memset(&s_diag.pending, 0, sizeof(s_diag.pending));
+    if (err)
+        return err;
+    s_diag.bytes_out += *numBytes;
+    if (s)
+        s->bytes_out += *numBytes;
+    return err;
+}
+
+void __wrap_HAPPlatformTCPStreamClose(HAPPlatformTCPStreamManagerRef manager, HAPPlatformTCPStreamRef tcpStream) {
+    tw_hapdiag_session_t* s = find(tcpStream);
+    if (s) {
+        s_diag.closed++;
+        s_diag.requests += s->requests;
+        s_diag.events += s->events;
+        s->stream = 0;
+    }
+    if (s_diag.current == tcpStream)
+        s_diag.current = 0;
+    __real_HAPPlatformTCPStreamClose(manager, tcpStream);
+}
+
+void __wrap_HAP_chacha20_poly1305_encrypt_aad(
+        uint8_t tag[16],
+        uint8_t* c,
+        const uint8_t* m,
+        size_t m_len,
+        const uint8_t* a,
+        size_t a_len,
+        const uint8_t* n,
+        size_t n_len,
+        const uint8_t k[32]) {
+    // Each outgoing message starts a new frame, continuation frames carry the rest of the body
+    if (starts_with(m, m_len, "HTTP/1.1 "))
+        s_diag.pending.responses++;
+    else if (starts_with(m, m_len, "EVENT/1.0 "))
+        s_diag.pending.events++;
+    int64_t started = mgos_uptime_micros();
+    __real_HAP_chacha20_poly1305_encrypt_aad(tag, c, m, m_len, a, a_len, n, n_len, k);
+    uint32_t took = mgos_uptime_micros() - started;
+    s_diag.pending.us += took;
+    s_diag.crypto_us += took;
+}
+
+int __wrap_HAP_chacha20_poly1305_decrypt_aad(
+        const uint8_t tag[16],
+        uint8_t* m,
+        const uint8_t* c,
+        size_t c_len,
+        const uint8_t* a,
+        size_t a_len,
+        const uint8_t* n,
+        size_t n_len,
+        const uint8_t k[32]) {
+    int64_t started = mgos_uptime_micros();
+    int res = __real_HAP_chacha20_poly1305_decrypt_aad(tag, m, c, c_len, a, a_len, n, n_len, k);
+    uint32_t took = mgos_uptime_micros() - started;
+    s_diag.crypto_us += took;
+    tw_hapdiag_session_t* s = find(s_diag.current);
+    if (s)
+        s->crypto_us += took;
+    return res;
+}
+
+void tw_hapdiag_session_accept(HAPAccessoryServerRef* server, HAPSessionRef* session, void* _Nullable context) {
+    s_diag.hap_sessions++;
+    if (s_diag.hap_sessions > s_diag.hap_sessions_max)
+        s_diag.hap_sessions_max = s_diag.hap_sessions;
+    (void) server;
+    (void) session;
+    (void) context;
+}
+
+void tw_hapdiag_session_invalidate(HAPAccessoryServerRef* server, HAPSessionRef* session, void* _Nullable context) {
+    if (s_diag.hap_sessions > 0)
+        s_diag.hap_sessions--;
+    (void) server;
+    (void) session;
+    (void) context;
+}
+
+/* Scratch buffer bytes ever used, the ADK fills it from the start */
+static size_t scratch_high_water(void) {
+    size_t used = s_diag.scratch_size;
+    while (used > 0 && s_diag.scratch[used - 1] == TW_HAPDIAG_PAINT)
+        used--;
+    return used;
+}
+
+static int print_sessions(struct json_out* out, va_list* ap) {
+    int64_t now = mgos_uptime_micros() / 1000;
+    int len = 0;
+    bool first = true;
+    for (size_t i = 0; i < s_diag.max_sessions; i++) {
+        const tw_hapdiag_session_t* s = &s_diag.sessions[i];
+        if (s->stream == 0)
+            continue;
+        len += json_printf(
+                out,
+                "%s{slot: %d, age_s: %lld, bytes_in: %u, bytes_out: %u, requests: %u, events: %u, crypto_us: %u}",
+                first ? "" : ", ",
+                (int) i,
+                (long long) ((now - s->opened_ms) / 1000),
+                (unsigned) s->bytes_in,
+                (unsigned) s->bytes_out,
+                (unsigned) s->requests,
+                (unsigned) s->events,
+                (unsigned) s->crypto_us);
+        first = false;
+    }
+    (void) ap;
+    return len;
+}
+
+static void sessions_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    // Totals hold closed sessions, add the open ones
+    uint32_t requests = 0, events = 0;
+    for (size_t i = 0; i < s_diag.max_sessions; i++) {
+        if (s_diag.sessions[i].stream == 0)
+            continue;
+        requests += s_diag.sessions[i].requests;
+        events += s_diag.sessions[i].events;
+    }
+    mg_rpc_send_responsef(
+            ri,
+            "{sessions: [%M], active: %u, active_max: %u, slots: %u, accepted: %u, closed: %u, rejected: %u, "
+            "hap_sessions: %u, hap_sessions_max: %u, bytes_in: %llu, bytes_out: %llu, requests: %u, events: %u, "
+            "crypto_us: %llu, scratch: {size: %u, high_water: %u}}",
+            print_sessions,
+            (unsigned) active(),
+            (unsigned) s_diag.active_max,
+            (unsigned) s_diag.max_sessions,
+            (unsigned) s_diag.accepted,
+            (unsigned) s_diag.closed,
+            (unsigned) s_diag.rejected,
+            (unsigned) s_diag.hap_sessions,
+            (unsigned) s_diag.hap_sessions_max,
+            (unsigned long long) s_diag.bytes_in,
+            (unsigned long long) s_diag.bytes_out,
+            (unsigned) (s_diag.requests + requests),
+            (unsigned) (s_diag.events + events),
+            (unsigned long long) s_diag.crypto_us,
+            (unsigned) s_diag.scratch_size,
+            (unsigned) scratch_high_water());
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_hapdiag_init(uint8_t* scratch, size_t scratch_size, size_t max_sessions) {
+    s_diag.sessions = calloc(max_sessions, sizeof(tw_hapdiag_session_t));
+    if (s_diag.sessions == NULL)
+        return false;
+    s_diag.max_sessions = max_sessions;
+    s_diag.scratch = scratch;
+    s_diag.scratch_size = scratch_size;
+    memset(scratch, TW_HAPDIAG_PAINT, scratch_size);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "HAP.Sessions", "", sessions_handler, NULL);
+    return true;
+}
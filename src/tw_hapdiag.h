@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HAP.h"
+
+/**
+ * HomeKit session and traffic diagnostics.
+ *
+ * The TCP stream and ChaCha20-Poly1305 calls of the ADK are wrapped at link time (APP_LDFLAGS in mos.yml), which
+ * gives bytes in and out, requests, events and encryption time per TCP session. The scratch buffer is painted at
+ * start and its high-water mark is found by looking for the paint. Reported by the HAP.Sessions RPC, next to the
+ * HAP.* methods of mgos_hap_add_rpc_service, to size MAX_NUM_SESSIONS and the buffers from field data.
+ */
+
+bool tw_hapdiag_init(uint8_t* scratch, size_t scratch_size, size_t max_sessions);
+
+/* Accessory server callbacks, count secured HAP sessions */
+void tw_hapdiag_session_accept(HAPAccessoryServerRef* server, HAPSessionRef* session, void* _Nullable context);
+
+void tw_hapdiag_session_invalidate(HAPAccessoryServerRef* server, HAPSessionRef* session, void* _Nullable context);
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_heap.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#if TW_HEAP_TRACK
+
+#define TW_HEAP_MAGIC 0x7E
+
+/* In front of every tracked block, keeps the block 8 byte aligned */
+typedef union {
+    struct {
+        uint32_t size;
+        uint8_t site;
+        uint8_t magic;
+    };
+    uint64_t align;
+} tw_heap_hdr_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t allocs; // of the last run
+    int32_t net;     // allocations left behind by the last run
+    int32_t net_bytes;
+    uint32_t peak_bytes; // most bytes the last run held at once
+    int32_t heap_delta;  // free heap change of the last run, all allocations
+    uint32_t max_bytes;  // most bytes left behind by a run
+} tw_heap_op_stat_t;
+
+static const char* s_site_names[TW_HEAP_SITE_MAX] = { "state", "services", "service", "name", "scratch" };
+static const char* s_op_names[TW_HEAP_OP_MAX] = { "server_start", "warm_restart", "resize" };
+static tw_heap_counters_t s_sites[TW_HEAP_SITE_MAX];
+static tw_heap_counters_t s_total;
+static tw_heap_op_stat_t s_ops[TW_HEAP_OP_MAX];
+
+static void account(tw_heap_counters_t* c, int live, int32_t bytes) {
+    if (live > 0)
+        c->allocs++;
+    c->live += live;
+    c->live_bytes += bytes;
+    if (c->live_bytes > c->peak_bytes)
+        c->peak_bytes = c->live_bytes;
+}
+
+static void* track(tw_heap_hdr_t* hdr, enum tw_heap_site site, size_t size) {
+    if (hdr == NULL)
+        return NULL;
+    hdr->size = size;
+    hdr->site = site;
+    hdr->magic = TW_HEAP_MAGIC;
+    account(&s_sites[site], 1, size);
+    account(&s_total, 1, size);
+    return hdr + 1;
+}
+
+static tw_heap_hdr_t* untrack(void* p) {
+    tw_heap_hdr_t* hdr = (tw_heap_hdr_t*) p - 1;
+    if (hdr->magic != TW_HEAP_MAGIC || hdr->site >= TW_HEAP_SITE_MAX) {
+        LOG(LL_ERROR, ("Heap: %p was not allocated by tw_heap", p));
+        abort();
+    }
+    account(&s_sites[hdr->site], -1, -(int32_t) hdr->size);
+    account(&s_total, -1, -(int32_t) hdr->size);
+    hdr->magic = 0;
+    return hdr;
+}
+
+void* tw_heap_calloc(enum tw_heap_site site, size_t n, size_t size) {
+    return track(calloc(1, sizeof(tw_heap_hdr_t) + n * size), site, n * size);
+}
+
+void* tw_heap_realloc(enum tw_heap_site site, void* p, size_t size) {
+    if (p == NULL)
+        return track(malloc(sizeof(tw_heap_hdr_t) + size), site, size);
+    tw_heap_hdr_t* hdr = untrack(p);
+    tw_heap_hdr_t* moved = realloc(hdr, sizeof(tw_heap_hdr_t) + size);
+    if (moved == NULL) {
+        // The old block is still there
+        track(hdr, hdr->site, hdr->size);
+        return NULL;
+    }
+    return track(moved, site, size);
+}
+
+void tw_heap_free(void* p) {
+    if (p != NULL)
+        free(untrack(p));
+}
+
+char* tw_heap_adopt_str(enum tw_heap_site site, char* s) {
+    if (s == NULL)
+        return NULL;
+    size_t len = strlen(s) + 1;
+    char* copy = tw_heap_calloc(site, 1, len);
+    if (copy != NULL)
+        memcpy(copy, s, len);
+    free(s);
+    return copy;
+}
+
+void tw_heap_get(enum tw_heap_site site, tw_heap_counters_t* counters) {
+    *counters = s_sites[site];
+}
+
+void tw_heap_total(tw_heap_counters_t* counters) {
+    *counters = s_total;
+}
+
+void tw_heap_op_begin(tw_heap_mark_t* mark, enum tw_heap_op op) {
+    mark->op = op;
+    mark->allocs = s_total.allocs;
+    mark->live = s_total.live;
+    mark->live_bytes = s_total.live_bytes;
+    mark->peak_bytes = s_total.peak_bytes;
+    s_total.peak_bytes = s_total.live_bytes; // peak of this operation from here
+    mark->free_heap = mgos_get_free_heap_size();
+}
+
+void tw_heap_op_end(const tw_heap_mark_t* mark) {
+    tw_heap_op_stat_t* st = &s_ops[mark->op];
+    st->count++;
+    st->allocs = s_total.allocs - mark->allocs;
+    st->net = (int32_t) (s_total.live - mark->live);
+    st->net_bytes = (int32_t) (s_total.live_bytes - mark->live_bytes);
+    st->peak_bytes = s_total.peak_bytes - mark->live_bytes;
+    if (s_total.peak_bytes < mark->peak_bytes)
+        s_total.peak_bytes = mark->peak_bytes;
+    st->heap_delta = (int32_t) (mark->free_heap - mgos_get_free_heap_size());
+    if (st->net_bytes > 0 && (uint32_t) st->net_bytes > st->max_bytes)
+        st->max_bytes = st->net_bytes;
+}
+
+static int print_counters(struct json_out* out, const tw_heap_counters_t* c) {
+    return json_printf(
+            out,
+            "{allocs: %u, live: %u, live_bytes: %u, peak_bytes: %u}",
+            (unsigned) c->allocs,
+            (unsigned) c->live,
+            (unsigned) c->live_bytes,
+            (unsigned) c->peak_bytes);
+}
+
+static int print_heap(struct json_out* out, va_list* ap) {
+    int len = json_printf(out, "{total: ");
+    len += print_counters(out, &s_total);
+    len += json_printf(out, ", sites: {");
+    for (int i = 0; i < TW_HEAP_SITE_MAX; i++) {
+        len += json_printf(out, "%s%Q: ", i ? ", " : "", s_site_names[i]);
+        len += print_counters(out, &s_sites[i]);
+    }
+    len += json_printf(out, "}, ops: {");
+    for (int i = 0; i < TW_HEAP_OP_MAX; i++) {
+        const tw_heap_op_stat_t* st = &s_ops[i];
+        len += json_printf(
+                out,
+                "%s%Q: {count: %u, allocs: %u, peak_bytes: %u, net: %d, net_bytes: %d, max_bytes: %u, "
+                "heap_delta: %d}",
+                i ? ", " : "",
+                s_op_names[i],
+                (unsigned) st->count,
+                (unsigned) st->allocs,
+                (unsigned) st->peak_bytes,
+                (int) st->net,
+                (int) st->net_bytes,
+                (unsigned) st->max_bytes,
+                (int) st->heap_delta);
+    }
+    len += json_printf(
+            out,
+            "}, free_heap: %u, min_free_heap: %u}",
+            (unsigned) mgos_get_free_heap_size(),
+            (unsigned) mgos_get_min_free_heap_size());
+    (void) ap;
+    return len;
+}
+
+static void heap_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(ri, "%M", print_heap);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_heap_init(void) {
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Heap", "", heap_handler, NULL);
+    return true;
+}
+
+#else
+
+bool tw_heap_init(void) {
+    return true;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Allocation accounting of the per-device memory of the hub.
+ *
+ * With TW_HEAP_TRACK (on in BENCH builds) every allocation made through these calls carries a small header with its
+ * size and call site, so the hub knows how many allocations and bytes each site holds, the peak and what a single
+ * operation (server start, warm restart) allocated. Hub.Heap reports it. Without TW_HEAP_TRACK the calls are plain
+ * calloc/realloc/free.
+ */
+
+#ifndef TW_HEAP_TRACK
+#define TW_HEAP_TRACK 0
+#endif
+
+enum tw_heap_site {
+    TW_HEAP_STATE,    // per-device state arrays
+    TW_HEAP_SERVICES, // HAP service list
+    TW_HEAP_SERVICE,  // Light Bulb service of a device
+    TW_HEAP_NAME,     // device name
+    TW_HEAP_SCRATCH,  // short-lived buffers, e.g. state encoding
+    TW_HEAP_SITE_MAX,
+};
+
+enum tw_heap_op {
+    TW_HEAP_OP_SERVER_START,
+    TW_HEAP_OP_WARM_RESTART,
+    TW_HEAP_OP_RESIZE,
+    TW_HEAP_OP_MAX,
+};
+
+typedef struct {
+    uint32_t allocs; // allocations since boot
+    uint32_t live;   // allocations not freed yet
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+} tw_heap_counters_t;
+
+/* Accounting of one running operation */
+typedef struct {
+    enum tw_heap_op op;
+    uint32_t allocs;
+    uint32_t live;
+    uint32_t live_bytes;
+    uint32_t peak_bytes; // peak before the operation
+    size_t free_heap;
+} tw_heap_mark_t;
+
+#if TW_HEAP_TRACK
+
+void* tw_heap_calloc(enum tw_heap_site site, size_t n, size_t size);
+void* tw_heap_realloc(enum tw_heap_site site, void* p, size_t size);
+void tw_heap_free(void* p);
+
+/**
+ * Take over a block allocated elsewhere (e.g. a json_scanf string), returns the tracked copy.
+ */
+char* tw_heap_adopt_str(enum tw_heap_site site, char* s);
+
+void tw_heap_get(enum tw_heap_site site, tw_heap_counters_t* counters);
+
+/* Totals over all sites */
+void tw_heap_total(tw_heap_counters_t* counters);
+
+void tw_heap_op_begin(tw_heap_mark_t* mark, enum tw_heap_op op);
+void tw_heap_op_end(const tw_heap_mark_t* mark);
+
+#else
+
+#define tw_heap_calloc(site, n, size)  calloc((n), (size))
+#define tw_heap_realloc(site, p, size) realloc((p), (size))
+#define tw_heap_free(p)                free(p)
+#define tw_heap_adopt_str(site, s)     (s)
+#define tw_heap_op_begin(mark, op) \
+    do {                           \
+        (void) (mark);             \
+    } while (0)
+#define tw_heap_op_end(mark) \
+    do {                     \
+    } while (0)
+
+#endif
+
+bool tw_heap_init(void);
@@ -0,0 +1,807 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_kv.h"
+
+#include <stdio.h>
+
+#include "common/cs_crc32.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+
+/* File: magic, version. Then records: header followed by the value. */
+#define TW_KV_MAGIC      "TWKV"
+#define TW_KV_VERSION    1
+#define TW_KV_FILE_HDR   8
+#define TW_KV_RECORD_HDR 12
+#define TW_KV_MARKER     0xA5
+#define TW_KV_MAX_VALUE  0xFFFF
+
+enum tw_kv_op {
+    TW_KV_OP_SET = 1,
+    TW_KV_OP_REMOVE = 2,
+    TW_KV_OP_PURGE = 3, // whole domain
+};
+
+typedef struct {
+    HAPPlatformKeyValueStoreDomain domain;
+    HAPPlatformKeyValueStoreKey key;
+    uint16_t len;
+    uint32_t offset; // of the value in the file
+} tw_kv_entry_t;
+
+static struct {
+    const char* file;
+    char tmp_file[48];
+    const char* path; // the records are read from here, tmp_file while it waits to be renamed
+    bool pending_rename; // compaction could not put tmp_file in place, changes are appended to it until it can
+    bool ready;
+    bool adk; // the ADK store calls end up here, see tw_kv_migrate
+    HAPPlatformKeyValueStoreRef adk_store;
+    const char* adk_file;
+    tw_kv_entry_t* entries;
+    int count;
+    int capacity;
+    uint32_t size; // file size
+    uint32_t live; // bytes of the records still in use, headers included
+    mgos_timer_id compact_timer;
+    // lifetime counters
+    uint32_t appended;
+    uint32_t bytes_written;
+    uint32_t skipped; // sets with an unchanged value
+    uint32_t compactions;
+    uint32_t torn; // bytes of an incomplete tail dropped on load
+    uint32_t refused; // changes refused while the rename was pending and the file had a broken tail
+} s_kv;
+
+HAPError __real_HAPPlatformKeyValueStoreGet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found);
+HAPError __real_HAPPlatformKeyValueStoreSet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes);
+HAPError __real_HAPPlatformKeyValueStoreRemove(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key);
+HAPError __real_HAPPlatformKeyValueStoreEnumerate(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreEnumerateCallback callback,
+        void* _Nullable context);
+HAPError __real_HAPPlatformKeyValueStorePurgeDomain(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain);
+
+static void put_header(uint8_t* hdr, enum tw_kv_op op, uint8_t domain, uint8_t key, size_t len) {
+    hdr[0] = TW_KV_MARKER;
+    hdr[1] = op;
+    hdr[2] = domain;
+    hdr[3] = key;
+    hdr[4] = len & 0xFF;
+    hdr[5] = len >> 8;
+    hdr[6] = hdr[7] = 0;
+}
+
+static uint32_t record_crc(const uint8_t* hdr, const void* value, size_t len) {
+    uint32_t crc = cs_crc32(0, hdr, 8);
+    return len ? cs_crc32(crc, value, len) : crc;
+}
+
+static void put_crc(uint8_t* hdr, uint32_t crc) {
+    for (int i = 0; i < 4; i++)
+        hdr[8 + i] = crc >> (8 * i);
+}
+
+static uint32_t get_crc(const uint8_t* hdr) {
+    return hdr[8] | hdr[9] << 8 | hdr[10] << 16 | (uint32_t) hdr[11] << 24;
+}
+
+static tw_kv_entry_t* find(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key) {
+    for (int i = 0; i < s_kv.count; i++) {
+        if (s_kv.entries[i].domain == domain && s_kv.entries[i].key == key)
+            return &s_kv.entries[i];
+    }
+    return NULL;
+}
+
+static void drop(tw_kv_entry_t* e) {
+    s_kv.live -= TW_KV_RECORD_HDR + e->len;
+    *e = s_kv.entries[--s_kv.count];
+}
+
+/* Point the index at a value written at `offset` */
+static bool index_set(uint8_t domain, uint8_t key, uint16_t len, uint32_t offset) {
+    tw_kv_entry_t* e = find(domain, key);
+    if (e == NULL) {
+        if (s_kv.count == s_kv.capacity) {
+            int capacity = s_kv.capacity ? s_kv.capacity * 2 : 4;
+            tw_kv_entry_t* entries = realloc(s_kv.entries, capacity * sizeof(*entries));
+            if (entries == NULL)
+                return false;
+            s_kv.entries = entries;
+            s_kv.capacity = capacity;
+        }
+        e = &s_kv.entries[s_kv.count++];
+        e->domain = domain;
+        e->key = key;
+    } else {
+        s_kv.live -= TW_KV_RECORD_HDR + e->len;
+    }
+    e->len = len;
+    e->offset = offset;
+    s_kv.live += TW_KV_RECORD_HDR + len;
+    return true;
+}
+
+static void index_purge(uint8_t domain) {
+    for (int i = s_kv.count - 1; i >= 0; i--) {
+        if (s_kv.entries[i].domain == domain)
+            drop(&s_kv.entries[i]);
+    }
+}
+
+static bool read_value(const tw_kv_entry_t* e, void* bytes, size_t len) {
+    FILE* fp = fopen(s_kv.path, "rb");
+    if (fp == NULL)
+        return false;
+    bool ok = fseek(fp, e->offset, SEEK_SET) == 0 && fread(bytes, 1, len, fp) == len;
+    fclose(fp);
+    return ok;
+}
+
+static bool write_file_header(FILE* fp) {
+    uint8_t hdr[TW_KV_FILE_HDR] = { 0 };
+    memcpy(hdr, TW_KV_MAGIC, 4);
+    hdr[4] = TW_KV_VERSION;
+    return fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+}
+
+static bool has_file_header(const char* path) {
+    uint8_t hdr[TW_KV_FILE_HDR];
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    bool ok = fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) && memcmp(hdr, TW_KV_MAGIC, 4) == 0 &&
+              hdr[4] == TW_KV_VERSION;
+    fclose(fp);
+    return ok;
+}
+
+static long file_size(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    fclose(fp);
+    return size;
+}
+
+/* Put a compacted file whose rename failed in place, the main file is not a complete copy then */
+static bool settle(void) {
+    if (!s_kv.pending_rename)
+        return true;
+    remove(s_kv.file);
+    if (rename(s_kv.tmp_file, s_kv.file) != 0)
+        return false;
+    s_kv.pending_rename = false;
+    s_kv.path = s_kv.file;
+    LOG(LL_WARN, ("KV: %s in place", s_kv.file));
+    return true;
+}
+
+/* Rebuild the index from the file, returns the end of the last intact record */
+static uint32_t scan(FILE* fp) {
+    uint8_t hdr[TW_KV_RECORD_HDR];
+    uint8_t chunk[64];
+    uint32_t pos = TW_KV_FILE_HDR;
+    if (fread(hdr, 1, TW_KV_FILE_HDR, fp) != TW_KV_FILE_HDR || memcmp(hdr, TW_KV_MAGIC, 4) != 0 ||
+        hdr[4] != TW_KV_VERSION)
+        return 0;
+    while (fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) && hdr[0] == TW_KV_MARKER) {
+        size_t len = hdr[4] | hdr[5] << 8, left = len;
+        uint32_t crc = cs_crc32(0, hdr, 8);
+        while (left > 0) {
+            size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+            if (fread(chunk, 1, n, fp) != n)
+                return pos;
+            crc = cs_crc32(crc, chunk, n);
+            left -= n;
+        }
+        if (crc != get_crc(hdr))
+            return pos;
+        switch (hdr[1]) {
+            case TW_KV_OP_SET:
+                if (!index_set(hdr[2], hdr[3], len, pos + TW_KV_RECORD_HDR))
+                    return pos;
+                break;
+            case TW_KV_OP_REMOVE: {
+                tw_kv_entry_t* e = find(hdr[2], hdr[3]);
+                if (e)
+                    drop(e);
+            } break;
+            case TW_KV_OP_PURGE:
+                index_purge(hdr[2]);
+                break;
+            default:
+                return pos;
+        }
+        pos += sizeof(hdr) + len;
+    }
+    return pos;
+}
+
+/* Write the live records to a new file and put it in place of the old one */
+static bool compact(void) {
+    // The new file is written to tmp_file, which must not be the one read from
+    if (!settle())
+        return false;
+    int64_t started = mgos_uptime_micros();
+    uint8_t hdr[TW_KV_RECORD_HDR];
+    uint16_t max_len = 0;
+    for (int i = 0; i < s_kv.count; i++)
+        max_len = s_kv.entries[i].len > max_len ? s_kv.entries[i].len : max_len;
+    uint8_t* value = malloc(max_len + 1);
+    FILE* in = fopen(s_kv.path, "rb");
+    FILE* out = fopen(s_kv.tmp_file, "wb");
+    bool ok = in && out && write_file_header(out);
+    uint32_t pos = TW_KV_FILE_HDR;
+    uint32_t* offsets = calloc(s_kv.count + 1, sizeof(uint32_t));
+    ok = ok && offsets && value;
+    for (int i = 0; ok && i < s_kv.count; i++) {
+        tw_kv_entry_t* e = &s_kv.entries[i];
+        ok = fseek(in, e->offset, SEEK_SET) == 0 && fread(value, 1, e->len, in) == e->len;
+        if (!ok)
+            break;
+        put_header(hdr, TW_KV_OP_SET, e->domain, e->key, e->len);
+        put_crc(hdr, record_crc(hdr, value, e->len));
+        ok = fwrite(hdr, 1, sizeof(hdr), out) == sizeof(hdr) && fwrite(value, 1, e->len, out) == e->len;
+        offsets[i] = pos + TW_KV_RECORD_HDR;
+        pos += TW_KV_RECORD_HDR + e->len;
+    }
+    free(value);
+    if (in)
+        fclose(in);
+    if (out && fclose(out) != 0)
+        ok = false;
+    // The new file is complete, from here a power cut leaves either file in place, see tw_kv_init
+    if (ok && remove(s_kv.file) != 0)
+        ok = false;
+    if (ok) {
+        // The old file is gone, the new one is the only copy whether the rename works or not
+        for (int i = 0; i < s_kv.count; i++)
+            s_kv.entries[i].offset = offsets[i];
+        s_kv.bytes_written += pos;
+        s_kv.size = pos;
+        s_kv.compactions++;
+        if (rename(s_kv.tmp_file, s_kv.file) != 0) {
+            LOG(LL_ERROR, ("KV: can't rename %s, using it as it is", s_kv.tmp_file));
+            s_kv.path = s_kv.tmp_file;
+            s_kv.pending_rename = true;
+            ok = false;
+        }
+        LOG(LL_INFO,
+            ("KV compacted: %d records, %u bytes, %lld ms",
+             s_kv.count,
+             (unsigned) pos,
+             (long long) ((mgos_uptime_micros() - started) / 1000)));
+    } else {
+        LOG(LL_ERROR, ("KV compaction failed"));
+        remove(s_kv.tmp_file);
+    }
+    free(offsets);
+    return ok;
+}
+
+static void compact_timer_cb(void* arg) {
+    s_kv.compact_timer = MGOS_INVALID_TIMER_ID;
+    compact();
+    (void) arg;
+}
+
+static void maybe_compact(void) {
+    uint32_t min = mgos_sys_config_get_app_kv_compact_min();
+    if (s_kv.compact_timer != MGOS_INVALID_TIMER_ID || s_kv.size < min || s_kv.size < 2 * s_kv.live)
+        return;
+    // Off the caller's path, a HAP write handler should not wait for it
+    s_kv.compact_timer = mgos_set_timer(0, 0, compact_timer_cb, NULL);
+}
+
+/* Append one record, the change counts only when the whole record is on flash */
+static HAPError append(enum tw_kv_op op, uint8_t domain, uint8_t key, const void* bytes, size_t len) {
+    uint8_t hdr[TW_KV_RECORD_HDR];
+    put_header(hdr, op, domain, key, len);
+    put_crc(hdr, record_crc(hdr, bytes, len));
+    // The rename is retried on every change; until it works the compacted file is the store and takes the change.
+    // A tail dropped on load is still in the file and has to go first, which needs the file in place.
+    if (s_kv.pending_rename) {
+        bool settled = settle();
+        if (file_size(s_kv.path) != (long) s_kv.size && (!settled || !compact())) {
+            s_kv.refused++;
+            return kHAPError_Unknown;
+        }
+    }
+    FILE* fp = fopen(s_kv.path, "ab");
+    if (fp == NULL)
+        return kHAPError_Unknown;
+    bool ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) && (len == 0 || fwrite(bytes, 1, len, fp) == len);
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok) {
+        // Whatever part made it fails the CRC, rewrite the file without it
+        LOG(LL_ERROR, ("KV append failed"));
+        compact();
+        return kHAPError_Unknown;
+    }
+    switch (op) {
+        case TW_KV_OP_SET:
+            if (!index_set(domain, key, len, s_kv.size + TW_KV_RECORD_HDR))
+                return kHAPError_OutOfResources;
+            break;
+        case TW_KV_OP_REMOVE: {
+            tw_kv_entry_t* e = find(domain, key);
+            if (e)
+                drop(e);
+        } break;
+        case TW_KV_OP_PURGE:
+            index_purge(domain);
+            break;
+    }
+    s_kv.size += sizeof(hdr) + len;
+    s_kv.appended++;
+    s_kv.bytes_written += sizeof(hdr) + len;
+    maybe_compact();
+    return kHAPError_None;
+}
+
+HAPError tw_kv_get(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found) {
+    const tw_kv_entry_t* e = find(domain, key);
+    *found = e != NULL;
+    if (e == NULL)
+        return kHAPError_None;
+    size_t len = e->len < maxBytes ? e->len : maxBytes;
+    if (bytes && len && !read_value(e, bytes, len))
+        return kHAPError_Unknown;
+    if (numBytes)
+        *numBytes = len;
+    return kHAPError_None;
+}
+
+HAPError tw_kv_set(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes) {
+    if (numBytes > TW_KV_MAX_VALUE)
+        return kHAPError_OutOfResources;
+    const tw_kv_entry_t* e = find(domain, key);
+    if (e && e->len == numBytes) {
+        // Unchanged value costs a read instead of a flash write
+        void* old = malloc(numBytes + 1);
+        bool same = old && read_value(e, old, numBytes) && memcmp(old, bytes, numBytes) == 0;
+        free(old);
+        if (same) {
+            s_kv.skipped++;
+            return kHAPError_None;
+        }
+    }
+    return append(TW_KV_OP_SET, domain, key, bytes, numBytes);
+}
+
+HAPError tw_kv_remove(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key) {
+    if (find(domain, key) == NULL)
+        return kHAPError_None;
+    return append(TW_KV_OP_REMOVE, domain, key, NULL, 0);
+}
+
+#define KEY_BIT(keys, key) ((keys)[(key) >> 3] & (1 << ((key) & 7)))
+
+HAPError tw_kv_enumerate(HAPPlatformKeyValueStoreDomain domain, tw_kv_enumerate_cb_t cb, void* _Nullable context) {
+    // The keys first, a callback may remove the entry it is given
+    uint8_t keys[32] = { 0 };
+    for (int i = 0; i < s_kv.count; i++) {
+        if (s_kv.entries[i].domain == domain)
+            keys[s_kv.entries[i].key >> 3] |= 1 << (s_kv.entries[i].key & 7);
+    }
+    bool shouldContinue = true;
+    for (int key = 0; key < 256 && shouldContinue; key++) {
+        if (!KEY_BIT(keys, key) || find(domain, key) == NULL)
+            continue;
+        HAPError err = cb(context, domain, key, &shouldContinue);
+        if (err)
+            return err;
+    }
+    return kHAPError_None;
+}
+
+HAPError tw_kv_purge_domain(HAPPlatformKeyValueStoreDomain domain) {
+    for (int i = 0; i < s_kv.count; i++) {
+        if (s_kv.entries[i].domain == domain)
+            return append(TW_KV_OP_PURGE, domain, 0, NULL, 0);
+    }
+    return kHAPError_None;
+}
+
+/*
+ * The ADK store calls, linked with -Wl,--wrap (mos.yml), so HomeKit pairings and the configuration number are kept
+ * here as well. Until tw_kv_migrate has moved kv.json over they go to the ADK store as before.
+ */
+
+HAPError __wrap_HAPPlatformKeyValueStoreGet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found) {
+    if (!s_kv.adk)
+        return __real_HAPPlatformKeyValueStoreGet(keyValueStore, domain, key, bytes, maxBytes, numBytes, found);
+    return tw_kv_get(domain, key, bytes, maxBytes, numBytes, found);
+}
+
+HAPError __wrap_HAPPlatformKeyValueStoreSet(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes) {
+    if (!s_kv.adk)
+        return __real_HAPPlatformKeyValueStoreSet(keyValueStore, domain, key, bytes, numBytes);
+    return tw_kv_set(domain, key, bytes, numBytes);
+}
+
+HAPError __wrap_HAPPlatformKeyValueStoreRemove(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key) {
+    if (!s_kv.adk)
+        return __real_HAPPlatformKeyValueStoreRemove(keyValueStore, domain, key);
+    return tw_kv_remove(domain, key);
+}
+
+typedef struct {
+    HAPPlatformKeyValueStoreRef keyValueStore;
+    HAPPlatformKeyValueStoreEnumerateCallback callback;
+    void* _Nullable context;
+} tw_kv_adk_enumerate_t;
+
+static HAPError adk_enumerate_cb(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        bool* shouldContinue) {
+    tw_kv_adk_enumerate_t* e = context;
+    return e->callback(e->context, e->keyValueStore, domain, key, shouldContinue);
+}
+
+HAPError __wrap_HAPPlatformKeyValueStoreEnumerate(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreEnumerateCallback callback,
+        void* _Nullable context) {
+    if (!s_kv.adk)
+        return __real_HAPPlatformKeyValueStoreEnumerate(keyValueStore, domain, callback, context);
+    tw_kv_adk_enumerate_t e = { keyValueStore, callback, context };
+    return tw_kv_enumerate(domain, adk_enumerate_cb, &e);
+}
+
+HAPError __wrap_HAPPlatformKeyValueStorePurgeDomain(
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain) {
+    if (!s_kv.adk)
+        return __real_HAPPlatformKeyValueStorePurgeDomain(keyValueStore, domain);
+    return tw_kv_purge_domain(domain);
+}
+
+#define TW_KV_MIGRATE_MAX 1024 // largest ADK value moved, pairings and setup info are well below
+
+// Records of the store itself, in an app domain nothing else uses
+#define TW_KV_DOMAIN          0x3E
+#define TW_KV_KEY_MIGRATED    0x00 // the ADK store was moved over, its file is never read again
+
+static HAPError collect_key_cb(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreRef keyValueStore,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        bool* shouldContinue) {
+    uint8_t* keys = context;
+    keys[key >> 3] |= 1 << (key & 7);
+    (void) keyValueStore;
+    (void) domain;
+    (void) shouldContinue;
+    return kHAPError_None;
+}
+
+bool tw_kv_migrate(HAPPlatformKeyValueStoreRef keyValueStore, const char* file) {
+    s_kv.adk_store = keyValueStore;
+    s_kv.adk_file = file;
+    if (!s_kv.ready)
+        return false;
+    uint8_t done = 1;
+    bool found = false;
+    if (tw_kv_get(TW_KV_DOMAIN, TW_KV_KEY_MIGRATED, NULL, 0, NULL, &found) == kHAPError_None && found) {
+        // Moved before, a file there now is not the pairings, e.g. the Hub.Kv bench was cut short by a reset
+        s_kv.adk = true;
+        if (remove(file) == 0)
+            LOG(LL_WARN, ("KV: %s left over, removed", file));
+        return true;
+    }
+    FILE* fp = fopen(file, "rb");
+    if (fp == NULL) {
+        s_kv.adk = true;
+        tw_kv_set(TW_KV_DOMAIN, TW_KV_KEY_MIGRATED, &done, sizeof done);
+        return true;
+    }
+    fclose(fp);
+    // Whatever kv.json holds wins, it is only there when firmware without this store wrote it
+    uint8_t* value = malloc(TW_KV_MIGRATE_MAX);
+    bool ok = value != NULL;
+    int moved = 0;
+    for (int domain = 0; ok && domain < 256; domain++) {
+        uint8_t keys[32] = { 0 };
+        ok = __real_HAPPlatformKeyValueStoreEnumerate(keyValueStore, domain, collect_key_cb, keys) == kHAPError_None;
+        for (int key = 0; ok && key < 256; key++) {
+            size_t len = 0;
+            bool found = false;
+            if (!KEY_BIT(keys, key))
+                continue;
+            ok = __real_HAPPlatformKeyValueStoreGet(
+                         keyValueStore, domain, key, value, TW_KV_MIGRATE_MAX, &len, &found) == kHAPError_None &&
+                 len < TW_KV_MIGRATE_MAX;
+            if (ok && found) {
+                ok = tw_kv_set(domain, key, value, len) == kHAPError_None;
+                moved++;
+            }
+        }
+    }
+    free(value);
+    if (!ok) {
+        // The ADK store stays in use, the next boot starts over
+        LOG(LL_ERROR, ("KV: can't move %s over, using it as it is", file));
+        return false;
+    }
+    s_kv.adk = true;
+    // Before the file goes, a reset in between moves it again, which is harmless
+    if (tw_kv_set(TW_KV_DOMAIN, TW_KV_KEY_MIGRATED, &done, sizeof done) != kHAPError_None)
+        LOG(LL_ERROR, ("KV: can't mark %s as moved", file));
+    remove(file);
+    LOG(LL_INFO, ("KV: moved %d records from %s", moved, file));
+    return true;
+}
+
+#if TW_BENCH
+
+#define TW_KV_BENCH_DOMAIN 0x3F // the last app domain, unused
+#define TW_KV_BENCH_KEYS   16
+#define TW_KV_BENCH_CHUNK  5 // operations per tick on each store, the HAP loop and the WDT get their turn
+
+typedef struct {
+    uint32_t us;
+    uint32_t max_us;
+    uint32_t bytes; // file bytes written
+    uint32_t errors;
+} tw_kv_bench_store_t;
+
+static struct {
+    int total;
+    int done;
+    mgos_timer_id timer;
+    tw_kv_bench_store_t store[2]; // this one, the ADK store
+} s_bench = { .timer = MGOS_INVALID_TIMER_ID };
+
+/* Same operation for both stores: op, key and value come from the operation number */
+static void bench_op(int n, bool adk) {
+    HAPPlatformKeyValueStoreRef ref = s_kv.adk_store;
+    tw_kv_bench_store_t* st = &s_bench.store[adk];
+    uint32_t r = (uint32_t) n * 2654435761u;
+    uint8_t key = (r >> 8) % TW_KV_BENCH_KEYS, kind = (r >> 16) % 100;
+    uint8_t value[128];
+    // Half the writes repeat the value the key had, like a slider dragged back and forth
+    size_t len = 8 + key * 7;
+    memset(value, (r >> 24) & 1 ? key : (uint8_t) n, len);
+    uint32_t written = s_kv.bytes_written;
+    bool found = false;
+    size_t num = 0;
+    HAPError err;
+    int64_t started = mgos_uptime_micros();
+    if (kind < 50) {
+        err = adk ? __real_HAPPlatformKeyValueStoreSet(ref, TW_KV_BENCH_DOMAIN, key, value, len)
+                  : tw_kv_set(TW_KV_BENCH_DOMAIN, key, value, len);
+    } else if (kind < 85) {
+        err = adk ? __real_HAPPlatformKeyValueStoreGet(
+                            ref, TW_KV_BENCH_DOMAIN, key, value, sizeof(value), &num, &found)
+                  : tw_kv_get(TW_KV_BENCH_DOMAIN, key, value, sizeof(value), &num, &found);
+    } else {
+        err = adk ? __real_HAPPlatformKeyValueStoreRemove(ref, TW_KV_BENCH_DOMAIN, key)
+                  : tw_kv_remove(TW_KV_BENCH_DOMAIN, key);
+    }
+    uint32_t took = mgos_uptime_micros() - started;
+    st->us += took;
+    st->max_us = took > st->max_us ? took : st->max_us;
+    st->errors += err != kHAPError_None;
+    if (!adk)
+        st->bytes += s_kv.bytes_written - written;
+    else if (kind < 50 || kind >= 85) {
+        // kv.json is rewritten as a whole on every change
+        long size = file_size(s_kv.adk_file);
+        st->bytes += size > 0 ? size : 0;
+    }
+}
+
+static void bench_timer_cb(void* arg) {
+    for (int i = 0; i < TW_KV_BENCH_CHUNK && s_bench.done < s_bench.total; i++, s_bench.done++) {
+        bench_op(s_bench.done, false);
+        bench_op(s_bench.done, true);
+    }
+    if (s_bench.done < s_bench.total)
+        return;
+    mgos_clear_timer(s_bench.timer);
+    s_bench.timer = MGOS_INVALID_TIMER_ID;
+    tw_kv_purge_domain(TW_KV_BENCH_DOMAIN);
+    __real_HAPPlatformKeyValueStorePurgeDomain(s_kv.adk_store, TW_KV_BENCH_DOMAIN);
+    // Nothing else uses the ADK file any more, see tw_kv_migrate
+    remove(s_kv.adk_file);
+    (void) arg;
+}
+
+static const char* bench_start(int ops) {
+    if (s_bench.timer != MGOS_INVALID_TIMER_ID)
+        return "benchmark running";
+    if (!s_kv.adk || s_kv.adk_store == NULL)
+        return "kv.json is still in use";
+    memset(s_bench.store, 0, sizeof(s_bench.store));
+    s_bench.total = ops < 10 ? 10 : ops > 10000 ? 10000 : ops;
+    s_bench.done = 0;
+    s_bench.timer = mgos_set_timer(10, MGOS_TIMER_REPEAT, bench_timer_cb, NULL);
+    return NULL;
+}
+
+static int print_bench_store(struct json_out* out, const tw_kv_bench_store_t* st, int ops) {
+    return json_printf(
+            out,
+            "{mean_us: %.1f, max_us: %u, bytes_written: %u, errors: %u}",
+            ops ? (double) st->us / ops : 0.0,
+            (unsigned) st->max_us,
+            (unsigned) st->bytes,
+            (unsigned) st->errors);
+}
+
+static int print_bench(struct json_out* out, va_list* ap) {
+    int len = json_printf(out, "{ops: %d, done: %d, log: ", s_bench.total, s_bench.done);
+    len += print_bench_store(out, &s_bench.store[0], s_bench.done);
+    len += json_printf(out, ", json: ");
+    len += print_bench_store(out, &s_bench.store[1], s_bench.done);
+    len += json_printf(out, "}");
+    (void) ap;
+    return len;
+}
+
+#else
+
+static const char* bench_start(int ops) {
+    (void) ops;
+    return "built without BENCH=1";
+}
+
+static int print_bench(struct json_out* out, va_list* ap) {
+    (void) ap;
+    return json_printf(out, "null");
+}
+
+#endif
+
+static void kv_handler(struct mg_rpc_request_info* ri, void* cb_arg, struct mg_rpc_frame_info* fi, struct mg_str args) {
+    bool compact_now = false;
+    int bench = 0;
+    json_scanf(args.p, args.len, ri->args_fmt, &compact_now, &bench);
+    if (compact_now && !compact()) {
+        mg_rpc_send_errorf(ri, 500, "compaction failed");
+        return;
+    }
+    const char* err = bench > 0 ? bench_start(bench) : NULL;
+    if (err != NULL) {
+        mg_rpc_send_errorf(ri, 400, "%s", err);
+        return;
+    }
+    mg_rpc_send_responsef(
+            ri,
+            "{file: %Q, records: %d, size: %u, live: %u, appended: %u, skipped: %u, bytes_written: %u, "
+            "compactions: %u, torn: %u, pending_rename: %B, refused: %u, adk: %B, bench: %M}",
+            s_kv.file,
+            s_kv.count,
+            (unsigned) s_kv.size,
+            (unsigned) s_kv.live,
+            (unsigned) s_kv.appended,
+            (unsigned) s_kv.skipped,
+            (unsigned) s_kv.bytes_written,
+            (unsigned) s_kv.compactions,
+            (unsigned) s_kv.torn,
+            s_kv.pending_rename,
+            (unsigned) s_kv.refused,
+            s_kv.adk,
+            print_bench);
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_kv_init(void) {
+    s_kv.file = mgos_sys_config_get_app_kv_file();
+    s_kv.compact_timer = MGOS_INVALID_TIMER_ID;
+    snprintf(s_kv.tmp_file, sizeof(s_kv.tmp_file), "%s.tmp", s_kv.file);
+    s_kv.path = s_kv.file;
+    if (has_file_header(s_kv.tmp_file) && !has_file_header(s_kv.file)) {
+        // Compaction wrote the new file but did not put it in place: power cut or a failed rename, and maybe an
+        // older firmware appended to a new headerless file after that
+        LOG(LL_WARN, ("KV: recovering compacted %s", s_kv.tmp_file));
+        s_kv.path = s_kv.tmp_file;
+        s_kv.pending_rename = true;
+    } else {
+        // An unfinished compaction, the old file is still complete
+        remove(s_kv.tmp_file);
+    }
+    FILE* fp = fopen(s_kv.path, "rb");
+    uint32_t end = 0;
+    if (fp != NULL) {
+        end = scan(fp);
+        fseek(fp, 0, SEEK_END);
+        s_kv.size = ftell(fp);
+        fclose(fp);
+    }
+    if (end == 0) {
+        if (fp != NULL)
+            LOG(LL_ERROR, ("KV: %s is not a store, starting empty", s_kv.file));
+        fp = fopen(s_kv.file, "wb");
+        if (fp == NULL || !write_file_header(fp)) {
+            if (fp)
+                fclose(fp);
+            LOG(LL_ERROR, ("KV: can't create %s", s_kv.file));
+            return false;
+        }
+        fclose(fp);
+        s_kv.size = TW_KV_FILE_HDR;
+    } else if (end < s_kv.size) {
+        // Appends go to the end of the file, the broken tail has to go first
+        LOG(LL_WARN, ("KV: dropping %u bytes of an incomplete write", (unsigned) (s_kv.size - end)));
+        s_kv.torn = s_kv.size - end;
+        s_kv.size = end;
+        if (!compact() && !s_kv.pending_rename)
+            return false;
+    }
+    if (!settle())
+        LOG(LL_ERROR, ("KV: can't rename %s, using it as it is", s_kv.tmp_file));
+    s_kv.ready = true;
+    LOG(LL_INFO, ("KV: %d records, %u of %u bytes live", s_kv.count, (unsigned) s_kv.live, (unsigned) s_kv.size));
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Kv", "{compact: %B, bench: %d}", kv_handler, NULL);
+    return true;
+}
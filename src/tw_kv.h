@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "HAP.h"
+
+/**
+ * Log-structured key-value store for application state.
+ *
+ * Every change is appended to the file as one record with its own CRC, a record that did not make it to flash
+ * completely fails the check and is ignored on load, so a write either happens as a whole or not at all.
+ * The index (domain, key, offset, length) is kept in RAM, values are read from the file on demand.
+ * Superseded records are dropped by a compaction pass in the background, which writes the live records to a new
+ * file and replaces the old one.
+ *
+ * The calls mirror HAPPlatformKeyValueStore, and the ADK store calls are redirected here (-Wl,--wrap in mos.yml),
+ * so HomeKit pairings and the configuration number are kept here too. A compacted file that could not be renamed
+ * stays in use as it is, reads are served from it and changes are appended to it until the rename works.
+ */
+
+typedef HAPError (*tw_kv_enumerate_cb_t)(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        bool* shouldContinue);
+
+bool tw_kv_init(void);
+
+/* Moves the records of the ADK store in `file` over once, remembered in the store, then takes over its calls */
+bool tw_kv_migrate(HAPPlatformKeyValueStoreRef keyValueStore, const char* file);
+
+HAPError tw_kv_get(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        void* _Nullable bytes,
+        size_t maxBytes,
+        size_t* _Nullable numBytes,
+        bool* found);
+
+HAPError tw_kv_set(
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        const void* bytes,
+        size_t numBytes);
+
+HAPError tw_kv_remove(HAPPlatformKeyValueStoreDomain domain, HAPPlatformKeyValueStoreKey key);
+
+HAPError tw_kv_enumerate(HAPPlatformKeyValueStoreDomain domain, tw_kv_enumerate_cb_t cb, void* _Nullable context);
+
+HAPError tw_kv_purge_domain(HAPPlatformKeyValueStoreDomain domain);
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_log.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+
+#define TW_LOG_LINE_LEN 64
+
+typedef struct {
+    uint32_t ts_ms; // uptime
+    uint8_t msg;
+    int8_t level;
+    int16_t index;
+    int32_t value;
+} tw_log_entry_t;
+
+#define TW_LOG_MESSAGE_FMT(id, fmt) fmt,
+static const char* const s_formats[TW_MSG_MAX] = { TW_LOG_MESSAGES(TW_LOG_MESSAGE_FMT) };
+#undef TW_LOG_MESSAGE_FMT
+
+static tw_log_entry_t* s_ring = NULL;
+static uint32_t s_size = 0;
+static uint32_t s_seq = 0;      // entries recorded so far, the next one gets this number
+static uint32_t s_exported = 0; // next entry to export
+static uint32_t s_dropped = 0;  // overwritten before export
+
+void tw_log_record(enum cs_log_level level, enum tw_log_msg msg, int index, int32_t value) {
+    if (s_size == 0)
+        return;
+    tw_log_entry_t* e = &s_ring[s_seq % s_size];
+    e->ts_ms = (uint32_t) (mgos_uptime_micros() / 1000);
+    e->msg = msg;
+    e->level = level;
+    e->index = index;
+    e->value = value;
+    s_seq++;
+}
+
+static const tw_log_entry_t* entry(uint32_t seq) {
+    return &s_ring[seq % s_size];
+}
+
+/* Oldest sequence number still in the ring */
+static uint32_t first_seq(void) {
+    return s_seq > s_size ? s_seq - s_size : 0;
+}
+
+static void format_entry(const tw_log_entry_t* e, char* buf, size_t len) {
+    const char* fmt = e->msg < TW_MSG_MAX ? s_formats[e->msg] : "Unknown message %d %d";
+    snprintf(buf, len, fmt, e->index, (int) e->value);
+}
+
+static void export_timer_cb(void* arg) {
+    char line[TW_LOG_LINE_LEN];
+    if (!mgos_sys_config_get_app_log_export()) {
+        s_exported = s_seq;
+        return;
+    }
+    if (s_exported < first_seq()) {
+        s_dropped += first_seq() - s_exported;
+        s_exported = first_seq();
+    }
+    for (; s_exported < s_seq; s_exported++) {
+        const tw_log_entry_t* e = entry(s_exported);
+        format_entry(e, line, sizeof(line));
+        LOG(e->level, ("[%u.%03u] %s", (unsigned) (e->ts_ms / 1000), (unsigned) (e->ts_ms % 1000), line));
+    }
+    (void) arg;
+}
+
+static int print_entries(struct json_out* out, va_list* ap) {
+    uint32_t since = *va_arg(*ap, uint32_t*);
+    char line[TW_LOG_LINE_LEN];
+    int len = json_printf(out, "[");
+    if (since < first_seq())
+        since = first_seq();
+    for (uint32_t seq = since; seq < s_seq; seq++) {
+        const tw_log_entry_t* e = entry(seq);
+        format_entry(e, line, sizeof(line));
+        len += json_printf(
+                out,
+                "%s{seq: %u, t_ms: %u, level: %d, text: %Q}",
+                seq > since ? ", " : "",
+                (unsigned) seq,
+                (unsigned) e->ts_ms,
+                (int) e->level,
+                line);
+    }
+    len += json_printf(out, "]");
+    return len;
+}
+
+static void log_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    uint32_t since = 0;
+    json_scanf(args.p, args.len, ri->args_fmt, &since);
+    mg_rpc_send_responsef(
+            ri,
+            "{next: %u, size: %u, dropped_export: %u, entries: %M}",
+            (unsigned) s_seq,
+            (unsigned) s_size,
+            (unsigned) s_dropped,
+            print_entries,
+            &since);
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_log_init(void) {
+    int size = mgos_sys_config_get_app_log_ring_size();
+    if (size > 0) {
+        s_ring = calloc(size, sizeof(*s_ring));
+        if (s_ring == NULL) {
+            LOG(LL_ERROR, ("No memory for the log ring"));
+            return false;
+        }
+        s_size = size;
+    }
+    mgos_set_timer(mgos_sys_config_get_app_log_export_ms(), MGOS_TIMER_REPEAT, export_timer_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Log", "{since: %u}", log_handler, NULL);
+    return true;
+}
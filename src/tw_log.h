@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/cs_dbg.h"
+
+/**
+ * Hot path logging.
+ *
+ * Messages are compiled in only up to the level of their subsystem (TW_LOG_LEVEL_* cdefs, cs_log_level values),
+ * anything above it is removed by the compiler. What is left is stored in a binary ring as a message id, a device
+ * index and one value, nothing is formatted on the spot. Hub.Log RPC formats the ring on request, and with
+ * app.log.export the new entries are formatted in the background and passed to the regular log (UART, UDP).
+ */
+
+#ifndef TW_LOG_LEVEL_HAP
+#define TW_LOG_LEVEL_HAP LL_INFO
+#endif
+
+#ifndef TW_LOG_LEVEL_DEV
+#define TW_LOG_LEVEL_DEV LL_INFO
+#endif
+
+/* Message id, format with the device index and the value */
+#define TW_LOG_MESSAGES(X)                                            \
+    X(TW_MSG_HAP_ON_READ, "Twinkly %d on read: %d")                   \
+    X(TW_MSG_HAP_ON_WRITE, "Twinkly %d on write: %d")                 \
+    X(TW_MSG_HAP_BRIGHTNESS_READ, "Twinkly %d brightness read: %d")   \
+    X(TW_MSG_HAP_BRIGHTNESS_WRITE, "Twinkly %d brightness write: %d") \
+    X(TW_MSG_HAP_NOTIFY, "Twinkly %d notification, iid %d")           \
+    X(TW_MSG_DEV_STATUS, "Twinkly %d status: %d")                     \
+    X(TW_MSG_DEV_MODE, "Twinkly %d mode: %d")                         \
+    X(TW_MSG_DEV_BRIGHTNESS, "Twinkly %d brightness: %d")
+
+#define TW_LOG_MESSAGE_ID(id, fmt) id,
+enum tw_log_msg { TW_LOG_MESSAGES(TW_LOG_MESSAGE_ID) TW_MSG_MAX };
+#undef TW_LOG_MESSAGE_ID
+
+void tw_log_record(enum cs_log_level level, enum tw_log_msg msg, int index, int32_t value);
+
+#define TW_LOG(subsystem, level, msg, index, value)          \
+    do {                                                     \
+        if ((level) <= TW_LOG_LEVEL_##subsystem)             \
+            tw_log_record((level), (msg), (index), (value)); \
+    } while (0)
+
+bool tw_log_init(void);
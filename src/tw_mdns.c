@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_mdns.h"
+
+#include <ctype.h>
+
+#include "mgos.h"
+#include "mgos_event.h"
+#include "mgos_mdns.h"
+#include "mgos_mongoose.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+#include "mgos_twinkly.h"
+#include "tw_client.h"
+#include "tw_heap.h"
+#include "tw_poll.h"
+
+#define TW_MDNS_GROUP      "udp://224.0.0.251:5353"
+#define TW_HOST_PREFIX     "Twinkly_"
+#define TW_HOST_SUFFIX_LEN 6
+#define TW_HOST_LEN        (sizeof(TW_HOST_PREFIX) - 1 + TW_HOST_SUFFIX_LEN)
+
+typedef struct {
+    bool offline;
+    double last_query;
+} tw_mdns_dev_t;
+
+static tw_mdns_dev_t* s_devs = NULL; // sized to the device list
+static int s_num_devs = 0;
+static struct mg_connection* s_query_nc = NULL;
+
+/* Starts over with all devices online, indexes shift on removal */
+static void reset_devices(void) {
+    int n = mgos_twinkly_count();
+    if (n > MAX_TWINKLY_DEVICES)
+        n = MAX_TWINKLY_DEVICES;
+    if (n == 0) {
+        tw_heap_free(s_devs);
+        s_devs = NULL;
+        s_num_devs = 0;
+        return;
+    }
+    if (n != s_num_devs) {
+        tw_mdns_dev_t* devs = tw_heap_realloc(TW_HEAP_STATE, s_devs, n * sizeof(*devs));
+        if (devs == NULL) {
+            LOG(LL_ERROR, ("No memory to track %d devices", n));
+        } else {
+            s_devs = devs;
+            s_num_devs = n;
+        }
+    }
+    if (s_num_devs)
+        memset(s_devs, 0, s_num_devs * sizeof(*s_devs));
+}
+
+/* Host name label of the device, derived from its MAC */
+static bool device_host(int index, char* host) {
+    const char* mac = tw_client_get_mac(index);
+    char hex[12];
+    int n = 0;
+    if (mac == NULL)
+        return false;
+    for (; *mac && n < (int) sizeof(hex); mac++) {
+        if (isxdigit((unsigned char) *mac))
+            hex[n++] = toupper((unsigned char) *mac);
+    }
+    if (n != (int) sizeof(hex))
+        return false;
+    sprintf(host, TW_HOST_PREFIX "%.*s", TW_HOST_SUFFIX_LEN, hex + sizeof(hex) - TW_HOST_SUFFIX_LEN);
+    return true;
+}
+
+static void handle_a_record(const char* name, const struct mg_str* rdata) {
+    char ip[16];
+    char host[TW_HOST_LEN + 1];
+    if (rdata->len != 4 || mg_ncasecmp(name, TW_HOST_PREFIX, sizeof(TW_HOST_PREFIX) - 1) != 0)
+        return;
+    const uint8_t* a = (const uint8_t*) rdata->p;
+    snprintf(ip, sizeof(ip), "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
+    for (int i = 0; i < tw_client_count(); i++) {
+        if (!device_host(i, host) || mg_ncasecmp(name, host, TW_HOST_LEN) != 0)
+            continue;
+        if (name[TW_HOST_LEN] != '\0' && name[TW_HOST_LEN] != '.')
+            continue;
+        if (tw_client_set_ip(i, ip))
+            tw_poll_touch(i);
+        break;
+    }
+}
+
+static void mdns_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    if (ev != MG_DNS_MESSAGE)
+        return;
+    struct mg_dns_message* msg = ev_data;
+    char name[64];
+    for (int i = 0; i < msg->num_answers; i++) {
+        struct mg_dns_resource_record* rr = &msg->answers[i];
+        if (rr->rtype != MG_DNS_A_RECORD)
+            continue;
+        name[0] = '\0';
+        mg_dns_uncompress_name(msg, &rr->name, name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        handle_a_record(name, &rr->rdata);
+    }
+    (void) nc;
+    (void) user_data;
+}
+
+static void query_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    if (ev == MG_EV_CLOSE && nc == s_query_nc)
+        s_query_nc = NULL;
+    else
+        mdns_ev_handler(nc, ev, ev_data, user_data);
+}
+
+void tw_mdns_query(int index) {
+    char host[TW_HOST_LEN + sizeof(".local")];
+    if (index < 0 || index >= tw_client_count() || index >= s_num_devs || !device_host(index, host))
+        return;
+    if (s_query_nc == NULL) {
+        // Queries from an ephemeral port are answered by unicast straight to it
+        s_query_nc = mg_connect(mgos_get_mgr(), TW_MDNS_GROUP, query_ev_handler, NULL);
+        if (s_query_nc == NULL)
+            return;
+        mg_set_protocol_dns(s_query_nc);
+    }
+    strcat(host, ".local");
+    LOG(LL_DEBUG, ("Looking up %s", host));
+    mg_send_dns_query(s_query_nc, host, MG_DNS_A_RECORD);
+    s_devs[index].last_query = mgos_uptime();
+}
+
+static void mdns_timer_cb(void* arg) {
+    double now = mgos_uptime();
+    double interval = mgos_sys_config_get_app_mdns_query_interval_ms() / 1000.0;
+    for (int i = 0; i < tw_client_count() && i < s_num_devs; i++) {
+        if (s_devs[i].offline && now - s_devs[i].last_query >= interval)
+            tw_mdns_query(i);
+    }
+    (void) arg;
+}
+
+static void twinkly_ev_cb(int ev, void* ev_data, void* userdata) {
+    switch (ev) {
+        case MGOS_TWINKLY_EV_STATUS: {
+            mgos_twinkly_ev_data_t* data = ev_data;
+            if (data->index < 0 || data->index >= s_num_devs)
+                break;
+            bool was_offline = s_devs[data->index].offline;
+            s_devs[data->index].offline = !data->value;
+            if (!data->value && !was_offline)
+                tw_mdns_query(data->index);
+        } break;
+        case MGOS_TWINKLY_EV_INITIALIZED:
+        case MGOS_TWINKLY_EV_ADDED:
+        case MGOS_TWINKLY_EV_REMOVED:
+            reset_devices();
+            break;
+    }
+    (void) userdata;
+}
+
+static int print_devices(struct json_out* out, va_list* ap) {
+    char host[TW_HOST_LEN + 1];
+    int len = json_printf(out, "[");
+    for (int i = 0; i < tw_client_count() && i < s_num_devs; i++) {
+        if (!device_host(i, host))
+            host[0] = '\0';
+        len += json_printf(
+                out,
+                "%s{index: %d, host: %Q, ip: %Q, offline: %B}",
+                i ? ", " : "",
+                i,
+                host,
+                tw_client_get_ip(i),
+                s_devs[i].offline);
+    }
+    len += json_printf(out, "]");
+    (void) ap;
+    return len;
+}
+
+static void mdns_list_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(ri, "%M", print_devices);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_mdns_init(void) {
+    if (!mgos_sys_config_get_app_mdns_enable())
+        return true;
+    mgos_mdns_add_handler(mdns_ev_handler, NULL);
+    reset_devices();
+    mgos_event_add_handler(MGOS_TWINKLY_EV_STATUS, twinkly_ev_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_INITIALIZED, twinkly_ev_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_ADDED, twinkly_ev_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_REMOVED, twinkly_ev_cb, NULL);
+    mgos_set_timer(1000, MGOS_TIMER_REPEAT, mdns_timer_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Mdns", "", mdns_list_handler, NULL);
+    return true;
+}
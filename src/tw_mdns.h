@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * mDNS based device address tracking.
+ *
+ * Twinkly devices announce themselves as Twinkly_XXXXXX.local, where XXXXXX are the last three bytes of the MAC.
+ * A records seen on the mDNS listener are matched against known devices and their address is updated in place,
+ * offline devices are actively queried by host name.
+ */
+
+bool tw_mdns_init(void);
+
+/**
+ * Query the device host name right away, e.g. when it stopped answering.
+ */
+void tw_mdns_query(int index);
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_poll.h"
+
+#include "mgos.h"
+#include "mgos_event.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+#include "mgos_twinkly.h"
+#include "tw_client.h"
+#include "tw_heap.h"
+#include "tw_queue.h"
+
+#define TW_POLL_TICK_MS 250
+
+typedef struct {
+    int64_t next_ms;      // when the next poll is due
+    int64_t hot_until_ms; // fast polling window end
+    int64_t seen_ms;      // last successful poll
+    int interval_ms;      // last scheduled interval, for the budget
+    int fails;            // consecutive failures, 0 when online
+    bool inflight;        // request outstanding
+    bool known;           // last status is valid
+    bool online;
+    bool resync;          // not yet reached by the running resync
+    tw_client_status_t last;
+} tw_poll_dev_t;
+
+static struct {
+    tw_poll_dev_t* dev; // sized to the device list
+    int num_dev;
+    int inflight;
+    int cursor;
+    int64_t minute_start_ms;
+    int minute_polls;
+    int last_minute_polls;
+    int last_minute_fails;
+    int minute_fails;
+    bool emitting;        // the event being triggered is a report of this poller
+    uint32_t lib_dropped; // reports of the library poller, see __wrap_mgos_event_trigger
+    struct {
+        bool active;
+        int left;
+        int devices;
+        int online;
+        int64_t started_ms;
+        int64_t took_ms;
+        tw_poll_resync_cb_t cb;
+        void* arg;
+    } resync;
+} s_poll;
+
+static void poll_start_due(int64_t now);
+
+/* Devices to poll, the client may know more than fit if growing the table failed */
+static int device_count(void) {
+    int n = tw_client_count();
+    return n < s_poll.num_dev ? n : s_poll.num_dev;
+}
+
+static void resize(int num) {
+    if (num > MAX_TWINKLY_DEVICES)
+        num = MAX_TWINKLY_DEVICES;
+    if (num == s_poll.num_dev)
+        return;
+    if (num == 0) {
+        tw_heap_free(s_poll.dev);
+        s_poll.dev = NULL;
+        s_poll.num_dev = 0;
+        return;
+    }
+    tw_poll_dev_t* dev = tw_heap_realloc(TW_HEAP_STATE, s_poll.dev, num * sizeof(*dev));
+    if (dev == NULL) {
+        LOG(LL_ERROR, ("No memory to poll %d devices", num));
+        return;
+    }
+    if (num > s_poll.num_dev)
+        memset(&dev[s_poll.num_dev], 0, (num - s_poll.num_dev) * sizeof(*dev));
+    s_poll.dev = dev;
+    s_poll.num_dev = num;
+}
+
+static int64_t now_ms(void) {
+    return mgos_uptime_micros() / 1000;
+}
+
+static int jitter(int interval_ms) {
+    int pct = mgos_sys_config_get_app_poll_jitter_pct();
+    if (pct <= 0)
+        return interval_ms;
+    int span = interval_ms * pct / 100;
+    return interval_ms - span + (int) (rand() % (2 * span + 1));
+}
+
+static void schedule(tw_poll_dev_t* dev, int64_t now) {
+    int interval;
+    if (dev->fails > 0) {
+        // Offline: interval * 2^fails up to the cap
+        int max = mgos_sys_config_get_app_poll_backoff_max_ms();
+        int shift = dev->fails < 16 ? dev->fails : 16;
+        int64_t backoff = (int64_t) mgos_sys_config_get_app_poll_interval_ms() << shift;
+        interval = backoff > max ? max : (int) backoff;
+    } else if (now < dev->hot_until_ms) {
+        interval = mgos_sys_config_get_app_poll_fast_interval_ms();
+    } else {
+        interval = mgos_sys_config_get_app_poll_interval_ms();
+    }
+    interval = jitter(interval);
+    dev->interval_ms = interval;
+    dev->next_ms = now + interval;
+}
+
+static void emit(int ev, int index, int value) {
+    mgos_twinkly_ev_data_t data = { .index = index, .value = value };
+    s_poll.emitting = true;
+    mgos_event_trigger(ev, &data);
+    s_poll.emitting = false;
+}
+
+int __real_mgos_event_trigger(int ev, void* ev_data);
+
+/*
+ * The twinkly library keeps polling the devices on its own and has no setting to stop it. While this poller runs,
+ * the status, mode and brightness reports of the library are dropped (-Wl,--wrap in mos.yml), so the hub follows
+ * one source only.
+ */
+int __wrap_mgos_event_trigger(int ev, void* ev_data) {
+    bool report = ev == MGOS_TWINKLY_EV_STATUS || ev == MGOS_TWINKLY_EV_MODE || ev == MGOS_TWINKLY_EV_BRIGHTNESS;
+    if (report && !s_poll.emitting && mgos_sys_config_get_app_poll_enable()) {
+        s_poll.lib_dropped++;
+        return 0;
+    }
+    return __real_mgos_event_trigger(ev, ev_data);
+}
+
+static void resync_finish(int64_t now) {
+    s_poll.resync.active = false;
+    s_poll.resync.took_ms = now - s_poll.resync.started_ms;
+    s_poll.resync.online = 0;
+    for (int i = 0; i < s_poll.resync.devices && i < s_poll.num_dev; i++) {
+        if (s_poll.dev[i].resync)
+            s_poll.dev[i].resync = false; // timed out, left to regular polling
+        else if (s_poll.dev[i].online)
+            s_poll.resync.online++;
+    }
+    LOG(LL_INFO,
+        ("Resync done: %d/%d devices consistent in %lld ms",
+         s_poll.resync.online,
+         s_poll.resync.devices,
+         (long long) s_poll.resync.took_ms));
+    if (s_poll.resync.cb)
+        s_poll.resync.cb(s_poll.resync.took_ms, s_poll.resync.arg);
+}
+
+static void poll_result_cb(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    s_poll.inflight--;
+    if (index < 0 || index >= s_poll.num_dev)
+        return; // device was removed meanwhile
+    tw_poll_dev_t* dev = &s_poll.dev[index];
+    dev->inflight = false;
+    if (index >= tw_client_count())
+        return; // device was removed meanwhile
+    if (!ok && status == NULL) {
+        dev->next_ms = now_ms(); // cancelled in the queue, e.g. by a command, read the result right after it
+        return;
+    }
+    if (!ok) {
+        dev->fails++;
+        s_poll.minute_fails++;
+        if (dev->online || !dev->known) {
+            dev->online = false;
+            dev->known = true;
+            emit(MGOS_TWINKLY_EV_STATUS, index, false);
+        }
+    } else {
+        dev->fails = 0;
+        dev->seen_ms = now_ms();
+        if (!dev->online) {
+            dev->online = true;
+            emit(MGOS_TWINKLY_EV_STATUS, index, true);
+        }
+        if (!dev->known || dev->last.on != status->on)
+            emit(MGOS_TWINKLY_EV_MODE, index, status->on);
+        if (!dev->known || dev->last.brightness != status->brightness)
+            emit(MGOS_TWINKLY_EV_BRIGHTNESS, index, status->brightness);
+        dev->last = *status;
+        dev->known = true;
+    }
+    schedule(dev, now_ms());
+    if (dev->resync) {
+        dev->resync = false;
+        if (--s_poll.resync.left == 0)
+            resync_finish(now_ms());
+        else
+            poll_start_due(now_ms()); // keep the pipeline full instead of waiting for a tick
+    }
+    (void) arg;
+}
+
+static int budget_per_minute(void) {
+    int budget = 0;
+    for (int i = 0; i < device_count(); i++) {
+        if (s_poll.dev[i].interval_ms > 0)
+            budget += 60000 / s_poll.dev[i].interval_ms;
+    }
+    return budget;
+}
+
+static void poll_start_due(int64_t now) {
+    int n = device_count();
+    int max_inflight = s_poll.resync.active ? mgos_sys_config_get_app_resync_concurrency()
+                                            : mgos_sys_config_get_app_poll_max_inflight();
+    // Round robin so a burst of due devices is served fairly
+    for (int k = 0; k < n && s_poll.inflight < max_inflight; k++) {
+        int i = (s_poll.cursor + k) % n;
+        tw_poll_dev_t* dev = &s_poll.dev[i];
+        if (dev->inflight || now < dev->next_ms)
+            continue;
+        enum tw_prio prio = dev->resync ? TW_PRIO_RECONCILE : TW_PRIO_BACKGROUND;
+        // Before queueing: a request that fails to start completes right away and clears them
+        dev->inflight = true;
+        s_poll.inflight++;
+        s_poll.minute_polls++;
+        s_poll.cursor = (i + 1) % n;
+        if (!tw_queue_get_status(i, prio, poll_result_cb, NULL)) {
+            dev->inflight = false;
+            s_poll.inflight--;
+            s_poll.minute_polls--;
+            schedule(dev, now);
+        }
+    }
+}
+
+static void poll_timer_cb(void* arg) {
+    int64_t now = now_ms();
+    if (now - s_poll.minute_start_ms >= 60000) {
+        s_poll.last_minute_polls = s_poll.minute_polls;
+        s_poll.last_minute_fails = s_poll.minute_fails;
+        s_poll.minute_polls = s_poll.minute_fails = 0;
+        s_poll.minute_start_ms = now;
+        LOG(LL_INFO,
+            ("Poll budget: %d/min, last minute %d polls, %d failed",
+             budget_per_minute(),
+             s_poll.last_minute_polls,
+             s_poll.last_minute_fails));
+    }
+    if (s_poll.resync.active && now - s_poll.resync.started_ms >= mgos_sys_config_get_app_resync_timeout_ms())
+        resync_finish(now);
+    if (mgos_sys_config_get_app_poll_enable() || s_poll.resync.active)
+        poll_start_due(now);
+    (void) arg;
+}
+
+void tw_poll_resync(tw_poll_resync_cb_t cb, void* arg) {
+    int n = device_count();
+    int64_t now = now_ms();
+    s_poll.resync.active = true;
+    s_poll.resync.left = s_poll.resync.devices = n;
+    s_poll.resync.started_ms = now;
+    s_poll.resync.cb = cb;
+    s_poll.resync.arg = arg;
+    LOG(LL_INFO, ("Resync of %d devices, %d at once", n, mgos_sys_config_get_app_resync_concurrency()));
+    for (int i = 0; i < n; i++) {
+        s_poll.dev[i].resync = true;
+        s_poll.dev[i].next_ms = now;
+    }
+    if (n == 0)
+        resync_finish(now);
+    else
+        poll_start_due(now);
+}
+
+void tw_poll_touch(int index) {
+    if (index < 0 || index >= s_poll.num_dev)
+        return;
+    tw_poll_dev_t* dev = &s_poll.dev[index];
+    int64_t now = now_ms();
+    int64_t next = now + mgos_sys_config_get_app_poll_fast_interval_ms();
+    dev->hot_until_ms = now + mgos_sys_config_get_app_poll_fast_window_ms();
+    if (dev->next_ms > next)
+        dev->next_ms = next;
+}
+
+void tw_poll_refresh(int index) {
+    if (index < 0 || index >= s_poll.num_dev)
+        return;
+    tw_poll_dev_t* dev = &s_poll.dev[index];
+    int64_t now = now_ms();
+    if (!dev->inflight && dev->next_ms > now)
+        dev->next_ms = now;
+}
+
+int64_t tw_poll_last_seen_ms(int index) {
+    return (index >= 0 && index < s_poll.num_dev) ? s_poll.dev[index].seen_ms : 0;
+}
+
+static void twinkly_list_cb(int ev, void* ev_data, void* userdata) {
+    const mgos_twinkly_ev_data_t* data = ev_data;
+    // Queued and running polls move down with their device, so do their inflight flags
+    if (ev == MGOS_TWINKLY_EV_REMOVED && data != NULL && data->index >= 0 && data->index < s_poll.num_dev) {
+        memmove(&s_poll.dev[data->index],
+                &s_poll.dev[data->index + 1],
+                (s_poll.num_dev - data->index - 1) * sizeof(*s_poll.dev));
+        s_poll.dev[s_poll.num_dev - 1].inflight = false;
+    }
+    resize(mgos_twinkly_count());
+    if (ev == MGOS_TWINKLY_EV_INITIALIZED)
+        return; // list loaded, new slots are zeroed already
+    // Indexes are shifted on removal, start over
+    for (int i = 0; i < s_poll.num_dev; i++) {
+        bool inflight = s_poll.dev[i].inflight;
+        memset(&s_poll.dev[i], 0, sizeof(s_poll.dev[i]));
+        s_poll.dev[i].inflight = inflight;
+    }
+    if (s_poll.resync.active)
+        resync_finish(now_ms());
+    (void) userdata;
+}
+
+static int print_devices(struct json_out* out, va_list* ap) {
+    int len = json_printf(out, "[");
+    int64_t now = now_ms();
+    for (int i = 0; i < device_count(); i++) {
+        const tw_poll_dev_t* dev = &s_poll.dev[i];
+        len += json_printf(
+                out,
+                "%s{index: %d, online: %B, interval_ms: %d, fails: %d, next_in_ms: %d}",
+                i ? ", " : "",
+                i,
+                dev->online,
+                dev->interval_ms,
+                dev->fails,
+                (int) (dev->next_ms > now ? dev->next_ms - now : 0));
+    }
+    len += json_printf(out, "]");
+    (void) ap;
+    return len;
+}
+
+static void poll_stats_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(
+            ri,
+            "{budget_per_min: %d, last_min_polls: %d, last_min_fails: %d, inflight: %d, max_inflight: %d, "
+            "lib_dropped: %u, resync: {active: %B, devices: %d, online: %d, took_ms: %lld}, devices: %M}",
+            budget_per_minute(),
+            s_poll.last_minute_polls,
+            s_poll.last_minute_fails,
+            s_poll.inflight,
+            mgos_sys_config_get_app_poll_max_inflight(),
+            (unsigned) s_poll.lib_dropped,
+            s_poll.resync.active,
+            s_poll.resync.devices,
+            s_poll.resync.online,
+            (long long) s_poll.resync.took_ms,
+            print_devices);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_poll_init(void) {
+    memset(&s_poll, 0, sizeof(s_poll));
+    s_poll.minute_start_ms = now_ms();
+    resize(mgos_twinkly_count());
+    mgos_event_add_handler(MGOS_TWINKLY_EV_INITIALIZED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_ADDED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_REMOVED, twinkly_list_cb, NULL);
+    mgos_set_timer(TW_POLL_TICK_MS, MGOS_TIMER_REPEAT, poll_timer_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Poll", "", poll_stats_handler, NULL);
+    return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Adaptive device status polling.
+ *
+ * Devices that were recently changed or commanded are polled at the fast interval, healthy devices at the regular
+ * one and offline devices back off exponentially with jitter. Results are delivered as MGOS_TWINKLY_EV_* events.
+ */
+
+bool tw_poll_init(void);
+
+typedef void (*tw_poll_resync_cb_t)(int64_t took_ms, void* arg);
+
+/**
+ * Poll every device once, app.resync.concurrency at a time, and call `cb` when all of them answered or
+ * app.resync.timeout_ms passed. Devices that did not make it keep their stored state.
+ */
+void tw_poll_resync(tw_poll_resync_cb_t cb, void* arg);
+
+/**
+ * Mark the device as recently changed, so it is polled soon and frequently.
+ */
+void tw_poll_touch(int index);
+
+/**
+ * Poll the device at the next tick, without changing its schedule class. No-op if a poll is already running.
+ */
+void tw_poll_refresh(int index);
+
+/**
+ * Uptime of the last successful poll of the device, ms. 0 if never.
+ */
+int64_t tw_poll_last_seen_ms(int index);
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_queue.h"
+
+#include "mgos.h"
+#include "mgos_event.h"
+#include "mgos_rpc.h"
+#include "mgos_twinkly.h"
+#include "tw_heap.h"
+#include "tw_poll.h"
+#include "tw_stats.h"
+#include "tw_trace.h"
+
+#define TW_QUEUE_LEN (MAX_TWINKLY_DEVICES * 2)
+
+enum tw_cmd {
+    TW_CMD_STATUS,
+    TW_CMD_SET,
+};
+
+typedef struct {
+    tw_queue_id_t id; // 0 if the slot is free, ids grow, so the lowest one was queued first
+    enum tw_prio prio;
+    enum tw_cmd cmd;
+    int index;
+    int on; // TW_CMD_SET values, negative if not set
+    int brightness;
+    bool running;
+    int64_t queued_us;
+    tw_client_cb_t cb;
+    void* arg;
+} tw_queue_entry_t;
+
+typedef struct {
+    int depth;
+    int max_depth;
+    uint32_t queued;
+    uint32_t cancelled;
+    uint32_t rejected; // queue was full
+} tw_queue_class_t;
+
+static const char* s_class_names[TW_PRIO_MAX] = { "interactive", "reconcile", "background" };
+static tw_queue_entry_t s_queue[TW_QUEUE_LEN];
+static tw_queue_class_t s_class[TW_PRIO_MAX];
+static bool* s_busy = NULL; // a request of the device is running, sized to the device list
+static int s_num_busy = 0;
+static int s_inflight = 0;
+static tw_queue_id_t s_next_id = 1;
+
+static void dispatch(void);
+
+static bool busy(int index) {
+    return index >= 0 && index < s_num_busy && s_busy[index];
+}
+
+static void set_busy(int index, bool value) {
+    if (index >= 0 && index < s_num_busy)
+        s_busy[index] = value;
+}
+
+static void release(tw_queue_entry_t* e) {
+    if (e->running) {
+        set_busy(e->index, false);
+        s_inflight--;
+    } else {
+        s_class[e->prio].depth--;
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+static void entry_done_cb(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    tw_queue_entry_t* e = arg;
+    // The device list may have changed while the request was running, the entry has the index it has now
+    index = e->index;
+    tw_client_cb_t cb = e->cb;
+    void* cb_arg = e->arg;
+    release(e);
+    if (cb)
+        cb(index, ok, status, cb_arg);
+    dispatch();
+}
+
+static void start(tw_queue_entry_t* e) {
+    bool started = false;
+    s_class[e->prio].depth--;
+    e->running = true;
+    set_busy(e->index, true);
+    s_inflight++;
+    tw_stats_record(TW_STAT_WAIT_INTERACTIVE + e->prio, mgos_uptime_micros() - e->queued_us, true);
+    TW_TRACE_ASYNC_END("queue", e->index + 1, e->id, e->prio);
+    switch (e->cmd) {
+        case TW_CMD_STATUS:
+            started = tw_client_get_status(e->index, entry_done_cb, e);
+            break;
+        case TW_CMD_SET:
+            started = tw_client_set_state(e->index, e->on, e->brightness, entry_done_cb, e);
+            break;
+    }
+    if (!started) {
+        tw_client_status_t none = { 0 };
+        entry_done_cb(e->index, false, &none, e);
+    }
+}
+
+static void dispatch(void) {
+    static bool s_dispatching = false;
+    int max_inflight = mgos_sys_config_get_app_queue_max_inflight();
+    int reserve = mgos_sys_config_get_app_queue_reserve();
+    if (s_dispatching)
+        return; // completion of a request that failed to start, the outer loop goes on
+    s_dispatching = true;
+    while (s_inflight < max_inflight) {
+        tw_queue_entry_t* next = NULL;
+        for (int i = 0; i < TW_QUEUE_LEN; i++) {
+            tw_queue_entry_t* e = &s_queue[i];
+            if (e->id == 0 || e->running || busy(e->index))
+                continue;
+            if (e->prio != TW_PRIO_INTERACTIVE && s_inflight >= max_inflight - reserve)
+                continue;
+            if (next == NULL || e->prio < next->prio || (e->prio == next->prio && e->id < next->id))
+                next = e;
+        }
+        if (next == NULL)
+            break;
+        start(next);
+    }
+    s_dispatching = false;
+}
+
+static int cancel_matching(enum tw_prio prio, int index, bool status_only);
+
+static tw_queue_id_t enqueue(
+        enum tw_cmd cmd,
+        int index,
+        int on,
+        int brightness,
+        enum tw_prio prio,
+        tw_client_cb_t cb,
+        void* arg) {
+    tw_queue_entry_t* e = NULL;
+    if (index < 0 || index >= tw_client_count() || prio >= TW_PRIO_MAX)
+        return 0;
+    if (cmd != TW_CMD_STATUS) {
+        for (int p = prio + 1; p < TW_PRIO_MAX; p++)
+            cancel_matching(p, index, true);
+    }
+    for (int i = 0; i < TW_QUEUE_LEN && e == NULL; i++) {
+        if (s_queue[i].id == 0)
+            e = &s_queue[i];
+    }
+    if (e == NULL) {
+        s_class[prio].rejected++;
+        LOG(LL_WARN, ("Command queue full, %s request to Twinkly %d dropped", s_class_names[prio], index));
+        return 0;
+    }
+    e->id = s_next_id++;
+    if (s_next_id == 0)
+        s_next_id = 1;
+    e->cmd = cmd;
+    e->prio = prio;
+    e->index = index;
+    e->on = on;
+    e->brightness = brightness;
+    e->queued_us = mgos_uptime_micros();
+    e->cb = cb;
+    e->arg = arg;
+    tw_queue_id_t id = e->id;
+    TW_TRACE_ASYNC_BEGIN("queue", index + 1, id);
+    tw_queue_class_t* cls = &s_class[prio];
+    cls->queued++;
+    if (++cls->depth > cls->max_depth)
+        cls->max_depth = cls->depth;
+    dispatch();
+    return id;
+}
+
+tw_queue_id_t tw_queue_get_status(int index, enum tw_prio prio, tw_client_cb_t cb, void* arg) {
+    return enqueue(TW_CMD_STATUS, index, -1, -1, prio, cb, arg);
+}
+
+tw_queue_id_t tw_queue_set_mode(int index, bool on, enum tw_prio prio, tw_client_cb_t cb, void* arg) {
+    return enqueue(TW_CMD_SET, index, on, -1, prio, cb, arg);
+}
+
+tw_queue_id_t tw_queue_set_brightness(int index, int brightness, enum tw_prio prio, tw_client_cb_t cb, void* arg) {
+    return enqueue(TW_CMD_SET, index, -1, brightness, prio, cb, arg);
+}
+
+tw_queue_id_t tw_queue_set_state(int index, int on, int brightness, enum tw_prio prio, tw_client_cb_t cb, void* arg) {
+    return enqueue(TW_CMD_SET, index, on, brightness, prio, cb, arg);
+}
+
+static void cancel(tw_queue_entry_t* e) {
+    int index = e->index;
+    tw_client_cb_t cb = e->cb;
+    void* cb_arg = e->arg;
+    s_class[e->prio].cancelled++;
+    TW_TRACE_ASYNC_END("queue", index + 1, e->id, -1);
+    release(e);
+    if (cb)
+        cb(index, false, NULL, cb_arg);
+}
+
+bool tw_queue_cancel(tw_queue_id_t id) {
+    for (int i = 0; id != 0 && i < TW_QUEUE_LEN; i++) {
+        if (s_queue[i].id == id && !s_queue[i].running) {
+            cancel(&s_queue[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int cancel_matching(enum tw_prio prio, int index, bool status_only) {
+    int n = 0;
+    for (int i = 0; i < TW_QUEUE_LEN; i++) {
+        tw_queue_entry_t* e = &s_queue[i];
+        if (e->id == 0 || e->running || e->prio != prio || (index >= 0 && e->index != index))
+            continue;
+        if (status_only && e->cmd != TW_CMD_STATUS)
+            continue;
+        cancel(e);
+        n++;
+    }
+    return n;
+}
+
+int tw_queue_cancel_class(enum tw_prio prio, int index) {
+    return cancel_matching(prio, index, false);
+}
+
+/* Requests still running keep their device busy, whatever it is called now */
+static void resize_busy(void) {
+    int n = mgos_twinkly_count();
+    if (n > MAX_TWINKLY_DEVICES)
+        n = MAX_TWINKLY_DEVICES;
+    if (n == 0) {
+        tw_heap_free(s_busy);
+        s_busy = NULL;
+        s_num_busy = 0;
+        return;
+    }
+    if (n != s_num_busy) {
+        bool* b = tw_heap_realloc(TW_HEAP_STATE, s_busy, n * sizeof(*b));
+        if (b == NULL) {
+            LOG(LL_ERROR, ("No memory to queue for %d devices", n));
+        } else {
+            s_busy = b;
+            s_num_busy = n;
+        }
+    }
+    if (s_num_busy)
+        memset(s_busy, 0, s_num_busy * sizeof(*s_busy));
+    for (int i = 0; i < TW_QUEUE_LEN; i++) {
+        if (s_queue[i].id != 0 && s_queue[i].running)
+            set_busy(s_queue[i].index, true);
+    }
+}
+
+/**
+ * A removed device takes its queued requests with it, the ones of the devices after it move down by one like the
+ * device list does. Callbacks of the removed device's requests get index -1, also the one of a request still running.
+ */
+static void remove_device(int removed) {
+    for (int i = 0; i < TW_QUEUE_LEN; i++) {
+        tw_queue_entry_t* e = &s_queue[i];
+        if (e->id == 0 || e->index < removed)
+            continue;
+        if (e->index > removed) {
+            e->index--;
+        } else {
+            e->index = -1;
+            if (!e->running)
+                cancel(e);
+        }
+    }
+}
+
+static void twinkly_list_cb(int ev, void* ev_data, void* userdata) {
+    const mgos_twinkly_ev_data_t* data = ev_data;
+    if (ev == MGOS_TWINKLY_EV_REMOVED && data != NULL) {
+        remove_device(data->index);
+    } else if (ev == MGOS_TWINKLY_EV_REMOVED) {
+        // No way to tell which indexes are still valid
+        for (int p = 0; p < TW_PRIO_MAX; p++)
+            tw_queue_cancel_class(p, -1);
+    }
+    // Devices are added at the end of the list, queued requests keep their index
+    resize_busy();
+    (void) userdata;
+}
+
+static int print_queue(struct json_out* out, va_list* ap) {
+    int len = json_printf(
+            out,
+            "{inflight: %d, max_inflight: %d, reserve: %d",
+            s_inflight,
+            mgos_sys_config_get_app_queue_max_inflight(),
+            mgos_sys_config_get_app_queue_reserve());
+    for (int p = 0; p < TW_PRIO_MAX; p++) {
+        const tw_queue_class_t* cls = &s_class[p];
+        len += json_printf(
+                out,
+                ", %s: {depth: %d, max_depth: %d, queued: %u, cancelled: %u, rejected: %u}",
+                s_class_names[p],
+                cls->depth,
+                cls->max_depth,
+                (unsigned) cls->queued,
+                (unsigned) cls->cancelled,
+                (unsigned) cls->rejected);
+    }
+    len += json_printf(out, "}");
+    (void) ap;
+    return len;
+}
+
+static void queue_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(ri, "%M", print_queue);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+static void command_done_cb(int index, bool ok, const tw_client_status_t* status, void* arg) {
+    struct mg_rpc_request_info* ri = arg;
+    if (ok) {
+        tw_poll_touch(index);
+        mg_rpc_send_responsef(ri, "{index: %d}", index);
+    } else {
+        mg_rpc_send_errorf(ri, 503, "Twinkly %d did not accept the command", index);
+    }
+    (void) status;
+}
+
+/* Web UI commands, e.g. {"ip": "192.168.1.10", "on": true} */
+static void command_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    int index = -1, brightness = -1;
+    char* ip = NULL;
+    bool on = false;
+    bool has_on = (json_scanf(args.p, args.len, "{on: %B}", &on) == 1);
+    json_scanf(args.p, args.len, ri->args_fmt, &index, &ip, &brightness);
+    if (ip != NULL)
+        index = tw_client_find(ip);
+    free(ip);
+    if (index < 0 || index >= tw_client_count() || (!has_on && brightness < 0)) {
+        mg_rpc_send_errorf(ri, 400, "index or ip and one of on, brightness are required");
+        return;
+    }
+    if (!tw_queue_set_state(index, has_on ? on : -1, brightness, TW_PRIO_INTERACTIVE, command_done_cb, ri))
+        mg_rpc_send_errorf(ri, 503, "command queue is full");
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_queue_init(void) {
+    resize_busy();
+    mgos_event_add_handler(MGOS_TWINKLY_EV_INITIALIZED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_ADDED, twinkly_list_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_REMOVED, twinkly_list_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Queue", "", queue_handler, NULL);
+    mg_rpc_add_handler(
+            mgos_rpc_get_global(), "Hub.Command", "{index: %d, ip: %Q, brightness: %d}", command_handler, NULL);
+    return true;
+}
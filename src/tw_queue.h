@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tw_client.h"
+
+/**
+ * Outbound device command queue.
+ *
+ * Every request to a device goes through here. Queued requests are started by priority class, then in order, one
+ * at a time per device and up to app.queue.max_inflight in total, with app.queue.reserve of those slots kept for
+ * interactive commands, so a user command never waits behind a sweep of status polls.
+ * Callbacks of cancelled requests are called with `ok` false and `status` NULL.
+ * When a device is removed, queued and running requests follow their device to its new index. Queued requests of
+ * the removed device are cancelled, and callbacks of its requests get index -1.
+ */
+
+enum tw_prio {
+    TW_PRIO_INTERACTIVE, // HomeKit writes, web UI
+    TW_PRIO_RECONCILE,   // startup resync, confirmations
+    TW_PRIO_BACKGROUND,  // regular status polls
+    TW_PRIO_MAX,
+};
+
+/* Queued request handle, 0 is never a valid one */
+typedef uint32_t tw_queue_id_t;
+
+bool tw_queue_init(void);
+
+tw_queue_id_t tw_queue_get_status(int index, enum tw_prio prio, tw_client_cb_t cb, void* arg);
+
+/**
+ * Queue a command. Queued status requests of the device with a lower priority are cancelled, they would only
+ * read the value the command is about to change.
+ */
+tw_queue_id_t tw_queue_set_mode(int index, bool on, enum tw_prio prio, tw_client_cb_t cb, void* arg);
+
+tw_queue_id_t tw_queue_set_brightness(int index, int brightness, enum tw_prio prio, tw_client_cb_t cb, void* arg);
+
+/**
+ * Queue mode and brightness as one command, a negative value leaves that one as it is.
+ */
+tw_queue_id_t tw_queue_set_state(int index, int on, int brightness, enum tw_prio prio, tw_client_cb_t cb, void* arg);
+
+/**
+ * Drop a request that was not started yet. Returns false if it already runs or finished.
+ */
+bool tw_queue_cancel(tw_queue_id_t id);
+
+/**
+ * Drop all queued requests of the class, of one device or of all if `index` is -1. Returns the number cancelled.
+ */
+int tw_queue_cancel_class(enum tw_prio prio, int index);
@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_sched.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mgos.h"
+#include "mgos_event.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+#include "mgos_twinkly.h"
+#include "tw_client.h"
+#include "tw_kv.h"
+
+#define TW_SCHED_KV_DOMAIN ((HAPPlatformKeyValueStoreDomain) 0x10)
+#define TW_SCHED_MAX_RULES 32
+#define TW_SCHED_SLOTS     256 // 25.6 s per turn
+#define TW_SCHED_ALL_DAYS  0x7F
+#define TW_SCHED_MAX_STEP  (31 * 86400) // longest Hub.Schedule.Clock advance, s
+#define TW_SCHED_MAX_CATCH (10 * 1000)  // later than this after a clock jump, rules are skipped, ms
+#define TW_SCHED_VALID_MS  1577836800000LL // 2020-01-01, earlier means the clock is not set yet
+
+enum tw_sched_kind {
+    TW_SCHED_AT,
+    TW_SCHED_SUNRISE,
+    TW_SCHED_SUNSET,
+    TW_SCHED_KIND_MAX,
+};
+
+static const char* const s_kind_names[TW_SCHED_KIND_MAX] = { "at", "sunrise", "sunset" };
+
+/* As stored, a record is the 8 byte head and the device bitmap, which grows with MAX_TWINKLY_DEVICES */
+typedef struct {
+    uint8_t kind;
+    uint8_t days; // bit 0 Sunday .. bit 6 Saturday
+    int8_t on;    // -1 leave as it is
+    int8_t brightness;
+    int16_t minutes; // minute of the day for TW_SCHED_AT, offset from the sun event otherwise
+    uint8_t enabled;
+    uint8_t reserved;
+    uint8_t devices[TW_SCHED_MASK_BYTES]; // none set: every device
+} tw_sched_rule_t;
+
+#define TW_SCHED_RULE_HEAD offsetof(tw_sched_rule_t, devices)
+
+typedef struct {
+    bool used;
+    tw_sched_rule_t rule;
+    int64_t due_ms; // wall clock, 0 when not in the wheel
+    uint32_t rounds;  // turns left before the slot means it
+    int8_t next;      // in the slot list
+    uint32_t fired;
+    int64_t last_ms;
+    int32_t last_late_ms;
+} tw_sched_entry_t;
+
+static tw_sched_entry_t s_rules[TW_SCHED_MAX_RULES];
+static int8_t s_slots[TW_SCHED_SLOTS]; // rule list heads, -1 empty
+static int64_t s_tick;                 // last tick processed, wall clock / TW_SCHED_TICK_MS
+static int s_armed;
+static mgos_timer_id s_timer = MGOS_INVALID_TIMER_ID;
+static tw_sched_action_cb_t s_action = NULL;
+static void* s_action_arg = NULL;
+
+static struct {
+    int64_t offset_ms; // added to the real clock
+    bool hold;         // stands still at held_ms, moved only by advance
+    int64_t held_ms;
+} s_clock;
+
+static struct {
+    uint32_t fired;
+    uint32_t skipped; // passed by a clock jump
+    int32_t max_late_ms;
+} s_stats;
+
+static int64_t wall_ms(void) {
+    return s_clock.hold ? s_clock.held_ms : (int64_t) (mg_time() * 1000) + s_clock.offset_ms;
+}
+
+static bool clock_valid(void) {
+    return wall_ms() >= TW_SCHED_VALID_MS;
+}
+
+/* Epoch seconds of sunrise or sunset on the day of `noon`, the sunrise equation, ~1 minute accuracy */
+static bool sun_event(time_t noon, bool rise, double* at) {
+    const double rad = M_PI / 180;
+    double lat = mgos_sys_config_get_app_sched_lat();
+    double lon = mgos_sys_config_get_app_sched_lon();
+    double n = round(noon / 86400.0 + 2440587.5 - 2451545.0 + lon / 360);
+    double j = n - lon / 360; // mean solar noon
+    double m = fmod(357.5291 + 0.98560028 * j, 360);
+    double c = 1.9148 * sin(m * rad) + 0.02 * sin(2 * m * rad) + 0.0003 * sin(3 * m * rad);
+    double l = fmod(m + c + 180 + 102.9372, 360);
+    double transit = 2451545.0 + j + 0.0053 * sin(m * rad) - 0.0069 * sin(2 * l * rad);
+    double decl = asin(sin(l * rad) * sin(23.4397 * rad));
+    double cosw = (sin(-0.833 * rad) - sin(lat * rad) * sin(decl)) / (cos(lat * rad) * cos(decl));
+    if (cosw < -1 || cosw > 1)
+        return false; // polar day or night
+    double w = acos(cosw) / rad;
+    *at = ((rise ? transit - w / 360 : transit + w / 360) - 2440587.5) * 86400;
+    return true;
+}
+
+/* First time the rule is due after `after_ms`, 0 if not within a week */
+static int64_t next_due(const tw_sched_rule_t* r, int64_t after_ms) {
+    time_t t = (time_t) (after_ms / 1000);
+    struct tm today;
+    localtime_r(&t, &today);
+    // A sunrise rule with a large negative offset may fall on the previous day
+    for (int d = -1; d <= 7; d++) {
+        struct tm day = today;
+        day.tm_mday += d;
+        day.tm_hour = 12;
+        day.tm_min = day.tm_sec = 0;
+        day.tm_isdst = -1;
+        time_t noon = mktime(&day);
+        if (!(r->days & (1 << day.tm_wday)))
+            continue;
+        int64_t due;
+        if (r->kind == TW_SCHED_AT) {
+            day.tm_hour = r->minutes / 60;
+            day.tm_min = r->minutes % 60;
+            day.tm_isdst = -1;
+            due = (int64_t) mktime(&day) * 1000;
+        } else {
+            double at;
+            if (!sun_event(noon, r->kind == TW_SCHED_SUNRISE, &at))
+                continue;
+            due = (int64_t) (at * 1000) + r->minutes * 60000LL;
+        }
+        if (due > after_ms)
+            return due;
+    }
+    return 0;
+}
+
+static void unlink_rule(int id) {
+    tw_sched_entry_t* e = &s_rules[id];
+    if (e->due_ms == 0)
+        return;
+    int slot = (int) (((e->due_ms + TW_SCHED_TICK_MS - 1) / TW_SCHED_TICK_MS) % TW_SCHED_SLOTS);
+    for (int8_t* p = &s_slots[slot]; *p >= 0; p = &s_rules[*p].next) {
+        if (*p == id) {
+            *p = e->next;
+            break;
+        }
+    }
+    e->due_ms = 0;
+    s_armed--;
+}
+
+static void timer_cb(void* arg);
+
+/* Put the rule in the slot of its due tick, rounded up so it never fires early */
+static void link_rule(int id, int64_t due_ms) {
+    tw_sched_entry_t* e = &s_rules[id];
+    int64_t tick = (due_ms + TW_SCHED_TICK_MS - 1) / TW_SCHED_TICK_MS;
+    if (tick <= s_tick) {
+        tick = s_tick + 1;
+        due_ms = tick * TW_SCHED_TICK_MS;
+    }
+    int slot = (int) (tick % TW_SCHED_SLOTS);
+    e->due_ms = due_ms;
+    e->rounds = (uint32_t) ((tick - s_tick - 1) / TW_SCHED_SLOTS);
+    e->next = s_slots[slot];
+    s_slots[slot] = id;
+    s_armed++;
+    if (s_timer == MGOS_INVALID_TIMER_ID && !s_clock.hold)
+        s_timer = mgos_set_timer(TW_SCHED_TICK_MS, MGOS_TIMER_REPEAT, timer_cb, NULL);
+}
+
+static void arm_rule(int id, int64_t after_ms) {
+    tw_sched_entry_t* e = &s_rules[id];
+    unlink_rule(id);
+    if (!e->used || !e->rule.enabled || !mgos_sys_config_get_app_sched_enable() || !clock_valid())
+        return;
+    int64_t due = next_due(&e->rule, after_ms);
+    if (due)
+        link_rule(id, due);
+}
+
+/* Rebuild the wheel from the current clock, rules due in between are not fired */
+static void rearm_all(void) {
+    int64_t now = wall_ms();
+    s_tick = now / TW_SCHED_TICK_MS;
+    for (int i = 0; i < TW_SCHED_SLOTS; i++)
+        s_slots[i] = -1;
+    for (int i = 0; i < TW_SCHED_MAX_RULES; i++) {
+        if (s_rules[i].due_ms)
+            s_armed--;
+        s_rules[i].due_ms = 0;
+        arm_rule(i, now);
+    }
+}
+
+static void fire(int id, int64_t now) {
+    tw_sched_entry_t* e = &s_rules[id];
+    const tw_sched_rule_t* r = &e->rule;
+    bool all = true;
+    for (int i = 0; i < TW_SCHED_MASK_BYTES; i++)
+        all = all && r->devices[i] == 0;
+    int32_t late = (int32_t) (now - e->due_ms);
+    e->fired++;
+    e->last_ms = e->due_ms;
+    e->last_late_ms = late;
+    s_stats.fired++;
+    if (late > s_stats.max_late_ms)
+        s_stats.max_late_ms = late;
+    LOG(LL_INFO, ("Schedule rule %d: on %d, brightness %d, %d ms late", id, r->on, r->brightness, (int) late));
+    if (s_action)
+        s_action(all ? NULL : r->devices, r->on, r->brightness, s_action_arg);
+}
+
+/* Visit the slots of the ticks up to `target`, firing the rules whose turn it is */
+static void advance_to(int64_t target) {
+    uint32_t steps = 0;
+    int64_t held = s_clock.held_ms; // a held clock shows the tick being visited to the actions
+    while (s_tick < target && s_armed > 0) {
+        // A whole turn without a rule on its last round only counts the rounds down
+        if (target - s_tick >= TW_SCHED_SLOTS) {
+            bool idle = true;
+            for (int i = 0; i < TW_SCHED_MAX_RULES && idle; i++)
+                idle = s_rules[i].due_ms == 0 || s_rules[i].rounds > 0;
+            if (idle) {
+                for (int i = 0; i < TW_SCHED_MAX_RULES; i++) {
+                    if (s_rules[i].due_ms)
+                        s_rules[i].rounds--;
+                }
+                s_tick += TW_SCHED_SLOTS;
+                continue;
+            }
+        }
+        s_tick++;
+        if (s_clock.hold)
+            s_clock.held_ms = s_tick * TW_SCHED_TICK_MS;
+        int slot = (int) (s_tick % TW_SCHED_SLOTS);
+        int8_t id = s_slots[slot];
+        s_slots[slot] = -1;
+        while (id >= 0) {
+            tw_sched_entry_t* e = &s_rules[id];
+            int8_t next = e->next;
+            if (e->rounds > 0) {
+                e->rounds--;
+                e->next = s_slots[slot];
+                s_slots[slot] = id;
+            } else {
+                int64_t due = e->due_ms;
+                fire(id, wall_ms());
+                arm_rule(id, due); // not in the slot any more, unlinking only drops the count
+            }
+            id = next;
+        }
+        if (++steps % 4096 == 0)
+            mgos_wdt_feed();
+    }
+    if (s_tick < target)
+        s_tick = target;
+    s_clock.held_ms = held;
+}
+
+static void timer_cb(void* arg) {
+    int64_t target = wall_ms() / TW_SCHED_TICK_MS;
+    if (s_armed == 0 || s_clock.hold) {
+        mgos_clear_timer(s_timer);
+        s_timer = MGOS_INVALID_TIMER_ID;
+    } else if (target < s_tick || target - s_tick > TW_SCHED_MAX_CATCH / TW_SCHED_TICK_MS) {
+        // The clock was set, which MGOS_EVENT_TIME_CHANGED did not tell
+        s_stats.skipped++;
+        rearm_all();
+    } else {
+        advance_to(target);
+    }
+    (void) arg;
+}
+
+static void time_changed_cb(int ev, void* ev_data, void* userdata) {
+    LOG(LL_INFO, ("Clock changed, rearming schedules"));
+    rearm_all();
+    (void) ev;
+    (void) ev_data;
+    (void) userdata;
+}
+
+/* Device indexes above the removed one move down by one */
+static void twinkly_removed_cb(int ev, void* ev_data, void* userdata) {
+    const mgos_twinkly_ev_data_t* data = ev_data;
+    if (data == NULL)
+        return;
+    for (int id = 0; id < TW_SCHED_MAX_RULES; id++) {
+        tw_sched_rule_t* r = &s_rules[id].rule;
+        if (!s_rules[id].used)
+            continue;
+        bool any = false, changed = false;
+        for (int i = data->index; i < MAX_TWINKLY_DEVICES; i++) {
+            bool bit = i + 1 < MAX_TWINKLY_DEVICES && (r->devices[(i + 1) / 8] & (1 << ((i + 1) % 8)));
+            bool old = r->devices[i / 8] & (1 << (i % 8));
+            if (bit != old) {
+                r->devices[i / 8] ^= 1 << (i % 8);
+                changed = true;
+            }
+        }
+        for (int i = 0; i < TW_SCHED_MASK_BYTES; i++)
+            any = any || r->devices[i];
+        if (!changed)
+            continue;
+        if (!any) {
+            LOG(LL_WARN, ("Schedule rule %d has no devices left, disabled", id));
+            r->enabled = false;
+            arm_rule(id, wall_ms());
+        }
+        tw_kv_set(TW_SCHED_KV_DOMAIN, id, r, sizeof(*r));
+    }
+    (void) ev;
+    (void) userdata;
+}
+
+static HAPError load_cb(
+        void* _Nullable context,
+        HAPPlatformKeyValueStoreDomain domain,
+        HAPPlatformKeyValueStoreKey key,
+        bool* shouldContinue) {
+    tw_sched_rule_t r;
+    size_t numBytes = 0;
+    bool found = false;
+    memset(&r, 0, sizeof(r));
+    if (key >= TW_SCHED_MAX_RULES)
+        return kHAPError_None;
+    HAPError err = tw_kv_get(domain, key, &r, sizeof(r), &numBytes, &found);
+    if (err || !found || numBytes < TW_SCHED_RULE_HEAD || r.kind >= TW_SCHED_KIND_MAX) {
+        LOG(LL_WARN, ("Schedule rule %d is damaged, ignored", (int) key));
+        return kHAPError_None;
+    }
+    s_rules[key].used = true;
+    s_rules[key].rule = r;
+    (void) context;
+    (void) shouldContinue;
+    return kHAPError_None;
+}
+
+static void print_time(struct json_out* out, int64_t ms, int* len) {
+    char buf[24] = "";
+    time_t t = (time_t) (ms / 1000);
+    struct tm tm;
+    if (ms)
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    *len += json_printf(out, "%Q", buf);
+}
+
+static int print_rule(struct json_out* out, va_list* ap) {
+    int id = va_arg(*ap, int);
+    const tw_sched_entry_t* e = &s_rules[id];
+    const tw_sched_rule_t* r = &e->rule;
+    int len = json_printf(out, "{id: %d, enabled: %B, ", id, (bool) r->enabled);
+    if (r->kind == TW_SCHED_AT)
+        len += json_printf(out, "at: \"%02d:%02d\"", r->minutes / 60, r->minutes % 60);
+    else
+        len += json_printf(out, "sun: %Q, offset: %d", s_kind_names[r->kind], r->minutes);
+    len += json_printf(out, ", days: %d, on: %d, brightness: %d, devices: [", r->days, r->on, r->brightness);
+    for (int i = 0, n = 0; i < MAX_TWINKLY_DEVICES; i++) {
+        if (r->devices[i / 8] & (1 << (i % 8)))
+            len += json_printf(out, "%s%d", n++ ? ", " : "", i);
+    }
+    len += json_printf(out, "], next: ");
+    print_time(out, e->due_ms, &len);
+    len += json_printf(out, ", fired: %u, last: ", (unsigned) e->fired);
+    print_time(out, e->last_ms, &len);
+    len += json_printf(out, ", last_late_ms: %d}", (int) e->last_late_ms);
+    return len;
+}
+
+static int print_schedule(struct json_out* out, va_list* ap) {
+    int64_t now = wall_ms();
+    int len = json_printf(out, "{now: ");
+    print_time(out, now, &len);
+    len += json_printf(
+            out,
+            ", clock: {valid: %B, offset_ms: %lld, hold: %B}, armed: %d, fired: %u, skipped: %u, max_late_ms: %d",
+            clock_valid(),
+            (long long) s_clock.offset_ms,
+            s_clock.hold,
+            s_armed,
+            (unsigned) s_stats.fired,
+            (unsigned) s_stats.skipped,
+            (int) s_stats.max_late_ms);
+    double rise, set;
+    time_t noon = (time_t) (now / 1000);
+    struct tm tm;
+    localtime_r(&noon, &tm);
+    tm.tm_hour = 12;
+    tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    noon = mktime(&tm);
+    if (sun_event(noon, true, &rise) && sun_event(noon, false, &set)) {
+        len += json_printf(out, ", sunrise: ");
+        print_time(out, (int64_t) (rise * 1000), &len);
+        len += json_printf(out, ", sunset: ");
+        print_time(out, (int64_t) (set * 1000), &len);
+    }
+    len += json_printf(out, ", rules: [");
+    for (int id = 0, n = 0; id < TW_SCHED_MAX_RULES; id++) {
+        if (s_rules[id].used)
+            len += json_printf(out, "%s%M", n++ ? ", " : "", print_rule, id);
+    }
+    len += json_printf(out, "]}");
+    (void) ap;
+    return len;
+}
+
+static void list_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(ri, "%M", print_schedule);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+/* Device list of a rule, indexes or IP addresses */
+static bool parse_devices(struct mg_str args, uint8_t* devices) {
+    struct json_token t;
+    memset(devices, 0, TW_SCHED_MASK_BYTES);
+    for (int i = 0; json_scanf_array_elem(args.p, args.len, ".devices", i, &t) > 0; i++) {
+        char buf[20];
+        int index = -1;
+        if (t.type == JSON_TYPE_NUMBER || t.type == JSON_TYPE_STRING) {
+            snprintf(buf, sizeof(buf), "%.*s", t.len, t.ptr);
+            index = t.type == JSON_TYPE_NUMBER ? atoi(buf) : tw_client_find(buf);
+        }
+        if (index < 0 || index >= MAX_TWINKLY_DEVICES)
+            return false;
+        devices[index / 8] |= 1 << (index % 8);
+    }
+    return true;
+}
+
+/**
+ * {id, enable, at: "HH:MM" | sun: "sunrise" | "sunset", offset, days, on, brightness, devices}, a new rule without
+ * `id`, otherwise the fields given replace those of the rule.
+ */
+static void set_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    int id = -1, days = -1, offset = 0, brightness = -2, hh = -1, mm = -1;
+    bool enable = true, on = false;
+    char *at = NULL, *sun = NULL;
+    json_scanf(args.p, args.len, "{id: %d}", &id);
+    bool create = id < 0;
+    for (int i = 0; i < TW_SCHED_MAX_RULES && id < 0; i++) {
+        if (!s_rules[i].used)
+            id = i;
+    }
+    if (id < 0 || id >= TW_SCHED_MAX_RULES || (!create && !s_rules[id].used)) {
+        mg_rpc_send_errorf(ri, create ? 507 : 404, create ? "no free rule" : "no rule %d", id);
+        return;
+    }
+    tw_sched_rule_t r = s_rules[id].rule;
+    if (create) {
+        memset(&r, 0, sizeof(r));
+        r.kind = TW_SCHED_KIND_MAX;
+        r.days = TW_SCHED_ALL_DAYS;
+        r.on = r.brightness = -1;
+        r.enabled = true;
+    }
+    json_scanf(args.p, args.len, "{at: %Q, sun: %Q, days: %d}", &at, &sun, &days);
+    bool has_offset = json_scanf(args.p, args.len, "{offset: %d}", &offset) == 1;
+    bool bad = false;
+    if (at != NULL) {
+        bad = sscanf(at, "%d:%d", &hh, &mm) != 2 || hh < 0 || hh > 23 || mm < 0 || mm > 59;
+        r.kind = TW_SCHED_AT;
+        r.minutes = hh * 60 + mm;
+    } else if (sun != NULL) {
+        r.kind = strcmp(sun, "sunrise") == 0 ? TW_SCHED_SUNRISE : TW_SCHED_SUNSET;
+        bad = r.kind == TW_SCHED_SUNSET && strcmp(sun, "sunset") != 0;
+        r.minutes = 0;
+    }
+    if (has_offset && r.kind != TW_SCHED_AT) {
+        r.minutes = offset;
+        bad = bad || offset < -720 || offset > 720;
+    }
+    free(at);
+    free(sun);
+    if (bad || r.kind >= TW_SCHED_KIND_MAX) {
+        mg_rpc_send_errorf(ri, 400, "at \"HH:MM\" or sun \"sunrise\" / \"sunset\" with offset in minutes required");
+        return;
+    }
+    if (days >= 0)
+        r.days = days & TW_SCHED_ALL_DAYS;
+    if (json_scanf(args.p, args.len, "{on: %B}", &on) == 1)
+        r.on = on;
+    if (json_scanf(args.p, args.len, "{brightness: %d}", &brightness) == 1)
+        r.brightness = brightness < 0 ? -1 : brightness > 100 ? 100 : brightness;
+    if (json_scanf(args.p, args.len, "{enable: %B}", &enable) == 1)
+        r.enabled = enable;
+    if (r.on < 0 && r.brightness < 0) {
+        mg_rpc_send_errorf(ri, 400, "on or brightness required");
+        return;
+    }
+    if (json_scanf_array_elem(args.p, args.len, ".devices", 0, &(struct json_token) {}) > 0 || create) {
+        if (!parse_devices(args, r.devices)) {
+            mg_rpc_send_errorf(ri, 400, "unknown device");
+            return;
+        }
+    }
+    if (tw_kv_set(TW_SCHED_KV_DOMAIN, id, &r, sizeof(r)) != kHAPError_None) {
+        mg_rpc_send_errorf(ri, 500, "failed to save rule %d", id);
+        return;
+    }
+    s_rules[id].used = true;
+    s_rules[id].rule = r;
+    arm_rule(id, wall_ms());
+    mg_rpc_send_responsef(ri, "%M", print_rule, id);
+    (void) cb_arg;
+    (void) fi;
+}
+
+static void remove_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    int id = -1;
+    json_scanf(args.p, args.len, ri->args_fmt, &id);
+    if (id < 0 || id >= TW_SCHED_MAX_RULES || !s_rules[id].used) {
+        mg_rpc_send_errorf(ri, 404, "no rule %d", id);
+        return;
+    }
+    unlink_rule(id);
+    memset(&s_rules[id], 0, sizeof(s_rules[id]));
+    tw_kv_remove(TW_SCHED_KV_DOMAIN, id);
+    mg_rpc_send_responsef(ri, "{id: %d}", id);
+    (void) cb_arg;
+    (void) fi;
+}
+
+/**
+ * Simulated clock: `offset` (s) shifts the clock like a real clock change, rules in between are skipped. `hold` stops
+ * it, then `advance` (s) steps the wheel forward, firing every rule due on the way. `reset` goes back to real time.
+ */
+static void clock_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    int offset = 0, advance = 0;
+    bool hold = false, reset = false;
+    uint32_t fired = s_stats.fired;
+    json_scanf(args.p, args.len, "{reset: %B}", &reset);
+    if (reset) {
+        s_clock.offset_ms = 0;
+        s_clock.hold = false;
+        rearm_all();
+    }
+    if (json_scanf(args.p, args.len, "{offset: %d}", &offset) == 1) {
+        s_clock.offset_ms = offset * 1000LL;
+        if (s_clock.hold)
+            s_clock.held_ms = (int64_t) (mg_time() * 1000) + s_clock.offset_ms;
+        rearm_all();
+    }
+    if (json_scanf(args.p, args.len, "{hold: %B}", &hold) == 1 && hold != s_clock.hold) {
+        if (hold) {
+            s_clock.held_ms = wall_ms();
+            s_clock.hold = true;
+        } else {
+            s_clock.offset_ms = s_clock.held_ms - (int64_t) (mg_time() * 1000);
+            s_clock.hold = false;
+            rearm_all();
+        }
+    }
+    if (json_scanf(args.p, args.len, "{advance: %d}", &advance) == 1) {
+        if (advance < 0 || advance > TW_SCHED_MAX_STEP) {
+            mg_rpc_send_errorf(ri, 400, "advance must be 0..%d s", TW_SCHED_MAX_STEP);
+            return;
+        }
+        if (s_clock.hold)
+            s_clock.held_ms += advance * 1000LL;
+        else
+            s_clock.offset_ms += advance * 1000LL;
+        advance_to(wall_ms() / TW_SCHED_TICK_MS);
+    }
+    char now[24] = "";
+    time_t t = (time_t) (wall_ms() / 1000);
+    struct tm tm;
+    strftime(now, sizeof(now), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    mg_rpc_send_responsef(
+            ri,
+            "{now: %Q, offset_ms: %lld, hold: %B, fired: %u}",
+            now,
+            (long long) (s_clock.hold ? s_clock.held_ms - (int64_t) (mg_time() * 1000) : s_clock.offset_ms),
+            s_clock.hold,
+            (unsigned) (s_stats.fired - fired));
+    (void) cb_arg;
+    (void) fi;
+}
+
+void tw_sched_set_action(tw_sched_action_cb_t cb, void* arg) {
+    s_action = cb;
+    s_action_arg = arg;
+}
+
+void tw_sched_reset(void) {
+    for (int i = 0; i < TW_SCHED_MAX_RULES; i++)
+        unlink_rule(i);
+    memset(s_rules, 0, sizeof(s_rules));
+    tw_kv_purge_domain(TW_SCHED_KV_DOMAIN);
+}
+
+bool tw_sched_init(void) {
+    for (int i = 0; i < TW_SCHED_SLOTS; i++)
+        s_slots[i] = -1;
+    tw_kv_enumerate(TW_SCHED_KV_DOMAIN, load_cb, NULL);
+    rearm_all();
+    mgos_event_add_handler(MGOS_EVENT_TIME_CHANGED, time_changed_cb, NULL);
+    mgos_event_add_handler(MGOS_TWINKLY_EV_REMOVED, twinkly_removed_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Schedule.List", "", list_handler, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Schedule.Set", "", set_handler, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Schedule.Remove", "{id: %d}", remove_handler, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Schedule.Clock", "", clock_handler, NULL);
+    return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * On-hub schedules.
+ *
+ * Rules switch devices on or off and/or set their brightness at a time of day or at an offset from sunrise or sunset
+ * (app.sched.lat, app.sched.lon), on selected days of the week. They are kept in the state store, one record each.
+ *
+ * Armed rules sit in a single hashed timer wheel driven by one timer, TW_SCHED_TICK_MS per slot, a rule due more
+ * than one turn ahead waits the remaining turns in its slot. Rules fire from the local clock, set by SNTP, so they do
+ * not need a HomeKit home hub or a network connection beyond the devices.
+ *
+ * The clock the wheel runs on can be shifted or held and stepped by Hub.Schedule.Clock, to test rules without
+ * waiting for them.
+ */
+
+#define TW_SCHED_TICK_MS    100
+#define TW_SCHED_MASK_BYTES ((MAX_TWINKLY_DEVICES + 7) / 8)
+
+/**
+ * Rule action: `devices` is a bitmap of device indexes, NULL for every device. `on` and `brightness` are -1 when
+ * the rule leaves them as they are.
+ */
+typedef void (*tw_sched_action_cb_t)(const uint8_t* devices, int on, int brightness, void* arg);
+
+bool tw_sched_init(void);
+
+void tw_sched_set_action(tw_sched_action_cb_t cb, void* arg);
+
+/**
+ * Forget every rule, for factory reset.
+ */
+void tw_sched_reset(void);
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_stats.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+/* Histogram bucket upper bounds, us */
+static const int64_t s_bounds[] = { 100,     250,     500,      1000,     2500,   5000,
+                                    10000,   25000,   50000,    100000,   250000, 500000,
+                                    1000000, 2500000, 5000000,  10000000, 30000000, INT64_MAX };
+#define TW_STAT_BUCKETS (sizeof(s_bounds) / sizeof(s_bounds[0]))
+
+typedef struct {
+    uint32_t count;
+    uint32_t errors;
+    int64_t max_us;
+    uint32_t hist[TW_STAT_BUCKETS];
+} tw_stat_t;
+
+static const char* s_names[TW_STAT_MAX] = { "hap_read",         "hap_write",      "device_req",
+                                            "wait_interactive", "wait_reconcile", "wait_background",
+                                            "restart_warm",     "restart_cold",   "wifi_reconnect" };
+static tw_stat_t s_stats[TW_STAT_MAX];
+static uint32_t s_counters[TW_CNT_MAX];
+static bool s_redundancy_warned;
+static int64_t s_window_start;
+
+/* Minimum number of commands before the redundancy ratio means anything */
+#define TW_REDUNDANCY_MIN_CMDS 20
+
+void tw_stats_record(enum tw_stat stat, int64_t latency_us, bool ok) {
+    tw_stat_t* st = &s_stats[stat];
+    size_t b = 0;
+    while (latency_us > s_bounds[b])
+        b++;
+    st->hist[b]++;
+    st->count++;
+    if (!ok)
+        st->errors++;
+    if (latency_us > st->max_us)
+        st->max_us = latency_us;
+}
+
+static double redundancy(void) {
+    uint32_t sent = s_counters[TW_CNT_CMD_SENT];
+    return sent ? (double) s_counters[TW_CNT_CMD_REDUNDANT] / sent : 0.0;
+}
+
+void tw_stats_count(enum tw_counter counter) {
+    s_counters[counter]++;
+    if (s_redundancy_warned || counter != TW_CNT_CMD_REDUNDANT)
+        return;
+    if (s_counters[TW_CNT_CMD_SENT] < TW_REDUNDANCY_MIN_CMDS)
+        return;
+    if (redundancy() * 100 > mgos_sys_config_get_app_redundancy_warn_pct()) {
+        LOG(LL_WARN,
+            ("Redundant device commands: %u of %u",
+             (unsigned) s_counters[TW_CNT_CMD_REDUNDANT],
+             (unsigned) s_counters[TW_CNT_CMD_SENT]));
+        s_redundancy_warned = true;
+    }
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static int64_t percentile(const tw_stat_t* st, int pct) {
+    uint32_t rank = (st->count * pct + 99) / 100, seen = 0;
+    if (st->count == 0)
+        return 0;
+    for (size_t b = 0; b < TW_STAT_BUCKETS; b++) {
+        seen += st->hist[b];
+        if (seen >= rank)
+            return b + 1 < TW_STAT_BUCKETS ? s_bounds[b] : st->max_us;
+    }
+    return st->max_us;
+}
+
+static int print_stats(struct json_out* out, va_list* ap) {
+    double window = (mgos_uptime_micros() - s_window_start) / 1e6;
+    int len = json_printf(out, "{window_s: %.1f", window);
+    for (int i = 0; i < TW_STAT_MAX; i++) {
+        const tw_stat_t* st = &s_stats[i];
+        len += json_printf(
+                out,
+                ", %s: {count: %u, per_s: %.2f, errors: %u, error_rate: %.4f, p50_us: %lld, p90_us: %lld, "
+                "p99_us: %lld, max_us: %lld}",
+                s_names[i],
+                (unsigned) st->count,
+                window > 0 ? st->count / window : 0.0,
+                (unsigned) st->errors,
+                st->count ? (double) st->errors / st->count : 0.0,
+                (long long) percentile(st, 50),
+                (long long) percentile(st, 90),
+                (long long) percentile(st, 99),
+                (long long) st->max_us);
+    }
+    len += json_printf(
+            out,
+            ", commands: {sent: %u, suppressed: %u, redundant: %u, stale_reports: %u, deferred: %u, replayed: %u, "
+            "redundancy: %.4f, over_threshold: %B}, reports: {echoes: %u, external: %u, coalesced: %u, announced: %u}}",
+            (unsigned) s_counters[TW_CNT_CMD_SENT],
+            (unsigned) s_counters[TW_CNT_CMD_SUPPRESSED],
+            (unsigned) s_counters[TW_CNT_CMD_REDUNDANT],
+            (unsigned) s_counters[TW_CNT_STALE_REPORT],
+            (unsigned) s_counters[TW_CNT_CMD_DEFERRED],
+            (unsigned) s_counters[TW_CNT_CMD_REPLAYED],
+            redundancy(),
+            s_redundancy_warned,
+            (unsigned) s_counters[TW_CNT_ECHO],
+            (unsigned) s_counters[TW_CNT_EXT_REPORT],
+            (unsigned) s_counters[TW_CNT_EXT_COALESCED],
+            (unsigned) s_counters[TW_CNT_EXT_ANNOUNCED]);
+    (void) ap;
+    return len;
+}
+
+static void stats_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    bool reset = false;
+    json_scanf(args.p, args.len, ri->args_fmt, &reset);
+    mg_rpc_send_responsef(ri, "%M", print_stats);
+    if (reset) {
+        memset(s_stats, 0, sizeof(s_stats));
+        memset(s_counters, 0, sizeof(s_counters));
+        s_redundancy_warned = false;
+        s_window_start = mgos_uptime_micros();
+    }
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_stats_init(void) {
+    s_window_start = mgos_uptime_micros();
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Stats", "{reset: %B}", stats_handler, NULL);
+    return true;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Throughput, latency and error counters of the hub hot paths.
+ * Reported by the Hub.Stats RPC, `{"reset": true}` starts a new measurement window.
+ */
+
+enum tw_stat {
+    TW_STAT_HAP_READ,         // characteristic read handlers
+    TW_STAT_HAP_WRITE,        // characteristic write handlers
+    TW_STAT_DEVICE_REQ,       // Twinkly HTTP requests, end to end
+    TW_STAT_WAIT_INTERACTIVE, // time in the command queue, one per tw_prio class
+    TW_STAT_WAIT_RECONCILE,
+    TW_STAT_WAIT_BACKGROUND,
+    TW_STAT_RESTART_WARM, // HAP restart until the first controller request
+    TW_STAT_RESTART_COLD,
+    TW_STAT_WIFI_RECONNECT, // STA disconnect until the IP address is back
+    TW_STAT_MAX,
+};
+
+/**
+ * Device command accounting, used to spot redundant traffic.
+ */
+enum tw_counter {
+    TW_CNT_CMD_SENT,       // commands sent to devices
+    TW_CNT_CMD_SUPPRESSED, // commands skipped, the device already reported that value
+    TW_CNT_CMD_REDUNDANT,  // commands sent although the device had, or was about to get, that value
+    TW_CNT_STALE_REPORT,   // device reports ignored while a hub command was not yet confirmed
+    TW_CNT_CMD_DEFERRED,   // commands held while the device was unreachable
+    TW_CNT_CMD_REPLAYED,   // coalesced commands sent when such a device came back
+    TW_CNT_ECHO,           // device reports confirming a hub command, not announced again
+    TW_CNT_EXT_REPORT,     // device reports of a change made elsewhere, e.g. the Twinkly app
+    TW_CNT_EXT_COALESCED,  // such reports superseded by a later one before they were announced
+    TW_CNT_EXT_ANNOUNCED,  // external changes stored and announced to controllers
+    TW_CNT_MAX,
+};
+
+bool tw_stats_init(void);
+
+/**
+ * Account one operation that took `latency_us`.
+ */
+void tw_stats_record(enum tw_stat stat, int64_t latency_us, bool ok);
+
+void tw_stats_count(enum tw_counter counter);
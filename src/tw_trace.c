@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_trace.h"
+
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#if TW_TRACE
+
+typedef struct {
+    int64_t ts; // uptime, us
+    const char* name;
+    uint32_t id;
+    int32_t arg;
+    int16_t tid;
+    char ph;
+} tw_trace_event_t;
+
+bool tw_trace_on = false;
+static tw_trace_event_t* s_ring = NULL;
+static int s_size = 0;
+static int s_head = 0; // next slot to write
+static uint32_t s_total = 0;
+
+void tw_trace_record(const char* name, char ph, int tid, uint32_t id, int32_t arg) {
+    tw_trace_event_t* e = &s_ring[s_head];
+    e->ts = mgos_uptime_micros();
+    e->name = name;
+    e->ph = ph;
+    e->tid = tid;
+    e->id = id;
+    e->arg = arg;
+    s_head = (s_head + 1) % s_size;
+    s_total++;
+}
+
+static bool trace_enable(bool enable) {
+    int size = mgos_sys_config_get_app_trace_size();
+    tw_trace_on = false;
+    free(s_ring);
+    s_ring = NULL;
+    s_head = s_size = 0;
+    s_total = 0;
+    if (!enable || size <= 0)
+        return !enable;
+    s_ring = calloc(size, sizeof(*s_ring));
+    if (s_ring == NULL) {
+        LOG(LL_ERROR, ("No memory for %d trace events", size));
+        return false;
+    }
+    s_size = size;
+    tw_trace_on = true;
+    return true;
+}
+
+static int print_events(struct json_out* out, va_list* ap) {
+    int count = s_total < (uint32_t) s_size ? (int) s_total : s_size;
+    int first = (s_head - count + s_size) % (s_size ? s_size : 1);
+    int len = json_printf(out, "[");
+    for (int k = 0; k < count; k++) {
+        const tw_trace_event_t* e = &s_ring[(first + k) % s_size];
+        char ph[2] = { e->ph, '\0' };
+        len += json_printf(
+                out,
+                "%s{name: %Q, cat: \"hub\", ph: %Q, ts: %lld, pid: 1, tid: %d",
+                k ? ", " : "",
+                e->name,
+                ph,
+                (long long) e->ts,
+                e->tid);
+        if (e->ph == 'b' || e->ph == 'e')
+            len += json_printf(out, ", id: %u", (unsigned) e->id);
+        if (e->ph == 'i')
+            len += json_printf(out, ", s: \"t\"");
+        len += json_printf(out, ", args: {v: %d}}", (int) e->arg);
+    }
+    len += json_printf(out, "]");
+    (void) ap;
+    return len;
+}
+
+static void trace_get_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(
+            ri,
+            "{traceEvents: %M, displayTimeUnit: \"ms\", otherData: {enabled: %B, size: %d, recorded: %u}}",
+            print_events,
+            tw_trace_on,
+            s_size,
+            (unsigned) s_total);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+static void trace_set_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    bool enable = false;
+    if (json_scanf(args.p, args.len, ri->args_fmt, &enable) != 1) {
+        mg_rpc_send_errorf(ri, 400, "enable is required");
+        return;
+    }
+    // Re-enabling also starts from an empty ring
+    if (!trace_enable(enable)) {
+        mg_rpc_send_errorf(ri, 500, "out of memory");
+        return;
+    }
+    mg_rpc_send_responsef(ri, "{enabled: %B, size: %d}", tw_trace_on, s_size);
+    (void) cb_arg;
+    (void) fi;
+}
+
+bool tw_trace_init(void) {
+    if (mgos_sys_config_get_app_trace_enable())
+        trace_enable(true);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Trace.Get", "", trace_get_handler, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Trace.Set", "{enable: %B}", trace_set_handler, NULL);
+    return true;
+}
+
+#else
+
+bool tw_trace_init(void) {
+    return true;
+}
+
+#endif
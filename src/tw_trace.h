@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Request path tracing.
+ *
+ * Trace points record into a ring of app.trace.size events with microsecond timestamps. The ring is only
+ * allocated while tracing is on, a disabled trace point is a single flag test. Hub.Trace.Get returns the ring in
+ * Chrome trace event format (load it in chrome://tracing or ui.perfetto.dev), Hub.Trace.Set turns tracing on and off.
+ * Build with TW_TRACE=0 to compile all trace points out.
+ *
+ * `tid` is the device index + 1, 0 for the hub itself. Async spans are matched by `id`.
+ */
+
+#ifndef TW_TRACE
+#define TW_TRACE 1
+#endif
+
+#if TW_TRACE
+
+extern bool tw_trace_on;
+
+void tw_trace_record(const char* name, char ph, int tid, uint32_t id, int32_t arg);
+
+#define TW_TRACE_EVENT(name, ph, tid, id, arg)                 \
+    do {                                                       \
+        if (tw_trace_on)                                       \
+            tw_trace_record((name), (ph), (tid), (id), (arg)); \
+    } while (0)
+
+#else
+
+#define TW_TRACE_EVENT(name, ph, tid, id, arg) \
+    do {                                       \
+    } while (0)
+
+#endif
+
+/* Synchronous span, must end in the same call */
+#define TW_TRACE_BEGIN(name, tid)    TW_TRACE_EVENT(name, 'B', tid, 0, 0)
+#define TW_TRACE_END(name, tid, arg) TW_TRACE_EVENT(name, 'E', tid, 0, arg)
+/* Span across callbacks */
+#define TW_TRACE_ASYNC_BEGIN(name, tid, id)    TW_TRACE_EVENT(name, 'b', tid, id, 0)
+#define TW_TRACE_ASYNC_END(name, tid, id, arg) TW_TRACE_EVENT(name, 'e', tid, id, arg)
+#define TW_TRACE_INSTANT(name, tid, arg)       TW_TRACE_EVENT(name, 'i', tid, 0, arg)
+
+bool tw_trace_init(void);
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tw_udplog.h"
+
+#include "mgos.h"
+#include "mgos_debug.h"
+#include "mgos_event.h"
+#include "mgos_mongoose.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+
+#define TW_UDPLOG_MAGIC       "TWL1"
+#define TW_UDPLOG_HEADER_SIZE 12
+
+static struct {
+    char* buf;
+    size_t len;
+    size_t size;
+    struct mg_connection* nc;
+    int64_t pending_since; // uptime of the oldest unsent byte, us
+    double tokens;         // bytes we may send now
+    int64_t tokens_at;
+    uint32_t seq;
+    uint32_t dropped; // bytes
+    uint32_t sent;    // datagrams
+    uint32_t sent_bytes;
+    bool sending;
+} s_log;
+
+static void udp_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    if (ev == MG_EV_CLOSE && nc == s_log.nc)
+        s_log.nc = NULL;
+    (void) ev_data;
+    (void) user_data;
+}
+
+/* Drop whole lines from the front until `need` more bytes fit */
+static void make_room(size_t need) {
+    size_t cut = 0;
+    while (s_log.len - cut + need > s_log.size && cut < s_log.len) {
+        const char* nl = memchr(s_log.buf + cut, '\n', s_log.len - cut);
+        cut = nl ? (size_t) (nl - s_log.buf) + 1 : s_log.len;
+    }
+    if (cut == 0)
+        return;
+    memmove(s_log.buf, s_log.buf + cut, s_log.len - cut);
+    s_log.len -= cut;
+    s_log.dropped += cut;
+}
+
+static void refill_tokens(int64_t now) {
+    double rate = mgos_sys_config_get_app_udp_log_rate();
+    double burst = 2.0 * mgos_sys_config_get_app_udp_log_mtu();
+    s_log.tokens += rate * (now - s_log.tokens_at) / 1e6;
+    if (s_log.tokens > burst)
+        s_log.tokens = burst;
+    s_log.tokens_at = now;
+}
+
+/* Payload length of the next datagram: whole lines that fit, or a cut line if a single one does not */
+static size_t next_payload(size_t max) {
+    if (s_log.len <= max)
+        return s_log.len;
+    size_t n = 0;
+    for (;;) {
+        const char* nl = memchr(s_log.buf + n, '\n', s_log.len - n);
+        if (nl == NULL || (size_t) (nl - s_log.buf) + 1 > max)
+            break;
+        n = (size_t) (nl - s_log.buf) + 1;
+    }
+    return n ? n : max;
+}
+
+static void send_next(bool force) {
+    int64_t now = mgos_uptime_micros();
+    size_t max = mgos_sys_config_get_app_udp_log_mtu() - TW_UDPLOG_HEADER_SIZE;
+    if (s_log.len == 0)
+        return;
+    if (!force && s_log.len < max)
+        return;
+    if (s_log.nc == NULL) {
+        s_log.nc = mg_connect(mgos_get_mgr(), mgos_sys_config_get_app_udp_log_addr(), udp_ev_handler, NULL);
+        if (s_log.nc == NULL)
+            return;
+    }
+    // One datagram per poll, mongoose sends the whole send buffer with one sendto()
+    if (s_log.nc->send_mbuf.len > 0)
+        return;
+    refill_tokens(now);
+    size_t n = next_payload(max);
+    if (mgos_sys_config_get_app_udp_log_rate() > 0 && s_log.tokens < n + TW_UDPLOG_HEADER_SIZE)
+        return; // over the cap, keep buffering
+    uint8_t hdr[TW_UDPLOG_HEADER_SIZE];
+    memcpy(hdr, TW_UDPLOG_MAGIC, 4);
+    for (int i = 0; i < 4; i++) {
+        hdr[4 + i] = (uint8_t) (s_log.seq >> (8 * i));
+        hdr[8 + i] = (uint8_t) (s_log.dropped >> (8 * i));
+    }
+    mg_send(s_log.nc, hdr, sizeof(hdr));
+    mg_send(s_log.nc, s_log.buf, n);
+    memmove(s_log.buf, s_log.buf + n, s_log.len - n);
+    s_log.len -= n;
+    s_log.tokens -= n + TW_UDPLOG_HEADER_SIZE;
+    s_log.seq++;
+    s_log.sent++;
+    s_log.sent_bytes += n + TW_UDPLOG_HEADER_SIZE;
+    s_log.pending_since = s_log.len ? now : 0;
+}
+
+static void flush(bool force) {
+    if (s_log.sending)
+        return;
+    s_log.sending = true;
+    send_next(force);
+    s_log.sending = false;
+}
+
+static void log_ev_cb(int ev, void* ev_data, void* userdata) {
+    const struct mgos_debug_hook_arg* arg = ev_data;
+    if (s_log.sending || arg->len == 0)
+        return; // logged by mongoose while we send, capturing it would change the buffer under us
+    size_t len = arg->len > s_log.size ? s_log.size : arg->len;
+    make_room(len);
+    memcpy(s_log.buf + s_log.len, arg->data + arg->len - len, len);
+    s_log.len += len;
+    if (s_log.pending_since == 0)
+        s_log.pending_since = mgos_uptime_micros();
+    flush(false);
+    (void) ev;
+    (void) userdata;
+}
+
+static void flush_timer_cb(void* arg) {
+    int64_t age_ms = (mgos_uptime_micros() - s_log.pending_since) / 1000;
+    if (s_log.len > 0 && age_ms >= mgos_sys_config_get_app_udp_log_flush_ms())
+        flush(true);
+    (void) arg;
+}
+
+static void udplog_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(
+            ri,
+            "{addr: %Q, seq: %u, sent: %u, sent_bytes: %u, dropped_bytes: %u, buffered: %u}",
+            mgos_sys_config_get_app_udp_log_addr(),
+            (unsigned) s_log.seq,
+            (unsigned) s_log.sent,
+            (unsigned) s_log.sent_bytes,
+            (unsigned) s_log.dropped,
+            (unsigned) s_log.len);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_udplog_init(void) {
+    const char* addr = mgos_sys_config_get_app_udp_log_addr();
+    if (addr == NULL || addr[0] == '\0')
+        return true;
+    if (mgos_sys_config_get_app_udp_log_mtu() <= TW_UDPLOG_HEADER_SIZE + 64) {
+        LOG(LL_ERROR, ("app.udp_log.mtu is too small"));
+        return false;
+    }
+    s_log.size = mgos_sys_config_get_app_udp_log_buf_size();
+    s_log.buf = malloc(s_log.size);
+    if (s_log.buf == NULL)
+        return false;
+    s_log.tokens_at = mgos_uptime_micros();
+    s_log.tokens = 2.0 * mgos_sys_config_get_app_udp_log_mtu();
+    mgos_event_add_handler(MGOS_EVENT_LOG, log_ev_cb, NULL);
+    mgos_set_timer(50, MGOS_TIMER_REPEAT, flush_timer_cb, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.UdpLog", "", udplog_handler, NULL);
+    LOG(LL_INFO, ("Batched UDP log to %s", addr));
+    return true;
+}
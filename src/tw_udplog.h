@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Batched UDP log sink.
+ *
+ * Log output is collected in a buffer of app.udp_log.buf_size bytes and sent to app.udp_log.addr in datagrams of up
+ * to app.udp_log.mtu bytes, once a datagram is full or app.udp_log.flush_ms after the oldest pending line. Sending
+ * is capped at app.udp_log.rate bytes per second; when the buffer overflows the oldest lines are dropped.
+ *
+ * Every datagram starts with a 12 byte header: "TWL1", sequence number and total dropped bytes, both uint32 little
+ * endian, followed by whole log lines. tools/udplog.py receives and checks the stream.
+ */
+
+bool tw_udplog_init(void);
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_web.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mgos.h"
+#include "mgos_http_server.h"
+#include "mgos_rpc.h"
+
+#define TW_WEB_MANIFEST  "web.json"
+#define TW_WEB_MAX_FILES 16
+#define TW_WEB_CHUNK     1024 // read from the file whenever less than this is waiting to be sent
+
+#define TW_WEB_CACHE_IMMUTABLE  "public, max-age=31536000, immutable"
+#define TW_WEB_CACHE_REVALIDATE "no-cache"
+
+typedef struct {
+    char* pattern; // URI with a trailing '$', the endpoint must match it exactly
+    char* file;
+    char* etag; // content hash
+    char* type;
+    bool gzip;
+    bool immutable; // hashed name, the content never changes
+    uint32_t size;
+    uint32_t sent;         // full responses
+    uint32_t not_modified; // 304 responses
+    uint32_t bytes;        // body bytes sent
+} tw_web_file_t;
+
+static tw_web_file_t s_files[TW_WEB_MAX_FILES];
+static int s_count;
+
+/* A response body being sent, owns the connection until it is closed */
+typedef struct {
+    FILE* fp;
+    tw_web_file_t* file;
+} tw_web_xfer_t;
+
+static void xfer_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    tw_web_xfer_t* x = user_data;
+    switch (ev) {
+        case MG_EV_POLL:
+        case MG_EV_SEND: {
+            char buf[TW_WEB_CHUNK];
+            while (x->fp != NULL && nc->send_mbuf.len < TW_WEB_CHUNK) {
+                size_t n = fread(buf, 1, sizeof(buf), x->fp);
+                if (n > 0) {
+                    mg_send(nc, buf, (int) n);
+                    x->file->bytes += n;
+                }
+                if (n < sizeof(buf)) {
+                    fclose(x->fp);
+                    x->fp = NULL;
+                    nc->flags |= MG_F_SEND_AND_CLOSE;
+                }
+            }
+        } break;
+        case MG_EV_CLOSE: {
+            if (x->fp != NULL)
+                fclose(x->fp);
+            free(x);
+        } break;
+    }
+    (void) ev_data;
+}
+
+static bool accepts_gzip(struct http_message* hm) {
+    // No header means any encoding will do
+    struct mg_str* ae = mg_get_http_header(hm, "Accept-Encoding");
+    return ae == NULL || mg_strstr(*ae, mg_mk_str("gzip")) != NULL;
+}
+
+static void file_ev_handler(struct mg_connection* nc, int ev, void* ev_data, void* user_data) {
+    tw_web_file_t* f = user_data;
+    struct http_message* hm = ev_data;
+    if (ev != MG_EV_HTTP_REQUEST)
+        return;
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"%s\"", f->etag);
+    const char* cache = f->immutable ? TW_WEB_CACHE_IMMUTABLE : TW_WEB_CACHE_REVALIDATE;
+    struct mg_str* inm = mg_get_http_header(hm, "If-None-Match");
+    if (inm != NULL && (mg_strstr(*inm, mg_mk_str(etag)) != NULL || mg_vcmp(inm, "*") == 0)) {
+        f->not_modified++;
+        mg_printf(
+                nc,
+                "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: %s\r\nContent-Length: 0\r\n\r\n",
+                etag,
+                cache);
+        return;
+    }
+    if (f->gzip && !accepts_gzip(hm)) {
+        mg_http_send_error(nc, 406, "gzip encoding required");
+        return;
+    }
+    FILE* fp = fopen(f->file, "rb");
+    tw_web_xfer_t* x = fp ? calloc(1, sizeof(*x)) : NULL;
+    if (x == NULL) {
+        if (fp != NULL)
+            fclose(fp);
+        mg_http_send_error(nc, fp ? 503 : 404, NULL);
+        return;
+    }
+    f->sent++;
+    mg_printf(
+            nc,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n%sETag: %s\r\nCache-Control: %s\r\n"
+            "Vary: Accept-Encoding\r\nConnection: close\r\n\r\n",
+            f->type,
+            (unsigned) f->size,
+            f->gzip ? "Content-Encoding: gzip\r\n" : "",
+            etag,
+            cache);
+    x->fp = fp;
+    x->file = f;
+    if (mg_vcmp(&hm->method, "HEAD") == 0) {
+        fclose(x->fp);
+        x->fp = NULL;
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+    nc->handler = xfer_ev_handler;
+    nc->user_data = x;
+    xfer_ev_handler(nc, MG_EV_SEND, NULL, x);
+}
+
+static int print_files(struct json_out* out, va_list* ap) {
+    uint32_t sent = 0, not_modified = 0, bytes = 0;
+    int len = json_printf(out, "{files: [");
+    for (int i = 0; i < s_count; i++) {
+        const tw_web_file_t* f = &s_files[i];
+        len += json_printf(
+                out,
+                "%s{uri: %.*Q, file: %Q, size: %u, gzip: %B, immutable: %B, sent: %u, not_modified: %u, bytes: %u}",
+                i ? ", " : "",
+                (int) strlen(f->pattern) - 1,
+                f->pattern,
+                f->file,
+                (unsigned) f->size,
+                f->gzip,
+                f->immutable,
+                (unsigned) f->sent,
+                (unsigned) f->not_modified,
+                (unsigned) f->bytes);
+        sent += f->sent;
+        not_modified += f->not_modified;
+        bytes += f->bytes;
+    }
+    len += json_printf(
+            out,
+            "], sent: %u, not_modified: %u, bytes: %u}",
+            (unsigned) sent,
+            (unsigned) not_modified,
+            (unsigned) bytes);
+    (void) ap;
+    return len;
+}
+
+static void web_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(ri, "%M", print_files);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+static bool add_file(const struct json_token* t) {
+    tw_web_file_t* f = &s_files[s_count];
+    char* uri = NULL;
+    json_scanf(
+            t->ptr,
+            t->len,
+            "{uri: %Q, file: %Q, etag: %Q, type: %Q, gzip: %B, immutable: %B}",
+            &uri,
+            &f->file,
+            &f->etag,
+            &f->type,
+            &f->gzip,
+            &f->immutable);
+    FILE* fp = f->file ? fopen(f->file, "rb") : NULL;
+    if (uri == NULL || fp == NULL || f->etag == NULL || f->type == NULL) {
+        LOG(LL_ERROR, ("%s: bad entry %.*s", TW_WEB_MANIFEST, t->len, t->ptr));
+        if (fp != NULL)
+            fclose(fp);
+        free(uri);
+        free(f->file);
+        free(f->etag);
+        free(f->type);
+        memset(f, 0, sizeof(*f));
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    f->size = (uint32_t) ftell(fp);
+    fclose(fp);
+    mg_asprintf(&f->pattern, 0, "%s$", uri);
+    free(uri);
+    mgos_register_http_endpoint(f->pattern, file_ev_handler, f);
+    s_count++;
+    return true;
+}
+
+bool tw_web_init(void) {
+    char* manifest = json_fread(TW_WEB_MANIFEST);
+    struct json_token t;
+    if (manifest == NULL)
+        return true; // plain assets
+    for (int i = 0; s_count < TW_WEB_MAX_FILES; i++) {
+        if (json_scanf_array_elem(manifest, strlen(manifest), ".files", i, &t) <= 0)
+            break;
+        add_file(&t);
+    }
+    free(manifest);
+    LOG(LL_INFO, ("Serving %d packed web assets", s_count));
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Web", "", web_handler, NULL);
+    return true;
+}
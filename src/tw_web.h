@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Packed web UI assets.
+ *
+ * tools/pack_web.py minifies and gzips the UI and gives the assets it references content-hashed names; web.json
+ * lists the result. Each listed URI is served from its file with Content-Encoding, a strong ETag and Cache-Control:
+ * hashed assets are cached for good, pages are revalidated and answered with 304 when unchanged. Without web.json
+ * (plain fs build) the http-server serves the files as they are.
+ */
+
+bool tw_web_init(void);
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "tw_wifi.h"
+
+#ifdef MGOS_HAVE_WIFI
+
+#include "mgos.h"
+#include "mgos_dns_sd.h"
+#include "mgos_event.h"
+#include "mgos_net.h"
+#include "mgos_rpc.h"
+#include "mgos_timers.h"
+#include "mgos_wifi.h"
+#include "tw_client.h"
+#include "tw_poll.h"
+#include "tw_stats.h"
+
+static struct {
+    bool cached; // an access point to go back to
+    char bssid[18];
+    int channel;
+    bool up;          // had an address
+    int64_t down_at;  // uptime us of the disconnect, 0 while up
+    int64_t assoc_at; // associated again
+    bool fast;        // direct connect running
+    mgos_timer_id fallback_timer;
+    uint32_t disconnects;
+    uint32_t fast_ok; // reconnects on the cached access point
+    uint32_t full;    // reconnects that needed the regular connect
+    int last_reason;
+    uint32_t last_ms, last_assoc_ms, max_ms;
+} s_wifi = { .fallback_timer = MGOS_INVALID_TIMER_ID };
+
+static void fallback_timer_cb(void* arg) {
+    s_wifi.fallback_timer = MGOS_INVALID_TIMER_ID;
+    if (!s_wifi.fast || s_wifi.down_at == 0)
+        return;
+    LOG(LL_WARN, ("WiFi: no address from %s, connecting the regular way", s_wifi.bssid));
+    s_wifi.fast = false;
+    mgos_wifi_setup_sta(mgos_sys_config_get_wifi_sta());
+    (void) arg;
+}
+
+/* Out of the event handler, the setup disconnects and raises events of its own */
+static void fast_connect_cb(void* arg) {
+    struct mgos_config_wifi_sta cfg = *mgos_sys_config_get_wifi_sta();
+    if (s_wifi.down_at == 0)
+        return;
+    cfg.bssid = s_wifi.bssid;
+    cfg.channel = s_wifi.channel;
+    LOG(LL_INFO, ("WiFi: reconnecting to %s on channel %d", s_wifi.bssid, s_wifi.channel));
+    s_wifi.fast = mgos_wifi_setup_sta(&cfg);
+    if (s_wifi.fast)
+        s_wifi.fallback_timer =
+                mgos_set_timer(mgos_sys_config_get_app_wifi_fast_timeout_ms(), 0, fallback_timer_cb, NULL);
+    (void) arg;
+}
+
+/* Devices not heard from since the disconnect, the rest is fresh enough */
+static void refresh_devices(int64_t since_ms) {
+    int n = 0;
+    for (int i = 0; i < tw_client_count(); i++) {
+        if (tw_poll_last_seen_ms(i) < since_ms) {
+            tw_poll_refresh(i);
+            n++;
+        }
+    }
+    LOG(LL_INFO, ("WiFi: refreshing %d devices", n));
+}
+
+static void wifi_ev_handler(int ev, void* ev_data, void* userdata) {
+    int64_t now = mgos_uptime_micros();
+    switch (ev) {
+        case MGOS_WIFI_EV_STA_CONNECTED: {
+            const struct mgos_wifi_sta_connected_arg* ca = ev_data;
+            snprintf(
+                    s_wifi.bssid,
+                    sizeof(s_wifi.bssid),
+                    "%02x:%02x:%02x:%02x:%02x:%02x",
+                    ca->bssid[0],
+                    ca->bssid[1],
+                    ca->bssid[2],
+                    ca->bssid[3],
+                    ca->bssid[4],
+                    ca->bssid[5]);
+            s_wifi.channel = ca->channel;
+            s_wifi.cached = true;
+            if (s_wifi.down_at != 0)
+                s_wifi.assoc_at = now;
+        } break;
+        case MGOS_WIFI_EV_STA_DISCONNECTED: {
+            const struct mgos_wifi_sta_disconnected_arg* da = ev_data;
+            if (!s_wifi.up)
+                break; // still connecting, or our own setup
+            s_wifi.up = false;
+            s_wifi.down_at = now;
+            s_wifi.assoc_at = 0;
+            s_wifi.disconnects++;
+            s_wifi.last_reason = da->reason;
+            if (s_wifi.cached && mgos_sys_config_get_app_wifi_fast_reconnect())
+                mgos_set_timer(0, 0, fast_connect_cb, NULL);
+        } break;
+    }
+    (void) userdata;
+}
+
+static void net_ev_handler(int ev, void* ev_data, void* userdata) {
+    int64_t now = mgos_uptime_micros();
+    if (ev != MGOS_NET_EV_IP_ACQUIRED)
+        return;
+    s_wifi.up = true;
+    if (s_wifi.down_at == 0)
+        return; // first connect
+    int64_t took = now - s_wifi.down_at;
+    s_wifi.last_ms = (uint32_t) (took / 1000);
+    s_wifi.last_assoc_ms = s_wifi.assoc_at ? (uint32_t) ((s_wifi.assoc_at - s_wifi.down_at) / 1000) : 0;
+    if (s_wifi.last_ms > s_wifi.max_ms)
+        s_wifi.max_ms = s_wifi.last_ms;
+    if (s_wifi.fast)
+        s_wifi.fast_ok++;
+    else
+        s_wifi.full++;
+    tw_stats_record(TW_STAT_WIFI_RECONNECT, took, s_wifi.fast);
+    LOG(LL_INFO,
+        ("WiFi: back in %u ms (associated after %u ms, %s)",
+         (unsigned) s_wifi.last_ms,
+         (unsigned) s_wifi.last_assoc_ms,
+         s_wifi.fast ? "cached access point" : "regular connect"));
+    if (s_wifi.fallback_timer != MGOS_INVALID_TIMER_ID) {
+        mgos_clear_timer(s_wifi.fallback_timer);
+        s_wifi.fallback_timer = MGOS_INVALID_TIMER_ID;
+    }
+    s_wifi.fast = false;
+    // Controllers may have dropped the service while the hub was away
+    mgos_dns_sd_advertise();
+    refresh_devices(s_wifi.down_at / 1000);
+    s_wifi.down_at = 0;
+    (void) ev_data;
+    (void) userdata;
+}
+
+static void wifi_handler(
+        struct mg_rpc_request_info* ri,
+        void* cb_arg,
+        struct mg_rpc_frame_info* fi,
+        struct mg_str args) {
+    mg_rpc_send_responsef(
+            ri,
+            "{fw: %Q, up: %B, bssid: %Q, channel: %d, disconnects: %u, fast: %u, full: %u, "
+            "last: {reason: %d, ms: %u, assoc_ms: %u}, max_ms: %u}",
+            mgos_sys_ro_vars_get_fw_version(),
+            s_wifi.up,
+            s_wifi.cached ? s_wifi.bssid : "",
+            s_wifi.channel,
+            (unsigned) s_wifi.disconnects,
+            (unsigned) s_wifi.fast_ok,
+            (unsigned) s_wifi.full,
+            s_wifi.last_reason,
+            (unsigned) s_wifi.last_ms,
+            (unsigned) s_wifi.last_assoc_ms,
+            (unsigned) s_wifi.max_ms);
+    (void) cb_arg;
+    (void) fi;
+    (void) args;
+}
+
+bool tw_wifi_init(void) {
+    mgos_event_add_group_handler(MGOS_EVENT_GRP_WIFI, wifi_ev_handler, NULL);
+    mgos_event_add_group_handler(MGOS_EVENT_GRP_NET, net_ev_handler, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "Hub.Wifi", "", wifi_handler, NULL);
+    return true;
+}
+
+#else
+
+bool tw_wifi_init(void) {
+    return true;
+}
+
+#endif /* MGOS_HAVE_WIFI */
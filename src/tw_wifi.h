@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2020 d4rkmen
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Wi-Fi STA recovery.
+ *
+ * The BSSID and channel of the access point are remembered on every connect. After a disconnect the hub goes
+ * straight back to that access point on that channel, instead of a scan of all channels, and falls back to the
+ * regular connect if it does not get an address within app.wifi.fast_timeout_ms. Once the address is back the HAP
+ * service is announced over mDNS right away and devices not heard from since the disconnect are polled.
+ *
+ * Reconnect times go to the wifi_reconnect stat of Hub.Stats, Hub.Wifi has the details of the last one.
+ */
+
+bool tw_wifi_init(void);
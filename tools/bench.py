@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Run the hub benchmarks (Hub.Bench) and compare them with a stored baseline.
+
+Needs firmware built with `--build-var BENCH=1` and at least one device added. Exits with 1 if a mean got slower
+than the baseline by more than the tolerance, so it can gate a hardware-in-the-loop CI job. Without a baseline the
+results are only printed; the baseline has to be recorded on the reference board with --update and committed (see
+"Benchmarks" in README.md). Once it is, --require-baseline makes a missing baseline, or a case missing from it, fail.
+
+    tools/bench.py [--port /dev/ttyUSB0] [--iterations 200] [--tolerance 15] [--require-baseline] [--update]
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bench_baseline.json")
+
+
+def run_bench(args):
+    cmd = ["mos"]
+    if args.port:
+        cmd += ["--port", args.port]
+    cmd += ["call", "--timeout", "120s", "Hub.Bench", json.dumps({"iterations": args.iterations})]
+    out = subprocess.run(cmd, check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    return json.loads(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--port", help="mos port, e.g. /dev/ttyUSB0 or ws://hub/rpc")
+    ap.add_argument("--iterations", type=int, default=200)
+    ap.add_argument("--tolerance", type=float, default=15.0, help="allowed slowdown of the mean, %%")
+    ap.add_argument("--baseline", default=BASELINE)
+    ap.add_argument("--update", action="store_true", help="store this run as the new baseline")
+    ap.add_argument("--require-baseline", action="store_true", help="fail when the baseline or a case in it is missing")
+    ap.add_argument("--input", help="read results from a file instead of calling the hub")
+    args = ap.parse_args()
+
+    if args.input:
+        with open(args.input) as f:
+            res = json.load(f)
+    else:
+        res = run_bench(args)
+    results = {k: v for k, v in res["results"].items() if not v.get("skipped")}
+
+    if args.update:
+        with open(args.baseline, "w") as f:
+            json.dump({k: v["mean_us"] for k, v in sorted(results.items())}, f, indent=2)
+            f.write("\n")
+        print("baseline stored: %s" % args.baseline)
+        return 0
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    except FileNotFoundError:
+        sys.stderr.write("no baseline at %s, record one on the reference board with --update\n" % args.baseline)
+        if args.require_baseline:
+            return 1
+        baseline = {}
+
+    failed = False
+    print("%-24s %10s %10s %8s" % ("case", "base_us", "mean_us", "change"))
+    for name in sorted(set(baseline) | set(results)):
+        base = baseline.get(name)
+        cur = results.get(name, {}).get("mean_us")
+        if base is None or cur is None:
+            print("%-24s %10s %10s %8s" % (name, base or "-", cur or "-", "missing"))
+            failed = failed or cur is None or args.require_baseline
+            continue
+        change = (cur - base) / base * 100 if base else 0.0
+        bad = change > args.tolerance
+        failed = failed or bad
+        print("%-24s %10.1f %10.1f %+7.1f%%%s" % (name, base, cur, change, "  REGRESSION" if bad else ""))
+    print("free heap %d, min free heap %d" % (res["free_heap"], res["min_free_heap"]))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
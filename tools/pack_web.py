@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Pack the web UI: minify and gzip it, give referenced assets content-hashed names.
+
+Reads fs/, writes fs_dist/ with web.json, the list of packed files tw_web.c serves with Content-Encoding, ETag and
+Cache-Control. Files the UI does not reference (device list, data) are copied as they are. Build with
+
+    tools/pack_web.py && mos build --build-var WEB_FS=fs_dist
+
+--measure fetches the UI from a running hub twice, cold and with the ETags of the first load, and reports the bytes
+transferred and the time until the page was complete (its CSS and JS are inline, so that is when it can first paint):
+
+    tools/pack_web.py --measure http://192.168.1.10/
+"""
+
+import argparse
+import gzip
+import hashlib
+import json
+import os
+import re
+import shutil
+import sys
+import time
+import urllib.error
+import urllib.request
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+    ".svg": "image/svg+xml",
+}
+PAGES = (".html",)
+COMPRESS = (".html", ".css", ".js", ".ico", ".svg")
+FIXED_NAMES = ("favicon.ico",)  # requested by name, never hashed
+HASH_LEN = 8
+ETAG_LEN = 16
+
+
+def minify_html(text):
+    """Whitespace and comments only, line breaks stay so that inline JS keeps its meaning."""
+    text = re.sub(r"<!--(?!\[).*?-->", "", text, flags=re.S)
+    text = re.sub(r"(<style[^>]*>)(.*?)(</style>)",
+                  lambda m: m.group(1) + re.sub(r"/\*.*?\*/", "", m.group(2), flags=re.S) + m.group(3),
+                  text, flags=re.S | re.I)
+    lines = []
+    for line in text.splitlines():
+        line = line.strip()
+        if not line or line.startswith("//"):
+            continue
+        lines.append(line)
+    return "\n".join(lines) + "\n"
+
+
+def content_hash(data, n):
+    return hashlib.sha256(data).hexdigest()[:n]
+
+
+def pack(src, out):
+    names = sorted(n for n in os.listdir(src) if os.path.isfile(os.path.join(src, n)))
+    pages = {n: open(os.path.join(src, n), encoding="utf-8").read() for n in names if n.endswith(PAGES)}
+
+    # Assets referenced from a page get their hash in the name and are cached for good
+    renamed = {}
+    for n in names:
+        stem, ext = os.path.splitext(n)
+        if ext not in TYPES or n in pages or n in FIXED_NAMES:
+            continue
+        ref = re.compile(r"(?<=[\"'(/=\s])" + re.escape(n) + r"(?=[\"')?#\s])")
+        if not any(ref.search(p) for p in pages.values()):
+            continue
+        data = open(os.path.join(src, n), "rb").read()
+        renamed[n] = "%s.%s%s" % (stem, content_hash(data, HASH_LEN), ext)
+        for p in pages:
+            pages[p] = ref.sub(renamed[n], pages[p])
+
+    if os.path.isdir(out):
+        shutil.rmtree(out)
+    os.makedirs(out)
+    files, report = [], []
+    for n in names:
+        ext = os.path.splitext(n)[1]
+        raw = open(os.path.join(src, n), "rb").read()
+        if n not in pages and n not in renamed and n not in FIXED_NAMES:
+            shutil.copyfile(os.path.join(src, n), os.path.join(out, n))
+            report.append((n, n, len(raw), len(raw)))
+            continue
+        data = minify_html(pages[n]).encode("utf-8") if n in pages else raw
+        name = renamed.get(n, n)
+        packed = gzip.compress(data, 9, mtime=0) if ext in COMPRESS else data
+        gz = len(packed) < len(data)
+        if not gz:
+            packed = data
+        file = name + ".gz" if gz else name
+        with open(os.path.join(out, file), "wb") as f:
+            f.write(packed)
+        entry = {
+            "file": file,
+            "etag": content_hash(packed, ETAG_LEN),
+            "type": TYPES[ext],
+            "gzip": gz,
+            "immutable": n in renamed,
+        }
+        files.append(dict(uri="/" + name, **entry))
+        if n == "index.html":
+            files.append(dict(uri="/", **entry))
+        report.append((n, file, len(raw), len(packed)))
+
+    with open(os.path.join(out, "web.json"), "w") as f:
+        json.dump({"files": files}, f, separators=(",", ":"))
+    print("%-24s %-28s %8s %8s" % ("source", "packed", "bytes", "packed"))
+    for r in report:
+        print("%-24s %-28s %8d %8d" % r)
+    web = [r for r in report if r[1] != r[0] or r[0] in pages]
+    print("web assets: %d -> %d bytes" % (sum(r[2] for r in web), sum(r[3] for r in web)))
+
+
+def fetch(url, etag=None):
+    req = urllib.request.Request(url, headers={"Accept-Encoding": "gzip"})
+    if etag:
+        req.add_header("If-None-Match", etag)
+    start = time.monotonic()
+    try:
+        with urllib.request.urlopen(req, timeout=10) as resp:
+            body = resp.read()
+            return resp.status, resp.headers.get("ETag"), body, resp.headers, time.monotonic() - start
+    except urllib.error.HTTPError as e:
+        if e.code != 304:
+            raise
+        return 304, etag, b"", e.headers, time.monotonic() - start
+
+
+def load(base, etags):
+    """Page and the assets it references, as a browser with an empty or a warm cache would ask for them."""
+    status, etag, body, headers, took = fetch(base, etags.get("/"))
+    etags["/"] = etag
+    total, page_ms = len(body), took * 1000
+    if status == 304:
+        html = etags.get("html", "")
+    else:
+        html = gzip.decompress(body).decode("utf-8") if headers.get("Content-Encoding") == "gzip" else body.decode()
+        etags["html"] = html
+    statuses = [status]
+    for ref in sorted(set(re.findall(r"src=\"([^\"/:]+\.(?:png|ico|svg))\"", html)) | {"favicon.ico"}):
+        # Immutable assets are not asked for at all with a warm cache
+        if ref in etags and re.search(r"\.[0-9a-f]{%d}\." % HASH_LEN, ref):
+            continue
+        status, etag, body, _, took = fetch(base.rstrip("/") + "/" + ref, etags.get(ref))
+        etags[ref] = etag
+        total += len(body)
+        statuses.append(status)
+    return total, page_ms, statuses
+
+
+def measure(url):
+    etags = {}
+    for run in ("cold", "warm"):
+        total, page_ms, statuses = load(url, etags)
+        print("%s: %d bytes, %d requests (%s), page complete in %.0f ms" %
+              (run, total, len(statuses), " ".join(str(s) for s in statuses), page_ms))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--src", default=os.path.join(ROOT, "fs"))
+    ap.add_argument("--out", default=os.path.join(ROOT, "fs_dist"))
+    ap.add_argument("--measure", metavar="URL", help="measure a running hub instead of packing")
+    args = ap.parse_args()
+    if args.measure:
+        measure(args.measure)
+    else:
+        pack(args.src, args.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
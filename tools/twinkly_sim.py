@@ -0,0 +1,407 @@
+#!/usr/bin/env python3
+"""Emulate a fleet of Twinkly devices and drive the hub with commands against it.
+
+`serve` answers the Twinkly HTTP API the hub uses (login, verify, gestalt, led/mode, led/out/brightness) on N
+consecutive addresses, with a configurable reply latency and loss. A lost request is held open and closed without a
+reply, the way the hub sees a device that went away. The addresses have to exist on the host, `setup` prints the
+commands that add them:
+
+    tools/twinkly_sim.py setup -n 32 --base-ip 192.168.1.200 --dev eth0 | sudo sh
+    sudo tools/twinkly_sim.py serve -n 32 --base-ip 192.168.1.200 --latency 40 --jitter 60 --loss 0.02
+
+`load` adds the emulated devices to the hub and sends it Hub.Command writes and Hub.State reads from a number of
+concurrent clients. It reports commands/s, end to end latency percentiles and the error rate as seen by the clients,
+and the device request and queue wait figures of Hub.Stats for the same window:
+
+    tools/twinkly_sim.py load --hub http://192.168.1.10 -n 32 --base-ip 192.168.1.200 --duration 60 --clients 8
+
+`serve --control` also answers GET /state with the state of every emulated device and POST /set
+{"ip": ..., "on": ..., "brightness": ...} with a change made "in the Twinkly app", for tools/write_storm.py.
+"""
+
+import argparse
+import base64
+import hashlib
+import ipaddress
+import json
+import os
+import random
+import socketserver
+import sys
+import threading
+import time
+import urllib.error
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+API = "/xled/v1/"
+CODE_OK = 1000
+CODE_ERROR = 1101
+
+
+class Device:
+    def __init__(self, ip, n):
+        self.ip = ip
+        self.mac = "98:f4:ab:%02x:%02x:%02x" % ((n >> 16) & 0xFF, (n >> 8) & 0xFF, n & 0xFF)
+        self.name = "Twinkly_%06X" % (0xA00000 + n)
+        self.mode = "movie"
+        self.brightness = 100
+        self.tokens = {}  # token -> (expires, verified)
+        self.requests = {}
+        self.writes = 0
+        self.noop_writes = 0  # mode or brightness writes that did not change it
+        self.lost = 0
+        self.lock = threading.Lock()
+
+    def state(self):
+        with self.lock:
+            return {
+                "ip": self.ip,
+                "on": self.mode != "off",
+                "mode": self.mode,
+                "brightness": self.brightness,
+                "requests": dict(self.requests),
+                "writes": self.writes,
+                "noop_writes": self.noop_writes,
+                "lost": self.lost,
+            }
+
+    def gestalt(self):
+        return {
+            "product_name": "Twinkly",
+            "product_version": "2",
+            "hardware_version": "100",
+            "device_name": self.name,
+            "mac": self.mac,
+            "uuid": hashlib.md5(self.mac.encode()).hexdigest(),
+            "product_code": "TWS250STP-B",
+            "led_profile": "RGB",
+            "number_of_led": 250,
+            "fw_family": "D",
+            "uptime": str(int(time.monotonic() * 1000)),
+            "rssi": random.randint(-70, -40),
+            "code": CODE_OK,
+        }
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        if self.server.opts.verbose:
+            sys.stderr.write("%s %s\n" % (self.server.device.ip, fmt % args))
+
+    def reply(self, obj, status=200):
+        body = json.dumps(obj).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.wfile.write(body)
+        self.close_connection = True
+
+    def body(self):
+        n = int(self.headers.get("Content-Length") or 0)
+        try:
+            return json.loads(self.rfile.read(n) or b"{}")
+        except ValueError:
+            return None
+
+    def authorized(self, dev):
+        tok = self.headers.get("X-Auth-Token", "")
+        expires, verified = dev.tokens.get(tok, (0, False))
+        return verified and expires > time.monotonic()
+
+    def handle_api(self, method):
+        opts, dev = self.server.opts, self.server.device
+        path = self.path.split("?")[0]
+        if not path.startswith(API):
+            return self.reply({"code": CODE_ERROR}, 404)
+        path = path[len(API):]
+        with dev.lock:
+            dev.requests[path] = dev.requests.get(path, 0) + 1
+        time.sleep(max(0.0, random.uniform(opts.latency, opts.latency + opts.jitter)) / 1000)
+        if random.random() < opts.loss:
+            with dev.lock:
+                dev.lost += 1
+            time.sleep(opts.hold)
+            self.close_connection = True
+            return
+        req = self.body() if method == "POST" else {}
+        if req is None:
+            return self.reply({"code": CODE_ERROR}, 400)
+        with dev.lock:
+            if path == "gestalt" and method == "GET":
+                return self.reply(dev.gestalt())
+            if path == "login" and method == "POST":
+                challenge = base64.b64decode(req.get("challenge", ""))
+                tok = base64.b64encode(os.urandom(8)).decode()
+                dev.tokens[tok] = (time.monotonic() + opts.token_ttl, False)
+                return self.reply({
+                    "authentication_token": tok,
+                    "authentication_token_expires_in": opts.token_ttl,
+                    "challenge-response": hashlib.sha1(challenge + dev.mac.encode()).hexdigest(),
+                    "code": CODE_OK,
+                })
+            if path == "verify" and method == "POST":
+                tok = self.headers.get("X-Auth-Token", "")
+                if tok not in dev.tokens:
+                    return self.reply({"code": CODE_ERROR}, 401)
+                dev.tokens[tok] = (dev.tokens[tok][0], True)
+                return self.reply({"code": CODE_OK})
+            if not self.authorized(dev):
+                return self.reply({"code": CODE_ERROR}, 401)
+            if path == "led/mode":
+                if method == "POST":
+                    if req.get("mode") not in ("off", "color", "demo", "effect", "movie", "playlist", "rt"):
+                        return self.reply({"code": CODE_ERROR}, 400)
+                    dev.writes += 1
+                    dev.noop_writes += (req["mode"] == "off") == (dev.mode == "off")
+                    dev.mode = req["mode"]
+                    return self.reply({"code": CODE_OK})
+                return self.reply({"mode": dev.mode, "code": CODE_OK})
+            if path == "led/out/brightness":
+                if method == "POST":
+                    value = max(0, min(100, int(req.get("value", dev.brightness))))
+                    dev.writes += 1
+                    dev.noop_writes += value == dev.brightness
+                    dev.brightness = value
+                    return self.reply({"code": CODE_OK})
+                return self.reply({"value": dev.brightness, "mode": "enabled", "code": CODE_OK})
+        return self.reply({"code": CODE_ERROR}, 404)
+
+    def do_GET(self):
+        self.handle_api("GET")
+
+    def do_POST(self):
+        self.handle_api("POST")
+
+
+class ThreadingServer(socketserver.ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+class ControlHandler(BaseHTTPRequestHandler):
+    def log_message(self, fmt, *args):
+        pass
+
+    def reply(self, obj, status=200):
+        body = json.dumps(obj).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        if self.path != "/state":
+            return self.reply({"error": "not found"}, 404)
+        self.reply([d.state() for d in self.server.devices])
+
+    def do_POST(self):
+        if self.path != "/set":
+            return self.reply({"error": "not found"}, 404)
+        req = json.loads(self.rfile.read(int(self.headers.get("Content-Length") or 0)) or b"{}")
+        dev = next((d for d in self.server.devices if d.ip == req.get("ip")), None)
+        if dev is None:
+            return self.reply({"error": "no such device"}, 404)
+        with dev.lock:
+            if "on" in req:
+                dev.mode = "movie" if req["on"] else "off"
+            if "brightness" in req:
+                dev.brightness = max(0, min(100, int(req["brightness"])))
+        self.reply(dev.state())
+
+
+def addresses(base, n):
+    first = ipaddress.ip_address(base)
+    return [str(first + i) for i in range(n)]
+
+
+def serve(args):
+    devices = [Device(ip, i) for i, ip in enumerate(addresses(args.base_ip, args.n))]
+    servers = []
+    for dev in devices:
+        srv = ThreadingServer((dev.ip, args.port), Handler)
+        srv.device, srv.opts = dev, args
+        servers.append(srv)
+    if args.control:
+        host, port = args.control.rsplit(":", 1)
+        ctl = ThreadingServer((host, int(port)), ControlHandler)
+        ctl.devices = devices
+        servers.append(ctl)
+    for srv in servers:
+        threading.Thread(target=srv.serve_forever, daemon=True).start()
+    print("%d devices on %s..%s:%d, latency %g+%g ms, loss %g" %
+          (len(devices), devices[0].ip, devices[-1].ip, args.port, args.latency, args.jitter, args.loss))
+    try:
+        while True:
+            time.sleep(args.report or 3600)
+            if args.report:
+                total = sum(sum(d.requests.values()) for d in devices)
+                print("requests %d, lost %d" % (total, sum(d.lost for d in devices)))
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+def setup(args):
+    for ip in addresses(args.base_ip, args.n):
+        print("ip addr add %s/32 dev %s" % (ip, args.dev))
+    return 0
+
+
+def rpc(hub, method, params=None, timeout=30):
+    """Hub RPC over HTTP, returns the result or raises with the error"""
+    data = json.dumps(params).encode() if params is not None else None
+    req = urllib.request.Request(hub.rstrip("/") + "/rpc/" + method, data=data,
+                                 headers={"Content-Type": "application/json"})
+    with urllib.request.urlopen(req, timeout=timeout) as resp:
+        return json.loads(resp.read() or b"null")
+
+
+def hub_devices(hub):
+    return [next(iter(item)) for item in rpc(hub, "Twinkly.List") or []]
+
+
+def add_devices(hub, ips):
+    known = set(hub_devices(hub))
+    for ip in ips:
+        if ip in known:
+            continue
+        try:
+            rpc(hub, "Twinkly.Add", {"ip": ip}, timeout=60)
+            print("added %s" % ip)
+        except (urllib.error.URLError, OSError) as e:
+            print("adding %s failed: %s" % (ip, e))
+
+
+def pct(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def load(args):
+    ips = addresses(args.base_ip, args.n)
+    if args.add:
+        add_devices(args.hub, ips)
+    listed = hub_devices(args.hub)
+    targets = [ip for ip in ips if ip in listed]
+    if not targets:
+        sys.stderr.write("none of the emulated devices is on the hub, run with --add\n")
+        return 2
+    rpc(args.hub, "Hub.Stats", {"reset": True})
+    lat = {"write": [], "read": []}
+    errors = {"write": 0, "read": 0}
+    lock = threading.Lock()
+    end = time.monotonic() + args.duration
+    interval = args.clients / args.rate if args.rate else 0
+
+    def client(seed):
+        rnd = random.Random(seed)
+        next_at = time.monotonic()
+        while time.monotonic() < end:
+            if rnd.random() < args.reads:
+                kind, method, params = "read", "Hub.State", None
+            else:
+                params = {"ip": rnd.choice(targets)}
+                if rnd.random() < 0.5:
+                    params["on"] = rnd.random() < 0.5
+                else:
+                    params["brightness"] = rnd.randint(1, 100)
+                kind, method = "write", "Hub.Command"
+            start = time.monotonic()
+            try:
+                rpc(args.hub, method, params, timeout=args.timeout)
+                ok = True
+            except (urllib.error.URLError, OSError, ValueError):
+                ok = False
+            took = (time.monotonic() - start) * 1000
+            with lock:
+                lat[kind].append(took)
+                errors[kind] += 0 if ok else 1
+            if interval:
+                next_at += interval
+                time.sleep(max(0.0, next_at - time.monotonic()))
+
+    started = time.monotonic()
+    with ThreadPoolExecutor(args.clients) as pool:
+        for i in range(args.clients):
+            pool.submit(client, args.seed + i)
+    window = time.monotonic() - started
+    stats = rpc(args.hub, "Hub.Stats")
+
+    print("%d devices, %d clients, %.1f s" % (len(targets), args.clients, window))
+    print("%-20s %8s %8s %8s %8s %8s %8s %8s" % ("", "count", "per_s", "err%", "p50_ms", "p90_ms", "p99_ms", "max_ms"))
+    for kind in ("write", "read"):
+        v = lat[kind]
+        print("%-20s %8d %8.1f %8.2f %8.1f %8.1f %8.1f %8.1f" %
+              (kind, len(v), len(v) / window, 100.0 * errors[kind] / len(v) if v else 0.0,
+               pct(v, 50), pct(v, 90), pct(v, 99), max(v) if v else 0.0))
+    for name in ("device_req", "wait_interactive", "wait_background", "hap_write", "hap_read"):
+        st = stats.get(name)
+        if not st or not st["count"]:
+            continue
+        print("%-20s %8d %8.1f %8.2f %8.1f %8.1f %8.1f %8.1f" %
+              ("hub " + name, st["count"], st["per_s"], st["error_rate"] * 100, st["p50_us"] / 1000,
+               st["p90_us"] / 1000, st["p99_us"] / 1000, st["max_us"] / 1000))
+    print("hub commands: %s" % json.dumps(stats.get("commands", {})))
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"window_s": window, "client": {k: {"count": len(v), "errors": errors[k],
+                                                           "p50_ms": pct(v, 50), "p90_ms": pct(v, 90),
+                                                           "p99_ms": pct(v, 99)} for k, v in lat.items()},
+                       "hub": stats}, f, indent=2)
+    return 1 if args.max_error is not None and sum(errors.values()) > args.max_error / 100 * \
+        max(1, sum(len(v) for v in lat.values())) else 0
+
+
+def fleet_args(p):
+    p.add_argument("-n", type=int, default=32, help="number of devices")
+    p.add_argument("--base-ip", default="127.0.10.1", help="address of the first device, the others follow it")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("serve", help="emulate the devices")
+    fleet_args(p)
+    p.add_argument("--port", type=int, default=80)
+    p.add_argument("--latency", type=float, default=20.0, help="reply latency, ms")
+    p.add_argument("--jitter", type=float, default=30.0, help="random extra latency up to this, ms")
+    p.add_argument("--loss", type=float, default=0.0, help="fraction of requests that get no reply")
+    p.add_argument("--hold", type=float, default=10.0, help="seconds a lost request is held open")
+    p.add_argument("--token-ttl", type=int, default=14400, help="authentication token lifetime, s")
+    p.add_argument("--control", metavar="HOST:PORT", help="serve /state and /set here")
+    p.add_argument("--report", type=float, default=0, help="print request counts every this many seconds")
+    p.add_argument("-v", "--verbose", action="store_true")
+
+    p = sub.add_parser("setup", help="print the commands that add the device addresses")
+    fleet_args(p)
+    p.add_argument("--dev", default="lo")
+
+    p = sub.add_parser("load", help="drive the hub with commands to the emulated devices")
+    fleet_args(p)
+    p.add_argument("--hub", required=True, help="hub URL, e.g. http://192.168.1.10")
+    p.add_argument("--add", action="store_true", help="add the emulated devices the hub does not have yet")
+    p.add_argument("--duration", type=float, default=30.0, help="seconds")
+    p.add_argument("--clients", type=int, default=4, help="concurrent clients")
+    p.add_argument("--rate", type=float, default=0, help="total requests/s, 0 sends back to back")
+    p.add_argument("--reads", type=float, default=0.2, help="fraction of requests that are Hub.State reads")
+    p.add_argument("--timeout", type=float, default=15.0)
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--max-error", type=float, help="exit with 1 above this error rate, %%")
+    p.add_argument("--json", help="also write the results here")
+
+    args = ap.parse_args()
+    return {"serve": serve, "setup": setup, "load": load}[args.cmd](args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Receiver for the hub's batched UDP log (app.udp_log.addr).
+
+Prints log lines in order and reports lost, duplicate and reordered datagrams and bytes the hub dropped on its side.
+
+    tools/udplog.py [--port 1993] [--window 8]
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+MAGIC = b"TWL1"
+HEADER = struct.Struct("<4sII")
+
+
+def note(msg):
+    sys.stderr.write("### %s\n" % msg)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--port", type=int, default=1993)
+    ap.add_argument("--window", type=int, default=8, help="datagrams held back to put reordered ones in place")
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+
+    expected = None  # next sequence number to print
+    highest = -1
+    held = {}  # seq -> (dropped, payload)
+    dropped_seen = 0
+    stats = {"datagrams": 0, "lost": 0, "dups": 0, "reordered": 0, "bad": 0}
+
+    def emit(seq, dropped, payload):
+        nonlocal dropped_seen
+        if dropped != dropped_seen:
+            note("hub dropped %d bytes" % (dropped - dropped_seen))
+            dropped_seen = dropped
+        sys.stdout.write(payload.decode("utf-8", "replace"))
+        sys.stdout.flush()
+
+    try:
+        while True:
+            data, peer = sock.recvfrom(65535)
+            if len(data) < HEADER.size or data[:4] != MAGIC:
+                stats["bad"] += 1
+                continue
+            _, seq, dropped = HEADER.unpack_from(data)
+            stats["datagrams"] += 1
+            if expected is None or seq == 0 and expected > args.window:
+                if expected is not None:
+                    note("sequence restarted, hub rebooted?")
+                expected = seq
+                highest = seq - 1
+                dropped_seen = dropped
+            if seq < expected or seq in held:
+                stats["dups"] += 1
+                continue
+            if seq < highest:
+                stats["reordered"] += 1
+            highest = max(highest, seq)
+            held[seq] = (dropped, data[HEADER.size:])
+            while held:
+                if expected in held:
+                    emit(expected, *held.pop(expected))
+                    expected += 1
+                elif len(held) > args.window:
+                    nxt = min(held)
+                    note("lost datagrams %d..%d" % (expected, nxt - 1))
+                    stats["lost"] += nxt - expected
+                    expected = nxt
+                else:
+                    break
+    except KeyboardInterrupt:
+        note(", ".join("%s %d" % kv for kv in stats.items()) + ", hub dropped %d bytes" % dropped_seen)
+
+
+if __name__ == "__main__":
+    main()
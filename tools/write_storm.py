@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""Storm the hub with interleaved HomeKit writes and device reports, then check that it ends up consistent.
+
+Needs firmware built with `--build-var BENCH=1`, for Hub.Inject, and the devices of `tools/twinkly_sim.py serve
+--control` added to the hub. From several clients at once, every step is one of:
+
+  - a HomeKit write of on or brightness, through the characteristic write handlers (Hub.Inject)
+  - a late device report, a value the device had earlier, through the Twinkly event handler (Hub.Inject report)
+  - a change made in the Twinkly app, on the emulated device itself (sim /set), which the hub learns by polling
+
+Afterwards the hub must agree with every emulated device within --settle seconds. Commands with no effect are
+counted twice: by the emulated devices (writes that did not change the value) and by the hub (Hub.Stats
+commands.redundant). Exits with 1 if the state does not converge or either ratio is over --threshold.
+
+    tools/write_storm.py --hub http://192.168.1.10 --sim http://192.168.1.2:8099 --steps 2000 --clients 4
+"""
+
+import argparse
+import json
+import random
+import sys
+import threading
+import time
+import urllib.error
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
+
+
+def post(url, params=None, timeout=15):
+    data = json.dumps(params).encode() if params is not None else None
+    req = urllib.request.Request(url, data=data, headers={"Content-Type": "application/json"})
+    with urllib.request.urlopen(req, timeout=timeout) as resp:
+        return json.loads(resp.read() or b"null")
+
+
+def rpc(hub, method, params=None):
+    return post(hub.rstrip("/") + "/rpc/" + method, params)
+
+
+def sim_state(sim):
+    return {d["ip"]: d for d in post(sim.rstrip("/") + "/state")}
+
+
+def devices(args):
+    """Hub index and address of the emulated devices the hub knows"""
+    sim = sim_state(args.sim)
+    listed = [next(iter(item)) for item in rpc(args.hub, "Twinkly.List") or []]
+    return [(i, ip) for i, ip in enumerate(listed) if ip in sim]
+
+
+def mismatches(args, devs):
+    hub = {d["index"]: d for d in rpc(args.hub, "Hub.State")}
+    sim = sim_state(args.sim)
+    bad = []
+    for index, ip in devs:
+        h, s = hub.get(index), sim[ip]
+        if h is None or h["on"]["value"] != s["on"] or h["brightness"]["value"] != s["brightness"]:
+            bad.append((index, ip, h and (h["on"]["value"], h["brightness"]["value"]), (s["on"], s["brightness"])))
+    return bad
+
+
+def storm(args, devs):
+    history = {index: [] for index, _ in devs}  # values each device had, for late reports
+    lock = threading.Lock()
+    counts = {"write": 0, "report": 0, "external": 0, "errors": 0}
+    steps = iter(range(args.steps))
+
+    def client(seed):
+        rnd = random.Random(seed)
+        for _ in steps:
+            index, ip = rnd.choice(devs)
+            on = rnd.random() < 0.5
+            brightness = rnd.choice([rnd.randint(1, 100), 25, 50, 100])  # repeats are likely, like a slider
+            what = {"on": on} if rnd.random() < 0.5 else {"brightness": brightness}
+            op = rnd.random()
+            try:
+                if op < args.reports:
+                    with lock:
+                        past = history[index][-4:]
+                    if not past:
+                        continue
+                    rpc(args.hub, "Hub.Inject", dict(rnd.choice(past), index=index, report=True))
+                    kind = "report"
+                elif op < args.reports + args.external:
+                    post(args.sim.rstrip("/") + "/set", dict(what, ip=ip))
+                    kind = "external"
+                else:
+                    rpc(args.hub, "Hub.Inject", dict(what, index=index))
+                    kind = "write"
+                with lock:
+                    counts[kind] += 1
+                    history[index].append(what)
+            except (urllib.error.URLError, OSError, ValueError):
+                with lock:
+                    counts["errors"] += 1
+            time.sleep(rnd.uniform(0, args.delay) / 1000)
+
+    with ThreadPoolExecutor(args.clients) as pool:
+        for i in range(args.clients):
+            pool.submit(client, args.seed + i)
+    return counts
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--hub", required=True, help="hub URL, e.g. http://192.168.1.10")
+    ap.add_argument("--sim", required=True, help="control URL of tools/twinkly_sim.py serve --control")
+    ap.add_argument("--steps", type=int, default=1000)
+    ap.add_argument("--clients", type=int, default=4, help="concurrent clients")
+    ap.add_argument("--delay", type=float, default=50.0, help="random pause after each step up to this, ms")
+    ap.add_argument("--reports", type=float, default=0.2, help="fraction of steps that are late device reports")
+    ap.add_argument("--external", type=float, default=0.1, help="fraction of steps that are Twinkly app changes")
+    ap.add_argument("--settle", type=float, default=60.0, help="seconds the hub gets to converge")
+    ap.add_argument("--threshold", type=float, default=10.0, help="allowed share of commands with no effect, %%")
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+
+    devs = devices(args)
+    if not devs:
+        sys.stderr.write("none of the emulated devices is on the hub, add them with twinkly_sim.py load --add\n")
+        return 2
+    sim_before = sim_state(args.sim)
+    rpc(args.hub, "Hub.Stats", {"reset": True})
+    started = time.monotonic()
+    counts = storm(args, devs)
+    took = time.monotonic() - started
+    print("%d steps on %d devices in %.1f s: %d writes, %d late reports, %d app changes, %d errors" %
+          (args.steps, len(devs), took, counts["write"], counts["report"], counts["external"], counts["errors"]))
+
+    deadline = time.monotonic() + args.settle
+    bad = mismatches(args, devs)
+    while bad and time.monotonic() < deadline:
+        time.sleep(1)
+        bad = mismatches(args, devs)
+    failed = False
+    if bad:
+        failed = True
+        print("NOT CONSISTENT after %.0f s:" % args.settle)
+        for index, ip, hub, dev in bad:
+            print("  %d %s hub (on, brightness) %s, device %s" % (index, ip, hub, dev))
+    else:
+        print("consistent %.1f s after the storm" % (args.settle - max(0.0, deadline - time.monotonic())))
+
+    sim_after = sim_state(args.sim)
+    writes = sum(sim_after[ip]["writes"] - sim_before[ip]["writes"] for _, ip in devs)
+    noop = sum(sim_after[ip]["noop_writes"] - sim_before[ip]["noop_writes"] for _, ip in devs)
+    cmd = rpc(args.hub, "Hub.Stats")["commands"]
+    ratios = [("device writes with no effect", noop, writes),
+              ("hub commands counted redundant", cmd["redundant"], cmd["sent"])]
+    for name, n, total in ratios:
+        pct = 100.0 * n / total if total else 0.0
+        over = pct > args.threshold
+        failed = failed or over
+        print("%-32s %6d of %6d  %5.1f%%%s" % (name, n, total, pct, "  OVER THRESHOLD" if over else ""))
+    print("hub commands: %s" % json.dumps(cmd))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())